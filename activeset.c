@@ -0,0 +1,102 @@
+/*
+ *
+ * activeset.c
+ *
+ * Event-driven synaptic propagation. A presynaptic cell only contributes
+ * current while its synaptic variables are nonzero, which in a CPG is a
+ * handful of cells at any one time, so instead of walking every synapse
+ * each step we keep the set of cells that have spiked recently and only
+ * accumulate their fan-out. A cell joins the set when it spikes (see
+ * check_spikes_all) and leaves once its i and j have both decayed below
+ * ACTIVE_EPSILON, after which they only ever decay further until it
+ * spikes again. What's dropped is at most g*|vn - v|*ACTIVE_EPSILON per
+ * synapse, well under a thousandth of a pA for any of our networks.
+ *
+ */
+
+#include "libneurobot.h"
+
+
+static bool quiescent(const struct network *net, int cell)
+{
+    return fabsf(net->i[cell]) < ACTIVE_EPSILON
+        && fabsf(net->j[cell]) < ACTIVE_EPSILON;
+}
+
+
+/*
+ * Start tracking activity, entering every cell that's already active,
+ * so this can go anywhere before the loop.
+ */
+void start_active_set(struct network *net)
+{
+    struct active_set *set = malloc(sizeof *set);
+    if (set) set->cells = malloc(net->n * sizeof *set->cells);
+    if (set) set->slot = malloc(net->n * sizeof *set->slot);
+    if (!set || !set->cells || !set->slot)
+        die("Couldn't allocate active set", NULL);
+
+    set->n = 0;
+    for (int i = 0; i < net->n; i++) set->slot[i] = -1;
+    net->active = set;
+
+    for (int i = 0; i < net->n; i++)
+        if (!quiescent(net, i)) activate_cell(net, i);
+}
+
+
+/*
+ * Enter a cell into the active set. Anything that pokes a cell's
+ * synaptic variables from outside needs to call this too, as
+ * kick_cell() does.
+ */
+void activate_cell(struct network *net, int cell)
+{
+    struct active_set *set = net->active;
+    if (!set || set->slot[cell] >= 0) return;
+    set->slot[cell] = set->n;
+    set->cells[set->n++] = cell;
+}
+
+
+/* Take the kth cell out of the set by moving the last one into its place. */
+static void retire(struct active_set *set, int k)
+{
+    int cell = set->cells[k], last = set->cells[--set->n];
+    set->cells[k] = last;
+    set->slot[last] = k;
+    set->slot[cell] = -1;
+}
+
+
+/*
+ * The same currents as synaptic_currents(), scattered out from the
+ * active cells rather than gathered in over every synapse. The
+ * fixed-point engine has no active set and always gathers.
+ */
+void active_synaptic_currents(const struct fanout *fanout,
+        struct network *net, float *i_in)
+{
+    if (net->fixed) {
+        fixed_synaptic_currents(net, i_in);
+        return;
+    }
+
+    memset(i_in, 0, net->n * sizeof *i_in);
+
+    struct active_set *set = net->active;
+    for (int k = 0; k < set->n; ) {
+        int pre = set->cells[k];
+        if (quiescent(net, pre)) {
+            retire(set, k);
+            continue;
+        }
+
+        float i_pre = net->i[pre] * g_conductance_scale;
+        for (int s = fanout->col[pre]; s < fanout->col[pre+1]; s++) {
+            const struct synapse_out *o = &fanout->out[s];
+            i_in[o->post] += o->g * (o->vn - net->v[o->post]) * i_pre;
+        }
+        k++;
+    }
+}
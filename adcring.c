@@ -0,0 +1,92 @@
+/*
+ *
+ * adcring.c
+ *
+ * Consumer side of a continuously sampled ADC ring buffer. Something
+ * else (the PRU in ring-buffer mode, or a software stand-in) keeps
+ * writing interleaved samples into the ring and advancing a write
+ * index; once per step we pick up everything new since last time and
+ * boil it down to one value per channel, so the loop never has to wait
+ * for a conversion.
+ *
+ * The write index wraps with the ring, so on its own it can't tell a
+ * ring the producer has lapped since the last poll from one it has
+ * barely written to. The time between polls can: a poll that comes
+ * late enough for the ring to have (nearly) filled up takes everything
+ * in it as new and counts an overrun.
+ *
+ */
+
+#include "libneurobot.h"
+
+
+void adc_ring_init(struct adc_ring *ring, const volatile uint16_t *values,
+        const volatile uint32_t *write_index, uint32_t n_samples,
+        int n_channels, int rate_hz, bool average)
+{
+    memset(ring, 0, sizeof *ring);
+    ring->values = values;
+    ring->write_index = write_index;
+    ring->length = n_samples * n_channels;
+    ring->n_channels = n_channels;
+    ring->rate_hz = rate_hz;
+    ring->average = average;
+    ring->read_index = *write_index % ring->length;
+    ring->read_index -= ring->read_index % n_channels;
+}
+
+
+/*
+ * Fold every complete sample written since the last poll into the
+ * per-channel outputs: either the newest sample, or the mean of all
+ * the new ones, which decimates the ring down to the loop rate. If
+ * nothing new has arrived, the outputs keep their previous values.
+ * Returns the number of samples consumed.
+ */
+int adc_ring_poll(struct adc_ring *ring, uint64_t now_ns)
+{
+    uint32_t write = *ring->write_index % ring->length;
+    write -= write % ring->n_channels;
+
+    /* Don't read the samples before the index that says they're there. */
+    __sync_synchronize();
+
+    uint32_t index = ring->read_index;
+    uint32_t available = (write + ring->length - index) % ring->length;
+
+    /*
+     * Lapped, or near enough: all of the ring is new but the oldest
+     * sample, which the producer is about to write over.
+     */
+    uint32_t ring_samples = ring->length / ring->n_channels;
+    if (ring->rate_hz && ring->polled_ns
+            && (now_ns - ring->polled_ns) * ring->rate_hz
+                >= (uint64_t)ADC_RING_SAFE_SAMPLES(ring_samples)
+                    * NS_PER_SEC) {
+        index = (write + ring->n_channels) % ring->length;
+        available = ring->length - ring->n_channels;
+        ring->overruns++;
+    }
+    ring->polled_ns = now_ns;
+
+    int n_samples = available / ring->n_channels;
+    if (n_samples == 0) return 0;
+
+    uint32_t sums[ADC_MAX_CHANNELS] = {0};
+    uint16_t newest[ADC_MAX_CHANNELS] = {0};
+    for (int k = 0; k < n_samples; k++) {
+        for (int c = 0; c < ring->n_channels; c++) {
+            newest[c] = ring->values[index + c];
+            sums[c] += newest[c];
+        }
+        index = (index + ring->n_channels) % ring->length;
+    }
+
+    for (int c = 0; c < ring->n_channels; c++) {
+        float raw = ring->average ? (float)sums[c] / n_samples : newest[c];
+        ring->value[c] = raw / (1<<12);
+    }
+
+    ring->read_index = write;
+    return n_samples;
+}
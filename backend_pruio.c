@@ -0,0 +1,147 @@
+/*
+ *
+ * backend_pruio.c
+ *
+ * The real hardware: ADC, PWM and GPIO on the BeagleBone through the
+ * PRU using libpruio.
+ *
+ */
+
+#include <libpruio/pruio.h>
+#include <libpruio/pruio_pins.h>
+
+#include "libneurobot.h"
+
+
+pruIo *g_pru = NULL;
+uint8_t g_pinmodes[4] = {};
+
+const int pwm_pins[4] = {
+    P9_31, P9_29, P9_14, P9_16
+};
+
+const int gpio_pins[4] = {
+    P8_07, P8_08, P8_10, P8_09
+};
+
+
+static void pruio_setup(int stream_hz, struct adc_ring *ring)
+{
+    /*
+     * Create the device driver object.
+     * The first parameter is a 16-bit mask specifying which
+     * subsystems to activate; here, we turn them all on.
+     * Next is an exponential moving-average filter time
+     * constant, in sample numbers, followed by the delay
+     * in cycles between configuration and the start of
+     * ADC readings; finally, a sample delay describing
+     * how long to wait between reading the ADC. It's probably
+     * wasteful to leave this at 0 considering how slowly we
+     * sample, but for now it'll do...
+     */
+    g_pru = pruio_new(PRUIO_DEF_ACTIVE, 4, 0x98, 0);
+    if (!g_pru) {
+        perror(NULL);
+        exit(1);
+    }
+
+    if (g_pru->Errr)
+        die("PruIO initialization failed", g_pru->Errr);
+
+    /*
+     * Save a constant necessary for correctly setting GPIOs.
+     * I still don't know why it works this way, but for
+     * some reason, you have to set the pin to pinmode|128
+     * to turn it on, or just pinmode to turn it off.
+     */
+    for (int i = 0; i < 4; i++) {
+        g_pinmodes[i] = g_pru->BallConf[gpio_pins[i]];
+    }
+
+    /*
+     * Initialize the four PWM pins corresponding to the
+     * motors' enable lines. These begin at 0% duty cycle.
+     */
+    for (int i = 0; i < 4; i++) {
+        if (pruio_pwm_setValue(g_pru, pwm_pins[i], PWM_FREQ_HZ, 0))
+            die("Couldn't set PWM", g_pru->Errr);
+    }
+
+    /*
+     * Send the config to the PRU. The parameters set the
+     * driver to IO mode (i.e. sampling on demand), activate
+     * the four ADC channels we're actually using, give zero
+     * sampling frequency because that's not used in IO mode,
+     * and say to return raw 12-bit values.
+     */
+    if (!stream_hz) {
+        if (pruio_config(g_pru, 1, 0xF<<1, 0, 0))
+            die("Config failed", g_pru->Errr);
+        return;
+    }
+
+    /*
+     * Or, in streaming mode, have the PRU sample the same four
+     * channels continuously at the given rate into a ring of
+     * ADC_RING_SAMPLES samples. DRam[0] tracks where it's writing.
+     */
+    if (pruio_config(g_pru, ADC_RING_SAMPLES, 0xF<<1,
+                NS_PER_SEC / stream_hz, 0))
+        die("Config failed", g_pru->Errr);
+    if (pruio_rb_start(g_pru))
+        die("Couldn't start ring buffer mode", g_pru->Errr);
+    adc_ring_init(ring, g_pru->Adc->Value, &g_pru->DRam[0],
+            ADC_RING_SAMPLES, 4, stream_hz, g_adc_average);
+}
+
+
+static uint16_t pruio_read_adc(int i)
+{
+    return g_pru->Adc->Value[i+1];
+}
+
+
+/*
+ * Set the PWM duty cycle. The argument of -1 says to keep the
+ * frequency the same.
+ */
+static void pruio_set_pwm(int i, float duty_cycle)
+{
+    if (pruio_pwm_setValue(g_pru, pwm_pins[i], -1, duty_cycle))
+        die("Couldn't set PWM A", g_pru->Errr);
+}
+
+
+static void pruio_set_direction(int i, bool negative)
+{
+    int mask = (negative?0:128) | g_pinmodes[i];
+    if (pruio_gpio_setValue(g_pru, gpio_pins[i], mask))
+        die("Couldn't do GPIO", g_pru->Errr);
+}
+
+
+static void pruio_cleanup()
+{
+    /* Zero all the PWMs first because if left nonzero, they will do
+     * horrible things. */
+    for (int i = 0; i < 4; i++) {
+        if (pruio_pwm_setValue(g_pru, pwm_pins[i], -1, 0))
+            die("Couldn't set PWM", g_pru->Errr);
+    }
+
+    /* Sleep for 100ms to leave some space to shut down. */
+    usleep(100000);
+
+    /* Reset the PRU state */
+    pruio_destroy(g_pru);
+}
+
+
+const struct backend pruio_backend = {
+    .name = "pruio",
+    .setup = pruio_setup,
+    .read_adc = pruio_read_adc,
+    .set_pwm = pruio_set_pwm,
+    .set_direction = pruio_set_direction,
+    .cleanup = pruio_cleanup
+};
@@ -0,0 +1,155 @@
+/*
+ *
+ * backend_sim.c
+ *
+ * A simulated robot, so that the controllers can be built, run and
+ * profiled on any Linux machine. Each actuator is a position in [0,1]
+ * which moves at a speed proportional to its signed duty cycle; that's
+ * crude, but it's enough to close the proprioceptive feedback loop.
+ * Positions advance with the loop's simulated time rather than the
+ * wall clock, so a run behaves the same however fast it goes.
+ *
+ * In streaming mode a background thread plays the part of the PRU,
+ * writing samples into a ring at the requested rate.
+ *
+ */
+
+#include <pthread.h>
+
+#include "libneurobot.h"
+
+
+/* How often the stand-in for the PRU wakes up to write samples. */
+#define SIM_STREAM_WAKE_US 200
+
+
+/* The stream thread reads the plant too, hence the lock. */
+static pthread_mutex_t g_sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static float g_position[4], g_duty[4];
+static bool g_negative[4];
+static long g_sim_step = 0;
+
+static int g_stream_hz = 0;
+static uint16_t g_stream_values[ADC_RING_SAMPLES * 4];
+static uint32_t g_stream_write = 0;
+static bool g_stream_stopping = false;
+static pthread_t g_stream_thread;
+
+
+/*
+ * Move the simulated actuators on by dt_s seconds under the given
+ * signed duty cycles. The parameter sweep uses this too.
+ */
+void plant_advance(float position[4], const float signed_duty[4], float dt_s)
+{
+    for (int i = 0; i < 4; i++) {
+        float x = position[i] + SIM_SPEED*signed_duty[i]*dt_s;
+        position[i] = x < 0 ? 0 : x > 1 ? 1 : x;
+    }
+}
+
+
+/* Bring the plant up to the I/O's current step. Hold the lock. */
+static void advance_plant()
+{
+    long step = io_step();
+    float dt_s = (step - g_sim_step) * dt_ms() / MS_PER_SEC;
+    g_sim_step = step;
+
+    float signed_duty[4];
+    for (int i = 0; i < 4; i++)
+        signed_duty[i] = g_negative[i] ? -g_duty[i] : g_duty[i];
+    plant_advance(g_position, signed_duty, dt_s);
+}
+
+
+static uint16_t sim_read_adc(int i)
+{
+    pthread_mutex_lock(&g_sim_lock);
+    advance_plant();
+    uint16_t raw = g_position[i] * ((1<<12) - 1) + 0.5f;
+    pthread_mutex_unlock(&g_sim_lock);
+    return raw;
+}
+
+
+/*
+ * Write however many samples are due since the last wakeup, then
+ * publish the new write index, the same contract as the PRU's DRam[0].
+ */
+static void *stream_samples(void *arg)
+{
+    (void)arg;
+    demote_thread();
+
+    uint32_t length = ADC_RING_SAMPLES * 4;
+    uint64_t period_ns = NS_PER_SEC / g_stream_hz;
+    uint64_t next_ns = now_ns();
+
+    while (!__atomic_load_n(&g_stream_stopping, __ATOMIC_ACQUIRE)) {
+        uint32_t write = g_stream_write;
+        for (uint64_t now = now_ns(); next_ns <= now; next_ns += period_ns) {
+            for (int c = 0; c < 4; c++)
+                g_stream_values[write + c] = sim_read_adc(c);
+            write = (write + 4) % length;
+        }
+        __atomic_store_n(&g_stream_write, write, __ATOMIC_RELEASE);
+        usleep(SIM_STREAM_WAKE_US);
+    }
+    return NULL;
+}
+
+
+static void sim_setup(int stream_hz, struct adc_ring *ring)
+{
+    for (int i = 0; i < 4; i++) {
+        g_position[i] = SIM_START_POSITION;
+        g_duty[i] = 0;
+        g_negative[i] = false;
+    }
+    g_sim_step = io_step();
+
+    g_stream_hz = stream_hz;
+    if (!stream_hz) return;
+
+    adc_ring_init(ring, g_stream_values, &g_stream_write,
+            ADC_RING_SAMPLES, 4, stream_hz, g_adc_average);
+    if (pthread_create(&g_stream_thread, NULL, stream_samples, NULL))
+        die("Couldn't start simulated ADC stream", NULL);
+}
+
+
+static void sim_set_pwm(int i, float duty_cycle)
+{
+    pthread_mutex_lock(&g_sim_lock);
+    advance_plant();
+    g_duty[i] = duty_cycle;
+    pthread_mutex_unlock(&g_sim_lock);
+}
+
+
+static void sim_set_direction(int i, bool negative)
+{
+    pthread_mutex_lock(&g_sim_lock);
+    advance_plant();
+    g_negative[i] = negative;
+    pthread_mutex_unlock(&g_sim_lock);
+}
+
+
+static void sim_cleanup()
+{
+    if (!g_stream_hz) return;
+    __atomic_store_n(&g_stream_stopping, true, __ATOMIC_RELEASE);
+    pthread_join(g_stream_thread, NULL);
+}
+
+
+const struct backend sim_backend = {
+    .name = "sim",
+    .setup = sim_setup,
+    .read_adc = sim_read_adc,
+    .set_pwm = sim_set_pwm,
+    .set_direction = sim_set_direction,
+    .cleanup = sim_cleanup
+};
@@ -31,6 +31,11 @@ class DoubleCPG(cpg.CPGBase):
     def muscle_activations(self):
         return self.V[-4:] - np.roll(self.V[-4:], 2)
 
+    def feedback_taps(self):
+        # The reverse CPG runs the other way around the body.
+        return [(cell, next, prev) if cell >= 12 else (cell, prev, next)
+                for cell, prev, next in super().feedback_taps()]
+
 
 class DoubleFeedbackCPG(DoubleCPG):
     def propriocept(self, pos):
@@ -49,7 +54,22 @@ if __name__ == '__main__':
     parser = argparse.ArgumentParser(
             description='Generate C code for a forward CPG.')
     parser.add_argument('file', help='output filename')
+    parser.add_argument('--step', action='store_true',
+            help='emit a specialized step function instead of the data')
+    parser.add_argument('--binary', action='store_true',
+            help='write a binary network file for the cpg controller')
+    parser.add_argument('--trace', type=int, metavar='STEPS',
+            help='run the Python model open loop and write its voltages')
+    parser.add_argument('--dt', type=float, default=0.5,
+            help='timestep in ms for --step and --trace')
     args = parser.parse_args()
 
-    with open(args.file, 'w') as f:
-        DoubleCPG().dump_source(f)
+    with open(args.file, 'wb' if args.binary else 'w') as f:
+        if args.binary:
+            DoubleCPG().dump_binary(f)
+        elif args.trace:
+            DoubleCPG().dump_trace(f, args.trace, args.dt)
+        elif args.step:
+            DoubleCPG().dump_step(f, args.dt)
+        else:
+            DoubleCPG().dump_source(f)
@@ -0,0 +1,404 @@
+/*
+ *
+ * bench.c
+ *
+ * Microbenchmarks of the ways of stepping a network, on one generated
+ * CPG; like the sweep, it's built per network ("make bench_forwards").
+ * Every engine runs the same closed loop against the simulated
+ * actuators from the same initial state, and reports its best time per
+ * step over a few runs, along with how far its voltages stray from the
+ * first engine's over the first stretch of the run, before the
+ * dynamics have had time to amplify rounding differences.
+ *
+ * The engines are the dense matrix the controllers started out with,
+ * the sparse CSR gather, event-driven propagation from the active
+ * cells, and the fully unrolled network_step() cpgcompiler.py
+ * generates with --step. All but the last use whichever integrator
+ * and timestep the usual options select. With -c, it exits with an
+ * error if any engine strays further than the given number of mV; this
+ * is how "make check" holds the faster engines to the dense one.
+ *
+ * With -a, it instead compares the integrators against a reference run
+ * of RK4 at REFERENCE_DT_US over the first COMPARE_STEPS steps:
+ * the RMS voltage error, which is mostly down to spikes landing on
+ * different steps, the number of spikes and the mean error in their
+ * timing, and the cost. The closed loop can turn one marginal spike
+ * into a different gait, so -k 0, which opens it, is the fairer test
+ * of the integrators themselves.
+ *
+ */
+
+#include "libneurobot.h"
+
+#include NETWORK
+#include NETWORK_STEP
+
+#define DEFAULT_FEEDBACK 25
+#define DEFAULT_STEPS 100000
+#define DEFAULT_REPEATS 5
+
+/* Steps over which engines are compared against the first one. */
+#define COMPARE_STEPS 2000
+
+/* The timestep of the reference for the integrator comparison. */
+#define REFERENCE_DT_US 10
+
+/* Spikes per cell whose timing is compared. */
+#define MAX_SPIKES 256
+
+
+/* Init returns whether the engine can run with the current settings. */
+struct engine {
+    const char *name;
+    bool (*init)();
+    int (*step)(const float *position, float feedback, float *activation);
+};
+
+/* How one run went, compared against the recorded reference. */
+struct outcome {
+    uint64_t ns;
+    float max_diff;
+    double sum_sq_diff;
+    long n_compared, spikes;
+    float spike_dt;
+};
+
+static SIMD_ALIGN float g_i_in[N_PADDED];
+
+/* The network as it was generated, to start every run from. */
+static SIMD_ALIGN float g_v0[N_PADDED], g_u0[N_PADDED];
+static SIMD_ALIGN float g_i0[N_PADDED], g_j0[N_PADDED];
+
+static float g_reference[COMPARE_STEPS][N_CELLS];
+static long g_active_total = 0;
+
+/* Spike times in ms, if they're being tracked, and the reference's. */
+static bool g_track_spikes = false;
+static bool g_fired[N_PADDED];
+static float g_spike_ms[N_CELLS][MAX_SPIKES];
+static float g_ref_spike_ms[N_CELLS][MAX_SPIKES];
+static int g_n_spikes[N_CELLS], g_n_ref_spikes[N_CELLS];
+
+
+static void activations(float *activation)
+{
+    for (int m = 0; m < N_MOTORS; m++)
+        activation[m] = motor_activation(&network, &motors[m]);
+}
+
+
+/*
+ * What the controllers did before synapses were stored sparsely: every
+ * cell against every other through a full N_CELLS^2 matrix.
+ */
+static float g_dense[N_CELLS][N_CELLS];
+static float g_dense_vn[N_CELLS];
+
+static bool dense_init()
+{
+    memset(g_dense, 0, sizeof g_dense);
+    for (int i = 0; i < N_CELLS; i++)
+        for (int k = synapse_rows[i]; k < synapse_rows[i+1]; k++) {
+            g_dense[i][synapse_list[k].pre] = synapse_list[k].g;
+            g_dense_vn[synapse_list[k].pre] = synapse_list[k].vn;
+        }
+    return true;
+}
+
+static int dense_step(const float *position, float feedback,
+        float *activation)
+{
+    int fired = check_spikes_all(&network, NULL);
+    for (int i = 0; i < N_CELLS; i++) {
+        float i_syn = 0;
+        for (int j = 0; j < N_CELLS; j++)
+            i_syn += g_dense[i][j] * (g_dense_vn[j] - network.v[i])
+                * network.i[j];
+        g_i_in[i] = i_syn;
+    }
+    feedback_currents(feedback_taps, N_FEEDBACK, position, feedback, g_i_in);
+    resolve_dynamics_all(&network, g_i_in);
+    activations(activation);
+    return fired;
+}
+
+
+static bool csr_init()
+{
+    return true;
+}
+
+static int csr_step(const float *position, float feedback,
+        float *activation)
+{
+    int fired = check_spikes_all(&network, g_track_spikes ? g_fired : NULL);
+    synaptic_currents(&synapses, &network, g_i_in);
+    feedback_currents(feedback_taps, N_FEEDBACK, position, feedback, g_i_in);
+    resolve_dynamics_all(&network, g_i_in);
+    activations(activation);
+    return fired;
+}
+
+
+static bool event_init()
+{
+    start_active_set(&network);
+    return true;
+}
+
+static int event_step(const float *position, float feedback,
+        float *activation)
+{
+    int fired = check_spikes_all(&network, NULL);
+    active_synaptic_currents(&fanout, &network, g_i_in);
+    g_active_total += network.active->n;
+    feedback_currents(feedback_taps, N_FEEDBACK, position, feedback, g_i_in);
+    resolve_dynamics_all(&network, g_i_in);
+    activations(activation);
+    return fired;
+}
+
+
+/* This one has the midpoint method and its timestep built in. */
+static bool unrolled_init()
+{
+    return g_dt_us == NETWORK_STEP_DT_US && g_substeps == 1
+        && g_integrator == INTEGRATE_MIDPOINT;
+}
+
+static int unrolled_step(const float *position, float feedback,
+        float *activation)
+{
+    return network_step(position, feedback, activation);
+}
+
+
+static const struct engine engines[] = {
+    {"dense", dense_init, dense_step},
+    {"csr", csr_init, csr_step},
+    {"event", event_init, event_step},
+    {"unrolled", unrolled_init, unrolled_step},
+};
+#define N_ENGINES (int)(sizeof engines / sizeof *engines)
+
+
+static void reset_network()
+{
+    memcpy(network.v, g_v0, sizeof g_v0);
+    memcpy(network.u, g_u0, sizeof g_u0);
+    memcpy(network.i, g_i0, sizeof g_i0);
+    memcpy(network.j, g_j0, sizeof g_j0);
+    memset(g_i_in, 0, sizeof g_i_in);
+    if (network.fired_early)
+        memset(network.fired_early, 0, N_PADDED * sizeof(int32_t));
+    if (network.active) {
+        free(network.active->cells);
+        free(network.active->slot);
+        free(network.active);
+        network.active = NULL;
+    }
+    network.v[0] = 0;
+}
+
+
+/*
+ * One closed-loop run. The voltages at the end of every stride steps,
+ * up to COMPARE_STEPS of them, are either recorded as the reference or
+ * compared against it.
+ */
+static void run(const struct engine *e, long n_steps, float feedback,
+        int stride, bool record, struct outcome *out)
+{
+    reset_network();
+    e->init();
+
+    float position[4], signed_duty[4], activation[N_MOTORS];
+    for (int a = 0; a < 4; a++) position[a] = SIM_START_POSITION;
+    float dt_s = dt_ms() / MS_PER_SEC;
+    long n_compared = (long)COMPARE_STEPS * stride;
+
+    memset(out, 0, sizeof *out);
+    memset(g_n_spikes, 0, sizeof g_n_spikes);
+    uint64_t start_ns = now_ns();
+    for (long step = 0; step < n_steps; step++) {
+        int fired = e->step(position, feedback, activation);
+
+        for (int m = 0; m < N_MOTORS && m < 4; m++) {
+            float a = activation[m];
+            if (a > 1) a = 1;
+            if (a < -1) a = -1;
+            signed_duty[m] = a * g_pwm_max;
+        }
+        plant_advance(position, signed_duty, dt_s);
+
+        if (step >= n_compared) continue;
+        out->spikes += fired;
+        for (int c = 0; g_track_spikes && fired && c < N_CELLS; c++)
+            if (g_fired[c] && g_n_spikes[c] < MAX_SPIKES)
+                g_spike_ms[c][g_n_spikes[c]++] = step * dt_ms();
+        if ((step + 1) % stride) continue;
+
+        float *reference = g_reference[(step + 1)/stride - 1];
+        for (int c = 0; c < N_CELLS; c++) {
+            if (record) reference[c] = network.v[c];
+            float diff = fabsf(network.v[c] - reference[c]);
+            if (diff > out->max_diff) out->max_diff = diff;
+            out->sum_sq_diff += diff*diff;
+            out->n_compared++;
+        }
+    }
+    out->ns = now_ns() - start_ns;
+
+    if (record) {
+        memcpy(g_ref_spike_ms, g_spike_ms, sizeof g_spike_ms);
+        memcpy(g_n_ref_spikes, g_n_spikes, sizeof g_n_spikes);
+    }
+
+    /* Pair up each cell's spikes with the reference's in order. */
+    double sum_dt = 0;
+    long n_paired = 0;
+    for (int c = 0; g_track_spikes && c < N_CELLS; c++) {
+        int n = g_n_spikes[c] < g_n_ref_spikes[c] 
+            ? g_n_spikes[c] : g_n_ref_spikes[c];
+        for (int k = 0; k < n; k++)
+            sum_dt += fabsf(g_spike_ms[c][k] - g_ref_spike_ms[c][k]);
+        n_paired += n;
+    }
+    out->spike_dt = n_paired ? sum_dt / n_paired : NAN;
+}
+
+
+/* The best of several runs, keeping the comparison from the first. */
+static void best_run(const struct engine *e, long n_steps, float feedback,
+        int n_repeats, bool record, struct outcome *out)
+{
+    struct outcome o;
+    for (int r = 0; r < n_repeats; r++) {
+        run(e, n_steps, feedback, 1, record && r == 0, &o);
+        if (r == 0) *out = o;
+        if (o.ns < out->ns) out->ns = o.ns;
+    }
+}
+
+
+/* Returns the furthest any engine strayed from the first. */
+static float compare_engines(long n_steps, float feedback, int n_repeats)
+{
+    printf("%d cells, %d synapses, %ld steps of %gms, %s x%d, "
+            "best of %d.\n", N_CELLS, N_SYNAPSES, n_steps, dt_ms(),
+            integrator_names[g_integrator], g_substeps, n_repeats);
+    printf("%-8s %10s %10s %12s\n", "engine", "ns/step", "speedup",
+            "max dV (mV)");
+
+    uint64_t reference_ns = 0;
+    float worst = 0;
+    for (int e = 0; e < N_ENGINES; e++) {
+        if (!engines[e].init()) {
+            printf("%-8s %10s\n", engines[e].name, "(n/a)");
+            continue;
+        }
+
+        struct outcome o;
+        g_active_total = 0;
+        best_run(&engines[e], n_steps, feedback, n_repeats, e == 0, &o);
+        if (e == 0) reference_ns = o.ns;
+        if (o.max_diff > worst) worst = o.max_diff;
+
+        printf("%-8s %10.1f %9.2fx %12.3g", engines[e].name,
+                (double)o.ns / n_steps, (double)reference_ns / o.ns,
+                o.max_diff);
+        if (g_active_total)
+            printf("   (%.2f of %d cells active on average)",
+                    (double)g_active_total / (n_steps * n_repeats), N_CELLS);
+        printf("\n");
+    }
+    return worst;
+}
+
+
+/*
+ * Every integrator with and without the selected substeps, on the CSR
+ * engine, against RK4 with a very small timestep.
+ */
+static void compare_integrators(long n_steps, float feedback, int n_repeats)
+{
+    const struct engine *csr = &engines[1];
+    int dt_us = g_dt_us, substeps = g_substeps > 1 ? g_substeps : 4;
+    if (dt_us % REFERENCE_DT_US)
+        die("Timestep isn't a multiple of the reference's", NULL);
+    int stride = dt_us / REFERENCE_DT_US;
+
+    struct outcome ref;
+    g_track_spikes = true;
+    g_integrator = INTEGRATE_RK4;
+    g_substeps = 1;
+    g_dt_us = REFERENCE_DT_US;
+    run(csr, (long)COMPARE_STEPS * stride, feedback, stride, true, &ref);
+    g_dt_us = dt_us;
+
+    printf("%d cells, %ld steps of %gms, best of %d; reference RK4 at "
+            "%gms had %ld spikes.\n", N_CELLS, n_steps, dt_ms(), n_repeats,
+            (float)REFERENCE_DT_US / US_PER_MS, ref.spikes);
+    printf("%-10s %8s %10s %12s %8s %14s\n", "integrator", "substeps",
+            "ns/step", "RMS dV (mV)", "spikes", "spike dt (ms)");
+
+    for (int m = 0; m < N_INTEGRATORS; m++) {
+        for (int sub = 1; sub <= substeps; sub += substeps - 1) {
+            g_integrator = m;
+            g_substeps = sub;
+
+            struct outcome o;
+            best_run(csr, n_steps, feedback, n_repeats, false, &o);
+            printf("%-10s %8d %10.1f %12.3g %8ld %14.3g\n",
+                    integrator_names[m], sub, (double)o.ns / n_steps,
+                    sqrt(o.sum_sq_diff / o.n_compared), o.spikes,
+                    o.spike_dt);
+        }
+    }
+}
+
+
+int main(int argc, char **argv)
+{
+    float feedback = DEFAULT_FEEDBACK;
+    long n_steps = DEFAULT_STEPS;
+    int n_repeats = DEFAULT_REPEATS;
+    bool integrators = false;
+    float tolerance = INFINITY;
+
+    int opt;
+    char *endptr;
+    while ((opt = getopt(argc, argv, COMMON_OPTIONS "k:n:r:ac:")) != -1) {
+        if (opt == 'k') {
+            feedback = strtod(optarg, &endptr);
+            if (*endptr != '\0') die("Invalid feedback constant", optarg);
+        } else if (opt == 'n') {
+            n_steps = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || n_steps < COMPARE_STEPS)
+                die("Invalid number of steps", optarg);
+        } else if (opt == 'r') {
+            n_repeats = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || n_repeats < 1)
+                die("Invalid number of repeats", optarg);
+        } else if (opt == 'a') {
+            integrators = true;
+        } else if (opt == 'c') {
+            tolerance = strtod(optarg, &endptr);
+            if (*endptr != '\0' || !(tolerance >= 0))
+                die("Invalid tolerance", optarg);
+        } else if (!common_option(opt, optarg))
+            die("Unrecognized argument", NULL);
+    }
+    if (optind != argc) die("Too many arguments!", NULL);
+
+    memcpy(g_v0, network.v, sizeof g_v0);
+    memcpy(g_u0, network.u, sizeof g_u0);
+    memcpy(g_i0, network.i, sizeof g_i0);
+    memcpy(g_j0, network.j, sizeof g_j0);
+
+    if (integrators) compare_integrators(n_steps, feedback, n_repeats);
+    else if (compare_engines(n_steps, feedback, n_repeats) > tolerance) {
+        printf("FAIL: engines differ by more than %gmV\n", tolerance);
+        return 1;
+    }
+}
@@ -0,0 +1,63 @@
+import inspect
+import numpy as np
+
+try:
+    import cpgcompiler as cpg
+except ImportError:
+    from . import cpgcompiler as cpg
+
+class BodyCPG(cpg.CPGBase):
+    """
+    A body's worth of the forward CPG: n_segments copies of its ring of
+    four oscillator modules, each segment driving the next through the
+    matching modules, and all of them driving the same four muscles.
+    """
+    def __init__(self, n_segments=166, Gexc=20, Ginh=60, Gffw=10, Gfb=8,
+                 Gslow=3, Gseg=10, Gmusc=1):
+        self.n_segments = n_segments
+        jig = []
+        for s in range(n_segments):
+            first = 12*s
+            modules = [first + 3*m for m in range(4)]
+            for i in modules:
+                jig += cpg.module(i, Gexc=Gexc, Ginh=Ginh, Gslow=Gslow)
+            jig += cpg.module_loop(*modules, Gfb=Gfb, Gffw=Gffw)
+
+            # On to the same module of the next segment.
+            if s + 1 < n_segments:
+                jig += [(i, i+12, Gseg) for i in modules]
+                jig += [(i+1, i+13, Gseg) for i in modules]
+
+            # Every segment drives all four muscles.
+            jig += [(i+1, 12*n_segments + m, Gmusc)
+                    for m, i in enumerate(modules)]
+
+        G = cpg.connectivity(jig, N=12*n_segments + 4)
+        is_excitatory = np.array([True, True, False]*4*n_segments + [True]*4)
+        super().__init__(G, is_excitatory, 12*n_segments)
+
+    def muscle_activations(self):
+        return np.clip(self.V[-4:] - np.roll(self.V[-4:], 2), -1, 1)
+
+    def conductance_basis(self):
+        # The same as CPGBase's, but with this many segments.
+        sig = inspect.signature(BodyCPG.__init__)
+        names = [p for p in sig.parameters if p.startswith('G')]
+        return [(p, sig.parameters[p].default,
+                 BodyCPG(self.n_segments,
+                         **{q: float(q == p) for q in names}).G)
+                for p in names]
+
+
+if __name__ == '__main__':
+    import argparse
+
+    parser = argparse.ArgumentParser(
+            description='Write a body-scale forward CPG as a network file.')
+    parser.add_argument('file', help='output filename')
+    parser.add_argument('--segments', type=int, default=166,
+            help='number of chained segments, of 12 cells each')
+    args = parser.parse_args()
+
+    with open(args.file, 'wb') as f:
+        BodyCPG(args.segments).dump_binary(f)
@@ -0,0 +1,54 @@
+"""
+Builds the neurobot Python module: the C engine compiled for the host
+through cffi, so that CPGBase.run() can advance a network many steps per
+call instead of one NumPy step at a time. Run it from this directory,
+"python3 build_neurobot.py" or "make pymodule", and the module lands
+next to cpgcompiler.py.
+"""
+from cffi import FFI
+
+# The engine and everything it links against; the host build has no
+# libpruio, so only the simulated backend.
+SOURCES = ['libneurobot.c', 'datalog.c', 'histogram.c', 'adcring.c',
+           'activeset.c', 'integrate.c', 'fixed.c', 'netfile.c',
+           'parallel.c', 'trace.c', 'pipeline.c', 'telemetry.c',
+           'spikelog.c', 'control.c', 'backend_sim.c']
+
+ffibuilder = FFI()
+ffibuilder.cdef("""
+    struct synapse {
+        int pre;
+        float g, vn;
+    };
+
+    struct synapses {
+        const int *row;
+        const struct synapse *syn;
+    };
+
+    struct network {
+        int n;
+        float *v, *u, *i, *j;
+        const float *k, *inv_C, *inv_tau;
+        const float *a, *b, *c, *d;
+        const float *vr, *vt, *vp;
+        ...;
+    };
+
+    extern int g_dt_us;
+    extern int g_substeps;
+    void select_integrator(const char *name);
+
+    long network_run(struct network *net, const struct synapses *synapses,
+            long n_steps, const float *i_ext, float *v_out, bool *raster);
+""")
+
+ffibuilder.set_source('neurobot', '#include "libneurobot.h"',
+                      sources=SOURCES, include_dirs=['.'],
+                      define_macros=[('NO_PRUIO', None)],
+                      extra_compile_args=['-std=gnu99', '-O2',
+                                          '-ffast-math'],
+                      libraries=['rt', 'pthread', 'm'])
+
+if __name__ == '__main__':
+    ffibuilder.compile(verbose=False)
@@ -0,0 +1,131 @@
+"""
+Conformance between the Python model and the C engine, and throughput
+of both: "make check" and "make bench" run this (with --bench for the
+latter), along with the C engines' own comparisons in bench.c.
+
+Each network runs from its usual starting state (cell 0 firing) under a
+few fixed input traces, once through Organoid.step() and once through
+the compiled engine (CPGBase.run(), which needs build_neurobot.py to
+have been run). Every cell must fire the same number of times in both,
+each spike paired off in order must land within SPIKE_TOL_MS, and the
+voltages, clipped at the peak as the controllers log them, must stay
+within V_TOL_MV throughout. The C engine is single precision and the
+Python one double, so the tolerances are there for rounding, not for
+any difference in the model.
+"""
+import argparse
+import sys
+import time
+
+import numpy as np
+
+import cpgcompiler
+from forwards import SingleCPG
+from backwards import DoubleCPG
+
+NETWORKS = [('forwards', SingleCPG), ('backwards', DoubleCPG)]
+
+DT = 0.5
+CHECK_STEPS = 4000
+BENCH_STEPS = {'python': 2000, 'c': 200000}
+BENCH_REPEATS = 3
+
+SPIKE_TOL_MS = 0.5
+V_TOL_MV = 0.5
+
+# Input traces: none at all, and a couple of seeds of input_trace().
+TRACES = [None, 1, 2]
+
+
+def input_trace(model, n_steps, seed):
+    """
+    A fixed input for every feedback-tap cell, the size of the
+    proprioceptive feedback but wandering smoothly at random between
+    knots 100ms apart, and nothing for any other cell.
+    """
+    if seed is None:
+        return None
+    rng = np.random.default_rng(seed)
+    knot_steps = int(100 / DT)
+    Iin = np.zeros((n_steps, model.N))
+    for cell, _, _ in model.feedback_taps():
+        knots = rng.uniform(-20, 5, n_steps // knot_steps + 2)
+        Iin[:, cell] = np.interp(np.arange(n_steps),
+                                 np.arange(len(knots)) * knot_steps, knots)
+    return Iin
+
+
+def compare(model, Vc, Fc, Vp, Fp):
+    """
+    A list of the ways the C run (Vc, Fc) differs from the Python run
+    (Vp, Fp) beyond the tolerances, empty if it doesn't.
+    """
+    problems = []
+    for c in range(model.N):
+        tc, tp = np.nonzero(Fc[:,c])[0], np.nonzero(Fp[:,c])[0]
+        if len(tc) != len(tp):
+            problems.append(f'cell {c} fired {len(tc)} times in C, '
+                            f'{len(tp)} in Python')
+        n = min(len(tc), len(tp))
+        dt = np.abs(tc[:n] - tp[:n]) * DT
+        if n and dt.max() > SPIKE_TOL_MS:
+            k = np.argmax(dt)
+            problems.append(f'cell {c} spike {k} at {tc[k]*DT}ms in C, '
+                            f'{tp[k]*DT}ms in Python')
+
+    dV = np.abs(np.minimum(Vc, model.Vp) - np.minimum(Vp, model.Vp))
+    if dV.max() > V_TOL_MV:
+        step, c = np.unravel_index(np.argmax(dV), dV.shape)
+        problems.append(f'V{c} differs by {dV.max():.3g}mV at {step*DT}ms')
+    return problems
+
+
+def check():
+    failed = False
+    for name, cls in NETWORKS:
+        for seed in TRACES:
+            c_model, py_model = cls(), cls()
+            Iin = input_trace(c_model, CHECK_STEPS, seed)
+            Vc, Fc = c_model.run(CHECK_STEPS, DT, Iin)
+            Vp, Fp = py_model.run(CHECK_STEPS, DT, Iin, compiled=False)
+
+            problems = compare(c_model, Vc, Fc, Vp, Fp)
+            trace = 'no input' if seed is None else f'input seed {seed}'
+            print(f'{name}, {trace}: {Fc.sum()} spikes, '
+                  f'{"FAIL" if problems else "ok"}')
+            for p in problems[:10]:
+                print(f'    {p}')
+            failed |= bool(problems)
+    return not failed
+
+
+def bench():
+    """Steps per second of each network on each engine, best of a few."""
+    print(f'{"network":10} {"engine":8} {"steps/s":>12}')
+    for name, cls in NETWORKS:
+        for engine, compiled in [('python', False), ('c', True)]:
+            n_steps = BENCH_STEPS[engine]
+            best = float('inf')
+            for _ in range(BENCH_REPEATS):
+                model = cls()
+                Iin = input_trace(model, n_steps, TRACES[-1])
+                start = time.perf_counter()
+                model.run(n_steps, DT, Iin, compiled=compiled)
+                best = min(best, time.perf_counter() - start)
+            rate = n_steps / best
+            print(f'{name:10} {engine:8} {rate:12.0f}')
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(
+            description='Check the C engine against the Python model.')
+    parser.add_argument('--bench', action='store_true',
+            help='report steps per second instead')
+    args = parser.parse_args()
+
+    if cpgcompiler._lib is None:
+        sys.exit('The neurobot module is missing; run build_neurobot.py.')
+    if args.bench:
+        bench()
+    else:
+        sys.exit(0 if check() else 1)
@@ -0,0 +1,245 @@
+/*
+ *
+ * control.c
+ *
+ * A control plane for tuning a controller while it runs (-K NAME):
+ * the loop shares a struct control_block as the POSIX shared memory
+ * object /NAME, and the tune tool reads and writes it from outside.
+ * Every CONTROL_PUBLISH_TICKS ticks the loop publishes a snapshot of
+ * where it's got to, how it's keeping time and every cell's state; at
+ * the end of every tick it looks for new parameters and, if a tool has
+ * finished writing some, applies them all at once before the next.
+ *
+ * The loop never waits on a tool. Parameters half written when it
+ * looks are left for the next tick, and tools retry a snapshot that
+ * was being written while they read it. A write still unfinished after
+ * CONTROL_STALE_MS was abandoned by a tool that died partway through:
+ * the loop puts back the parameters it's running with and takes the
+ * lock back, so that other tools aren't locked out for good.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libneurobot.h"
+
+
+/* About 200 snapshots a second at the defaults. */
+#define CONTROL_PUBLISH_TICKS 10
+
+/* How long a write to the parameters can take before it's abandoned. */
+#define CONTROL_STALE_MS 500
+
+bool g_control = false;
+
+static char *g_name;
+static struct control_block *g_block;
+
+/* The controller's own copies of the parameters it has, if any. */
+static float *g_bound[N_CONTROL_PARAMS];
+static const struct network *g_net = NULL;
+static uint32_t g_applied_seq = 0;
+static float g_params[N_CONTROL_PARAMS];
+
+/* A write seen under way, since when, and how many were abandoned. */
+static uint32_t g_writing_seq = 0;
+static long g_writing_since = 0, g_abandoned = 0;
+static bool g_started = false;
+
+
+/*
+ * Whether the shared object by this name belongs to a controller that's
+ * still running, rather than one that died without removing it.
+ */
+static bool in_use(const char *name)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return false;
+    struct stat st;
+    pid_t pid = 0;
+    if (!fstat(fd, &st) && (size_t)st.st_size >= sizeof *g_block) {
+        const struct control_block *b = mmap(NULL, sizeof *b, PROT_READ,
+                MAP_SHARED, fd, 0);
+        if (b != MAP_FAILED) {
+            pid = b->pid;
+            munmap((void *)b, sizeof *b);
+        }
+    }
+    close(fd);
+    return pid > 0 && (!kill(pid, 0) || errno == EPERM);
+}
+
+
+/*
+ * Create the shared object now, so a bad name fails before setup(). A
+ * live controller's is left alone; a dead one's is taken over.
+ */
+void open_control(const char *name)
+{
+    g_name = malloc(strlen(name) + 2);
+    if (!g_name) die("Couldn't allocate control plane", NULL);
+    sprintf(g_name, "%s%s", name[0] == '/' ? "" : "/", name);
+
+    int fd = shm_open(g_name, O_RDWR | O_CREAT | O_EXCL, 0660);
+    if (fd < 0 && errno == EEXIST) {
+        if (in_use(g_name))
+            die("Another controller is using that control plane", name);
+        shm_unlink(g_name);
+        fd = shm_open(g_name, O_RDWR | O_CREAT | O_EXCL, 0660);
+    }
+    if (fd < 0) die("Couldn't create control plane", strerror(errno));
+    if (ftruncate(fd, sizeof *g_block))
+        die("Couldn't size control plane", strerror(errno));
+    g_block = mmap(NULL, sizeof *g_block, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    close(fd);
+    if (g_block == MAP_FAILED) die("Couldn't map control plane", g_name);
+
+    /* Touch it all now rather than fault it in from the loop. */
+    memset(g_block, 0, sizeof *g_block);
+    g_block->pid = getpid();
+    g_control = true;
+}
+
+
+/*
+ * Let the control plane change one of the controller's variables. It's
+ * only ever written at the end of a tick, from the loop's own thread.
+ */
+void control_bind(enum control_param param, float *value)
+{
+    g_bound[param] = value;
+}
+
+
+/* The cells to publish; controllers get here through start_network(). */
+void control_network(const struct network *net)
+{
+    g_net = net;
+}
+
+
+/*
+ * Start publishing, with the parameters as they stand once the options
+ * have all been dealt with; the magic goes in last, so tools know the
+ * rest is there.
+ */
+static void start_control()
+{
+    struct control_block *b = g_block;
+    b->version = CONTROL_VERSION;
+    b->params[CONTROL_PWM_MAX] = g_pwm_max * 100;
+    b->params[CONTROL_CONDUCTANCE] = g_conductance_scale;
+    b->bound = 1u << CONTROL_PWM_MAX | 1u << CONTROL_CONDUCTANCE;
+    for (int p = 0; p < N_CONTROL_PARAMS; p++) {
+        if (!g_bound[p]) continue;
+        b->params[p] = *g_bound[p];
+        b->bound |= 1u << p;
+    }
+    memcpy(g_params, b->params, sizeof g_params);
+    b->snapshot.n_cells = g_net ? g_net->n : 0;
+    if (b->snapshot.n_cells > CONTROL_MAX_CELLS)
+        b->snapshot.n_cells = CONTROL_MAX_CELLS;
+    __atomic_store_n(&b->magic, CONTROL_MAGIC, __ATOMIC_RELEASE);
+    g_started = true;
+}
+
+
+/*
+ * Publish a snapshot of the loop, and of the cells too unless shedding
+ * (-V shed); params_seq goes out either way, so tools can see their
+ * parameters taken up.
+ */
+static void publish(uint64_t late_ns, uint64_t busy_ns, bool cells)
+{
+    struct control_snapshot *s = &g_block->snapshot;
+    seqlock_write_begin(&g_block->snapshot_seq);
+    s->step = g_num_dts;
+    s->elapsed_ns = g_num_dts * (uint64_t)g_dt_us * NS_PER_US;
+    s->overruns = g_num_overruns;
+    s->late_us = (float)late_ns / NS_PER_US;
+    s->busy_us = (float)busy_ns / NS_PER_US;
+    s->params_seq = g_applied_seq;
+    if (g_net && cells) {
+        size_t size = s->n_cells * sizeof(float);
+        memcpy(s->v, g_net->v, size);
+        memcpy(s->u, g_net->u, size);
+        memcpy(s->i, g_net->i, size);
+        memcpy(s->j, g_net->j, size);
+    }
+    seqlock_write_end(&g_block->snapshot_seq);
+}
+
+
+/*
+ * A tool is partway through writing the parameters: if it has been for
+ * too long, put back the ones the loop has and finish the write for it.
+ */
+static void check_abandoned(uint32_t seq)
+{
+    if (seq != g_writing_seq) {
+        g_writing_seq = seq;
+        g_writing_since = g_num_dts;
+        return;
+    }
+    if ((g_num_dts - g_writing_since) * g_dt_us
+            < (long)CONTROL_STALE_MS * US_PER_MS)
+        return;
+
+    memcpy(g_block->params, g_params, sizeof g_params);
+    if (__atomic_compare_exchange_n(&g_block->params_seq, &seq, seq + 1,
+                false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        g_applied_seq = seq + 1;
+        g_abandoned++;
+    }
+}
+
+
+/* Take up whatever parameters a tool has finished writing. */
+static void apply_params()
+{
+    uint32_t seq = __atomic_load_n(&g_block->params_seq, __ATOMIC_ACQUIRE);
+    if (seq == g_applied_seq) return;
+    if (seq & 1) {
+        check_abandoned(seq);
+        return;
+    }
+
+    float params[N_CONTROL_PARAMS];
+    if (!seqlock_try_read(&g_block->params_seq, g_block->params,
+                params, sizeof params, &seq))
+        return;
+
+    set_pwm_max(params[CONTROL_PWM_MAX]);
+    g_conductance_scale = params[CONTROL_CONDUCTANCE];
+    for (int p = 0; p < N_CONTROL_PARAMS; p++)
+        if (g_bound[p]) *g_bound[p] = params[p];
+    memcpy(g_params, params, sizeof g_params);
+    g_applied_seq = seq;
+}
+
+
+/* The end of a tick's work, with how late it started and how long it took. */
+void control_tick(uint64_t late_ns, uint64_t busy_ns)
+{
+    if (!g_started) start_control();
+    if (g_num_dts / g_io_steps % CONTROL_PUBLISH_TICKS == 0)
+        publish(late_ns, busy_ns, !g_shedding);
+    apply_params();
+}
+
+
+void close_control()
+{
+    if (!g_control) return;
+    if (g_abandoned)
+        fprintf(stderr, "Control plane: %ld abandoned parameter writes "
+                "undone.\n", g_abandoned);
+    munmap(g_block, sizeof *g_block);
+    shm_unlink(g_name);
+    g_control = false;
+}
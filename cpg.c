@@ -0,0 +1,153 @@
+/*
+ *
+ * cpg.c
+ *
+ * The forward controller again, but for any CPG: the network comes from
+ * a binary file written by cpgcompiler.py ("python3 forwards.py --binary
+ * forwards.net") instead of being compiled in, so trying a new gait
+ * doesn't need a rebuild. For big networks, -j spreads each step over
+ * that many threads (see parallel.c). Without -j the network runs on the
+ * event-driven path, which sums synaptic input in a different order, so
+ * its results differ slightly from the pool's; with -j, they're the same
+ * bit for bit whatever the number of threads, one included.
+ *
+ *     cpg [options] network.net [logfile]
+ *
+ */
+
+#include "libneurobot.h"
+
+/* The strength of position feedback in pA. */
+#define DEFAULT_FEEDBACK 25
+
+int main(int argc, char**argv) 
+{
+
+    /*
+     * Parsing command-line options.
+     */
+    float feedback = DEFAULT_FEEDBACK;
+    int n_threads = 0;
+
+    int opt;
+    char *endptr;
+    while ((opt = getopt(argc, argv, COMMON_OPTIONS "k:j:")) != -1) {
+        if (opt == 'k') {
+            feedback = strtod(optarg, &endptr);
+            if (endptr && *endptr != '\0') 
+                die("Invalid feedback constant", optarg);
+        } else if (opt == 'j') {
+            n_threads = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || n_threads < 1)
+                die("Invalid number of threads", optarg);
+        } else if (!common_option(opt, optarg)) 
+            die("Unrecognized argument", NULL);
+    }
+
+    /* 
+     * The network file, then optionally a filename to log to.
+     */
+    if (optind == argc)
+        die("No network file given", NULL);
+    if (optind+2 < argc) 
+        die("Too many arguments!", NULL);
+
+    uint64_t load_ns = now_ns();
+    struct loaded_network ln;
+    load_network(argv[optind], &ln);
+    struct network *net = &ln.net;
+    load_ns = now_ns() - load_ns;
+    fprintf(stderr, "Loaded %s: %d cells, %d synapses in %.3fms.\n",
+            argv[optind], net->n, ln.n_synapses, (double)load_ns / 1e6);
+
+    if (optind+2 == argc) 
+        open_logfile(argv[optind+1]);
+
+
+    /* The control plane (-K) may retune this between ticks. */
+    control_bind(CONTROL_FEEDBACK, &feedback);
+
+    setup();
+    float actuator_position[4];
+    float *i_in = NULL;
+    if (posix_memalign((void **)&i_in, NETWORK_FILE_ALIGN,
+                PADDED(net->n) * sizeof *i_in))
+        die("Couldn't allocate input currents", NULL);
+    memset(i_in, 0, PADDED(net->n) * sizeof *i_in);
+
+    net->v[0] = 0;
+    struct pool *pool = NULL;
+    if (n_threads)
+        pool = start_pool(net, &ln.synapses, ln.feedback_taps, 
+                ln.n_feedback, n_threads);
+    else
+        start_network(net, &ln.synapses);
+    datalogf("t,A0,A1,A2,A3");
+    for (int i=0; i<net->n; i++)
+        datalogf(",V%d", i);
+    start_log(4 + net->n);
+    while (!g_please_die_kthxbai) {
+        float *row = log_row();
+
+        for (int i = 0; i < 4; ++i) {
+            actuator_position[i] = read_adc(i);
+            row[i] = actuator_position[i];
+        }
+        phase_done(PHASE_ADC);
+
+        /*
+         * The network runs g_io_steps steps on each tick's readings,
+         * or more if it's catching up on an overrun.
+         */
+        for (int step = 0; step < g_tick_steps; step++) {
+            if (pool) {
+                /* The pool does the whole step, so it's all dynamics. */
+                pool_step(pool, actuator_position, feedback);
+                phase_done(PHASE_DYNAMICS);
+            } else {
+                /* 
+                 * Need to check all spikes before doing any dynamics for
+                 * consistency with the Python version. 
+                 */
+                check_spikes_all(net, NULL);
+                phase_done(PHASE_SPIKES);
+
+                /* 
+                 * Now run the continuous dynamics, with input currents
+                 * calculated both for the synapses and for feedback.
+                 */
+                active_synaptic_currents(&ln.fanout, net, i_in);
+
+                /* Compute feedback current. */
+                feedback_currents(ln.feedback_taps, ln.n_feedback, 
+                        actuator_position, feedback, i_in);
+
+                resolve_dynamics_all(net, i_in);
+                phase_done(PHASE_DYNAMICS);
+            }
+        }
+
+        /* This part actually communicates with the motor. */
+        for (int i = 0; i < ln.n_motors; i++)
+            apply_actuator(i, motor_activation(net, &ln.motors[i]));
+        commit_actuators();
+        phase_done(PHASE_ACTUATOR);
+
+        for (int i = 0; i < net->n; i++) {
+            float vlog = net->v[i];
+            if (vlog > net->vp[i]) vlog = net->vp[i];
+            row[4+i] = vlog;
+        }
+
+        log_commit();
+        phase_done(PHASE_LOG);
+
+        synchronize_loop();
+    }
+
+    print_final_time();
+    cleanup();
+    if (pool) stop_pool(pool);
+    free(i_in);
+    unload_network(&ln);
+}
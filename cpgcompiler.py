@@ -1,6 +1,28 @@
+import inspect
+import struct
 import numpy as np
 from braingeneers.drylab import Organoid, NEURON_TYPES
 
+# The compiled engine, if build_neurobot.py has been run.
+try:
+    from neurobot import ffi as _ffi, lib as _lib
+except ImportError:
+    _lib = None
+
+# The binary network format; these must match libneurobot.h.
+NETWORK_FILE_MAGIC = 0x574e424e # "NBNW"
+NETWORK_FILE_VERSION = 1
+NETWORK_FILE_ALIGN = 32
+
+def _aligned(shape):
+    """
+    A zeroed float32 array aligned for the engine's vector loads.
+    """
+    n = int(np.prod(shape))
+    buf = np.zeros(n + NETWORK_FILE_ALIGN//4, np.float32)
+    start = (-buf.ctypes.data % NETWORK_FILE_ALIGN) // 4
+    return buf[start:start+n].reshape(shape)
+
 def connectivity(jig, N=None):
     """
     Create the connectivity matrix given a list of connections in the
@@ -75,6 +97,91 @@ class CPGBase(Organoid):
     def step(self, *args, dt, pos):
         Iin = np.hstack((self.propriocept(pos), np.zeros(self.n_muscles)))
         super().step(dt=dt, Iin=Iin)
+
+    def run(self, n_steps, dt, Iin=None, record=True, compiled=True):
+        """
+        Advances the model n_steps steps of dt ms in a single call into
+        the C engine (the neurobot module from build_neurobot.py), in
+        float32 and with the C engine's dynamics. Iin is an optional
+        (n_steps, N) matrix of external input currents, in place of the
+        proprioception step() would add. Returns the voltages after
+        each step and which cells fired at the start of each step, both
+        (n_steps, N), or (None, None) if record is false. Without the
+        module, or with compiled=False, it goes through Organoid.step()
+        one step at a time instead.
+        """
+        if Iin is not None:
+            Iin = np.ascontiguousarray(Iin, np.float32)
+            if Iin.shape != (n_steps, self.N):
+                raise ValueError('Iin must be (n_steps, N)')
+        V = np.empty((n_steps, self.N), np.float32) if record else None
+        fired = np.empty((n_steps, self.N), bool) if record else None
+
+        if _lib is None or not compiled:
+            for s in range(n_steps):
+                if record: fired[s] = self.fired
+                Organoid.step(self, dt=dt, Iin=np.zeros(self.N)
+                              if Iin is None else Iin[s])
+                if record: V[s] = self.V
+            return V, fired
+
+        eng = self._engine()
+        state, N = eng['state'], self.N
+        state[0,:N] = np.where(self.fired, np.maximum(self.V, self.Vp), 
+                               self.V)
+        state[1,:N], state[2,:N], state[3,:N] = self.U, self.Isyn, self.Jsyn
+
+        # The synapses are rebuilt every call in case G has changed.
+        post, pre = np.nonzero(self.G)
+        rows = np.searchsorted(post, np.arange(N + 1)).astype(np.int32)
+        syn = np.zeros(len(pre), [('pre', '<i4'), ('g', '<f4'), 
+                                  ('vn', '<f4')])
+        syn['pre'], syn['g'], syn['vn'] = pre, self.G[post, pre], eng['vn'][pre]
+        synapses = _ffi.new('struct synapses *')
+        synapses.row = _ffi.from_buffer('int[]', rows)
+        synapses.syn = _ffi.cast('struct synapse *', 
+                                 _ffi.from_buffer(syn))
+
+        def buffer(x, ctype):
+            return _ffi.NULL if x is None else _ffi.from_buffer(ctype, x)
+
+        _lib.g_dt_us = round(dt * 1000)
+        spikes = _lib.network_run(eng['net'], synapses, n_steps, 
+                                  buffer(Iin, 'float[]'), 
+                                  buffer(V, 'float[]'), 
+                                  buffer(fired, 'bool[]'))
+        if spikes < 0:
+            raise MemoryError('network_run() ran out of memory')
+
+        self.V, self.U = state[0,:N].astype(float), state[1,:N].astype(float)
+        self.Isyn, self.Jsyn = (state[2,:N].astype(float), 
+                                state[3,:N].astype(float))
+        self.fired = self.V >= self.Vp
+        return V, fired
+
+    def _engine(self):
+        """
+        The C engine's struct network for this model, with its state and
+        parameter arrays, made on first use and kept for later runs.
+        """
+        if getattr(self, '_engine_cache', None) is None:
+            state, params = self.cell_arrays()
+            padded = len(state[0][1])
+            eng = {'state': _aligned((4, padded)),
+                   'params': _aligned((len(params), padded)),
+                   'vn': np.array([NEURON_TYPES[t][9] 
+                                   for t in self.cell_types])}
+            for row, (_, values) in zip(eng['params'], params):
+                row[:] = values
+            net = _ffi.new('struct network *')
+            net.n = self.N
+            for row, (name, _) in zip(eng['state'], state):
+                setattr(net, name, _ffi.from_buffer('float[]', row))
+            for row, (name, _) in zip(eng['params'], params):
+                setattr(net, name, _ffi.from_buffer('float[]', row))
+            eng['net'] = net
+            self._engine_cache = eng
+        return self._engine_cache
         
     def propriocept(self, pos):
         """
@@ -86,10 +193,74 @@ class CPGBase(Organoid):
         
     def muscle_activations(self):
         pass
+
+    def feedback_taps(self):
+        """
+        The cells which receive proprioceptive feedback, as tuples
+        (cell, prev, next): the cell is inhibited in proportion to how
+        far actuator prev is from 1 and actuator next is from 0. By
+        default that's the first cell of each oscillator module, with
+        the actuators on either side of the module's own.
+        """
+        return [(3*m, (m+3)%4, (m+1)%4) for m in range(self.n_neurons//3)]
+
+    def motor_map(self):
+        """
+        The (flexor, extensor) pair of muscle cells for each actuator,
+        whose voltage difference is the actuator's activation.
+        """
+        m0 = self.n_neurons
+        return [(m0 + i, m0 + (i+2)%4) for i in range(self.n_muscles)]
+
+    def conductance_basis(self):
+        """
+        The conductance keyword arguments of the subclass (the ones
+        whose names start with G), each with its default value and the
+        connectivity matrix it produces when set to 1 with the others
+        at 0. G is linear in these, so that's enough to rebuild it for
+        any combination of them.
+        """
+        sig = inspect.signature(type(self).__init__)
+        names = [p for p in sig.parameters if p.startswith('G')]
+        return [(p, sig.parameters[p].default,
+                 type(self)(**{q: float(q == p) for q in names}).G)
+                for p in names]
         
     def start(self):
         self.fired[0] = True
 
+    def cell_arrays(self):
+        """
+        The per-cell state variables and parameters in the order struct
+        network has them, as (name, values) pairs, each padded out to a
+        multiple of 8 cells with copies of the last cell sitting at its
+        resting potential.
+        """
+        types = self.cell_types + [self.cell_types[-1]] * (-self.N % 8)
+        a, b, c, d, C, k, vr, vt, vp, vn, tau = \
+                np.array([NEURON_TYPES[t] for t in types]).T
+        v = np.where(np.arange(len(types)) < self.N, -60, vr)
+        zero = np.zeros(len(types))
+        state = [('v', v), ('u', zero), ('i', zero), ('j', zero)]
+        params = [('k', k), ('inv_C', 1/C), ('inv_tau', 1/tau),
+                  ('a', a), ('b', b), ('c', c), ('d', d),
+                  ('vr', vr), ('vt', vt), ('vp', vp)]
+        return state, params
+
+    def synapse_pattern(self):
+        """
+        The synapses as parallel arrays of postsynaptic and presynaptic
+        cells, in the same order a dense row-major walk of G would visit
+        them, with the CSR row starts. Any synapse that some setting of
+        the conductance parameters could create is included, even if
+        it's zero here.
+        """
+        basis = self.conductance_basis()
+        pattern = (self.G != 0) | sum(Gp != 0 for _,_,Gp in basis)
+        post, pre = np.nonzero(pattern)
+        row = np.searchsorted(post, np.arange(self.N + 1))
+        return post, pre, row
+
     def dump_source(self, f=None):
         """
         Prints the connectivity and parameters as C source code.
@@ -97,26 +268,260 @@ class CPGBase(Organoid):
         print('#include "libneurobot.h"\n', file=f)
         print(f'#define N_CELLS {self.N}\n', file=f)
 
-        print('struct state states[N_CELLS] = {', file=f)
-        print('  [0 ... N_CELLS-1] = {.v=-60, .u=0, .i=0, .j=0}', file=f)
+        print('#define N_PADDED PADDED(N_CELLS)\n', file=f)
+
+        # One array per state variable and per parameter.
+        def array(name, values, const=True):
+            qual = 'const ' if const else ''
+            print(f'SIMD_ALIGN {qual}float cell_{name}[N_PADDED] = {{', 
+                  file=f)
+            print('  ' + ', '.join(repr(float(x)) for x in values), file=f)
+            print('};\n', file=f)
+
+        state, params = self.cell_arrays()
+        for name, values in state:
+            array(name, values, const=False)
+        for name, values in params:
+            array(name, values)
+
+        print('struct network network = {', file=f)
+        print('  .n=N_CELLS, .v=cell_v, .u=cell_u, .i=cell_i, .j=cell_j,',
+              file=f)
+        print('  .k=cell_k, .inv_C=cell_inv_C, .inv_tau=cell_inv_tau,',
+              file=f)
+        print('  .a=cell_a, .b=cell_b, .c=cell_c, .d=cell_d,', file=f)
+        print('  .vr=cell_vr, .vt=cell_vt, .vp=cell_vp', file=f)
         print('};\n', file=f)
 
-        for type in set(self.cell_types):
-            a, b, c, d, C, k, vr, vt, vp, vn, tau = NEURON_TYPES[type]
-            print(f'const struct params {type.upper()} = {{', file=f)
-            print(f'  .a={a}, .b={b}, .c={c}, .d={d},', file=f)
-            print(f'  .C={C}, .k={k}, .tau={tau},', file=f)
-            print(f'  .vr={vr}, .vt={vt}, .vp={vp}, .vn={vn}', file=f)
-            print(f'}};\n', file=f)
-
-        print('\nconst struct params *params[N_CELLS] = {', file=f)
-        for i,type in enumerate(self.cell_types):
-            print(f'  [{i}] = &{type.upper()},', file=f)
+        # The synapses are stored in compressed sparse row form.
+        basis = self.conductance_basis()
+        post, pre, row = self.synapse_pattern()
+        print(f'#define N_SYNAPSES {len(pre)}\n', file=f)
+
+        print('const int synapse_rows[N_CELLS+1] = {', file=f)
+        print('  ' + ', '.join(str(r) for r in row), file=f)
         print('};\n', file=f)
 
-        print('const float G[N_CELLS][N_CELLS] = {', file=f)
-        for (i,j),gij in np.ndenumerate(self.G):
-            if gij != 0:
-                print(f'\t[{i}][{j}] = {gij},', file=f)
-        print(f'}};', file=f)
+        print('const struct synapse synapse_list[N_SYNAPSES] = {', file=f)
+        for i,j in zip(post, pre):
+            vn = NEURON_TYPES[self.cell_types[j]][9]
+            print(f'\t/* {j} -> {i} */ {{.pre={j}, .g={self.G[i,j]}, '
+                  f'.vn={vn}}},', file=f)
+        print('};\n', file=f)
+
+        print('const struct synapses synapses = {', file=f)
+        print('  .row=synapse_rows, .syn=synapse_list', file=f)
+        print('};\n', file=f)
+
+        # The same synapses again, grouped by presynaptic cell for the
+        # event-driven path, which only visits the active cells' fan-out.
+        by_pre = np.lexsort((post, pre))
+        col = np.searchsorted(pre[by_pre], np.arange(self.N + 1))
+        print('const int fanout_cols[N_CELLS+1] = {', file=f)
+        print('  ' + ', '.join(str(c) for c in col), file=f)
+        print('};\n', file=f)
+
+        print('const struct synapse_out fanout_list[N_SYNAPSES] = {', file=f)
+        for i,j in zip(post[by_pre], pre[by_pre]):
+            vn = NEURON_TYPES[self.cell_types[j]][9]
+            print(f'\t/* {j} -> {i} */ {{.post={i}, .g={self.G[i,j]}, '
+                  f'.vn={vn}}},', file=f)
+        print('};\n', file=f)
+
+        print('const struct fanout fanout = {', file=f)
+        print('  .col=fanout_cols, .out=fanout_list', file=f)
+        print('};\n', file=f)
 
+        # How each synapse depends on the conductance parameters, so
+        # that the parameter sweep can rebuild the conductances.
+        print(f'#define N_SWEEP_PARAMS {len(basis)}\n', file=f)
+        print('const char *const sweep_param_names[N_SWEEP_PARAMS] = {',
+              file=f)
+        print('  ' + ', '.join(f'"{p}"' for p,_,_ in basis), file=f)
+        print('};\n', file=f)
+        print('const float sweep_param_defaults[N_SWEEP_PARAMS] = {', 
+              file=f)
+        print('  ' + ', '.join(repr(float(d)) for _,d,_ in basis), file=f)
+        print('};\n', file=f)
+        print('const float sweep_basis[N_SYNAPSES][N_SWEEP_PARAMS] = {', 
+              file=f)
+        for i,j in zip(post, pre):
+            coefs = ', '.join(repr(float(Gp[i,j])) for _,_,Gp in basis)
+            print(f'\t{{{coefs}}},', file=f)
+        print('};\n', file=f)
+
+        taps = self.feedback_taps()
+        print(f'#define N_FEEDBACK {len(taps)}\n', file=f)
+        print('const struct feedback_tap feedback_taps[N_FEEDBACK] = {',
+              file=f)
+        for cell, prev, next in taps:
+            print(f'  {{.cell={cell}, .prev={prev}, .next={next}}},', file=f)
+        print('};\n', file=f)
+
+        print(f'#define N_MOTORS {self.n_muscles}\n', file=f)
+        print('const struct motor motors[N_MOTORS] = {', file=f)
+        for flexor, extensor in self.motor_map():
+            print(f'  {{.flexor={flexor}, .extensor={extensor}}},', file=f)
+        print('};', file=f)
+
+    def dump_binary(self, f):
+        """
+        Writes the network as a binary file that libneurobot can map and
+        use in place (see netfile.c and struct network_file_header):
+        the header, then the initial state, the parameters, both forms
+        of the synapses, the feedback taps and the motor map, each
+        section starting on a 32-byte boundary. f must be opened in
+        binary mode. Everything is little-endian.
+        """
+        state, params = self.cell_arrays()
+        post, pre, row = self.synapse_pattern()
+        by_pre = np.lexsort((post, pre))
+        col = np.searchsorted(pre[by_pre], np.arange(self.N + 1))
+        vn = np.array([NEURON_TYPES[t][9] for t in self.cell_types])
+
+        synapse = np.dtype([('cell', '<i4'), ('g', '<f4'), ('vn', '<f4')])
+        syn = np.zeros(len(pre), synapse)
+        syn['cell'], syn['g'], syn['vn'] = pre, self.G[post, pre], vn[pre]
+        out = np.zeros(len(pre), synapse)
+        out['cell'] = post[by_pre]
+        out['g'] = self.G[post[by_pre], pre[by_pre]]
+        out['vn'] = vn[pre[by_pre]]
+
+        sections = [
+            np.concatenate([x for _,x in state]).astype('<f4'),
+            np.concatenate([x for _,x in params]).astype('<f4'),
+            row.astype('<i4'), syn, col.astype('<i4'), out,
+            np.array(self.feedback_taps(), '<i4').reshape(-1),
+            np.array(self.motor_map(), '<i4').reshape(-1),
+        ]
+
+        header = struct.Struct('<6I9Q')
+        offsets, end = [], header.size
+        for x in sections:
+            end += -end % NETWORK_FILE_ALIGN
+            offsets.append(end)
+            end += x.nbytes
+
+        f.write(header.pack(NETWORK_FILE_MAGIC, NETWORK_FILE_VERSION,
+                            self.N, len(pre), len(self.feedback_taps()),
+                            self.n_muscles, *offsets, end))
+        for offset, x in zip(offsets, sections):
+            f.write(bytes(offset - f.tell()))
+            f.write(x.tobytes())
+
+    def dump_step(self, f=None, dt=0.5):
+        """
+        Prints a network_step() function specialized to this network:
+        one step of spikes, synaptic and feedback currents, midpoint
+        dynamics and motor activations, the same as the data-driven
+        path but with the topology unrolled, the nonzero conductances,
+        cell parameters and timestep dt (in ms) folded into constants,
+        and the zero synapses left out. It works on the arrays from
+        dump_source(), which must be included first.
+        """
+        def lit(x):
+            return f'{float(x)!r}f'
+
+        def terms(coefs):
+            return ' + '.join(f'{lit(c)}*si[{j}]' for j,c in coefs)
+
+        print('/* Generated by cpgcompiler.py; do not edit. */\n', file=f)
+        print(f'#define NETWORK_STEP_DT_US {round(dt * 1000)}\n', file=f)
+        print('typedef float step_vec __attribute__('
+              '(vector_size(4*NETWORK_PAD)));\n', file=f)
+        print('int network_step(const float *position, float feedback,',
+              file=f)
+        print('        float *activation)\n{', file=f)
+        print('    float *v = cell_v, *u = cell_u, *si = cell_i, '
+              '*sj = cell_j;', file=f)
+        print('    SIMD_ALIGN float in[N_PADDED] = {0};', file=f)
+        print('    int fired = 0;\n', file=f)
+
+        params = [NEURON_TYPES[t] for t in self.cell_types]
+        for n, (a, b, c, d, C, k, vr, vt, vp, vn, tau) in enumerate(params):
+            print(f'    if (v[{n}] >= {lit(vp)}) {{ v[{n}] = {lit(c)}; '
+                  f'u[{n}] += {lit(d)}; sj[{n}] += 1; fired++; }}', file=f)
+        print(file=f)
+
+        # Each cell's input is sum_j G_ij*(vn_j - v_i)*i_j, split into
+        # the part that depends on v_i and the part that doesn't.
+        taps = {cell: (prev, next) for cell, prev, next in 
+                self.feedback_taps()}
+        for n in range(self.N):
+            pre = np.nonzero(self.G[n])[0]
+            gvn = [(j, self.G[n,j]*params[j][9]) for j in pre 
+                   if self.G[n,j]*params[j][9] != 0]
+            g = [(j, self.G[n,j]) for j in pre]
+            parts = []
+            if gvn:
+                parts.append(terms(gvn))
+            if g:
+                parts.append(f'- v[{n}]*({terms(g)})')
+            if n in taps:
+                prev, next = taps[n]
+                parts.append(f'- feedback*(fabsf(1 - position[{prev}])'
+                             f' + fabsf(position[{next}]))')
+            if parts:
+                print(f'    in[{n}] = ' + '\n        '.join(parts) + ';',
+                      file=f)
+        print(file=f)
+
+        # The dynamics are the same for every cell up to the constants,
+        # so they're done a whole vector of cells at a time, with the
+        # padding cells copying the last real one as in dump_source().
+        width = 8
+        types = params + [params[-1]] * (-self.N % width)
+        h = dt/2
+        def const(name, fn):
+            values = ', '.join(lit(fn(*p)) for p in block)
+            print(f'        const step_vec {name} = {{{values}}};', file=f)
+
+        for b0 in range(0, len(types), width):
+            block = types[b0:b0+width]
+            print(f'    {{', file=f)
+            for var, arr in ('v0','v'), ('u0','u'), ('i0','si'), ('j0','sj'):
+                print(f'        step_vec {var} = *(step_vec *)&{arr}[{b0}];',
+                      file=f)
+            print(f'        step_vec inj = *(step_vec *)&in[{b0}];', file=f)
+            const('K', lambda a,b,c,d,C,k,vr,vt,vp,vn,tau: k)
+            const('VR', lambda a,b,c,d,C,k,vr,vt,vp,vn,tau: vr)
+            const('VT', lambda a,b,c,d,C,k,vr,vt,vp,vn,tau: vt)
+            const('B', lambda a,b,c,d,C,k,vr,vt,vp,vn,tau: b)
+            const('H_C', lambda a,b,c,d,C,k,vr,vt,vp,vn,tau: h/C)
+            const('H_A', lambda a,b,c,d,C,k,vr,vt,vp,vn,tau: h*a)
+            const('H_TAU', lambda a,b,c,d,C,k,vr,vt,vp,vn,tau: h/tau)
+            print('        step_vec mv = v0 + H_C*(K*(v0 - VR)*(v0 - VT)'
+                  ' - u0 + i0 + inj);', file=f)
+            print('        step_vec mu = u0 + H_A*(B*(v0 - VR) - u0);', 
+                  file=f)
+            print('        step_vec mi = i0 + H_TAU*j0;', file=f)
+            print('        step_vec mj = j0 - H_TAU*(i0 + 2*j0);', file=f)
+            print(f'        *(step_vec *)&v[{b0}] = v0 + 2*H_C*(K*(mv - VR)'
+                  f'*(mv - VT) - mu + mi + inj);', file=f)
+            print(f'        *(step_vec *)&u[{b0}] = '
+                  f'u0 + 2*H_A*(B*(mv - VR) - mu);', file=f)
+            print(f'        *(step_vec *)&si[{b0}] = i0 + 2*H_TAU*mj;', 
+                  file=f)
+            print(f'        *(step_vec *)&sj[{b0}] = '
+                  f'j0 - 2*H_TAU*(mi + 2*mj);', file=f)
+            print('    }', file=f)
+        print(file=f)
+
+        for m, (flexor, extensor) in enumerate(self.motor_map()):
+            print(f'    activation[{m}] = v[{flexor}] - v[{extensor}];', 
+                  file=f)
+        print('    return fired;\n}', file=f)
+
+    def dump_trace(self, f=None, n_steps=20000, dt=0.5):
+        """
+        Runs the model open loop for n_steps steps of dt ms from its
+        starting state, with the actuators held still, and prints every
+        cell's voltage after each step as CSV, for comparison against
+        the C engines (see fixcheck.c).
+        """
+        pos = np.full(self.n_muscles, 0.5)
+        print('t,' + ','.join(f'V{i}' for i in range(self.N)), file=f)
+        for step in range(n_steps):
+            self.step(dt=dt, pos=pos)
+            print(f'{step*dt!r},' + ','.join(repr(float(v)) for v in self.V),
+                  file=f)
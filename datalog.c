@@ -0,0 +1,414 @@
+/*
+ *
+ * datalog.c
+ *
+ * Data logging for the control loop. The loop itself only copies
+ * numbers into a preallocated ring of fixed-size records, and a
+ * low-priority background thread drains the ring to disk, so there is
+ * no formatting and no system call in the real-time path. The log is
+ * written either as the usual CSV or, if the filename ends in ".bin",
+ * as the raw records, which logdump turns back into CSV later.
+ *
+ * For long runs, a filename ending in ".nbz" gets a compressed columnar
+ * log instead (see struct column_log_header). The writer gathers a
+ * block of rows, quantizes each column and stores it as the second
+ * differences of its values in zigzag varints: voltages that are
+ * resting or on a steady slope and ADC readings that aren't changing
+ * take a byte a value, instead of ten or so as text. Each block stands
+ * alone, and an index of them at the end lets a reader seek straight
+ * to a time range. logdump turns these back into CSV too, and
+ * logreader.py loads them into NumPy arrays.
+ */
+
+#include <pthread.h>
+
+#include "libneurobot.h"
+
+
+/* Number of records the ring can hold; must be a power of two. */
+#define LOG_RING_RECORDS 4096
+
+/* How long the writer naps when it finds the ring empty. */
+#define LOG_IDLE_US 2000
+
+/*
+ * How many times a blocked loop checks the ring before napping, and for
+ * how long. It has to sleep rather than yield: under -R it outranks the
+ * demoted writer, which might otherwise never get the CPU to drain it.
+ */
+#define LOG_BLOCK_SPINS 1000
+#define LOG_BLOCK_NAP_US 100
+
+/* Rows per compressed block, about half a second at the defaults. */
+#define COLUMN_BLOCK_ROWS 1024
+
+/*
+ * Resolution of the compressed log's values: exact for single ADC
+ * samples, and a quarter of a microvolt for voltages.
+ */
+#define COLUMN_QUANTUM (1.f/4096)
+
+/* Quantized values are kept well inside 64 bits, differences and all. */
+#define COLUMN_MAX_QUANTIZED 1e15
+
+
+FILE *g_logfile = NULL;
+static enum { LOG_CSV, LOG_BINARY, LOG_COLUMNS } g_log_format = LOG_CSV;
+static enum log_overflow g_log_overflow = LOG_DROP;
+
+/* The header line, built up by datalogf() before the log starts. */
+static char *g_log_header = NULL;
+static size_t g_log_header_len = 0;
+
+/*
+ * The ring itself. The producer (the control loop) owns g_ring_head
+ * and the consumer (the writer thread) owns g_ring_tail; both only
+ * ever increase, and each is published to the other side with
+ * release/acquire ordering, so no locks are needed.
+ */
+static bool g_log_started = false;
+static char *g_ring = NULL;
+static int g_log_values = 0;
+static size_t g_record_size = 0;
+static size_t g_ring_head = 0, g_ring_tail = 0;
+static bool g_log_stopping = false;
+static pthread_t g_log_thread;
+
+/* Where rows go when there's nowhere else to put them. */
+static struct log_record *g_scratch_record = NULL;
+static bool g_row_dropped = false, g_row_skipped = false;
+static long g_log_dropped = 0;
+
+/* Only every so many I/O ticks are logged (-L). */
+static int g_log_every = 1;
+
+/*
+ * The compressed log's block being filled, column by column with the
+ * step numbers first, and the index of the blocks written so far.
+ * Only the writer thread touches these.
+ */
+static int64_t *g_block = NULL;
+static int g_block_rows = 0;
+static uint8_t *g_block_bytes = NULL;
+static struct column_index_entry *g_index = NULL;
+static uint32_t g_n_blocks = 0, g_index_size = 0;
+static uint64_t g_log_offset = 0;
+
+
+static struct log_record *ring_record(size_t index)
+{
+    index &= LOG_RING_RECORDS - 1;
+    return (struct log_record *)(g_ring + index*g_record_size);
+}
+
+
+static void write_bytes(const void *data, size_t size)
+{
+    fwrite(data, 1, size, g_logfile);
+    g_log_offset += size;
+}
+
+
+static uint8_t *put_varint(uint8_t *out, uint64_t x)
+{
+    for (; x >= 0x80; x >>= 7) *out++ = x | 0x80;
+    *out++ = x;
+    return out;
+}
+
+
+/* Encode one column of the block, in place of its quantized values. */
+static uint8_t *put_column(uint8_t *out, const int64_t *q, int n)
+{
+    uint64_t previous = 0, delta = 0;
+    for (int k = 0; k < n; k++) {
+        /* Unsigned, so that wild values wrap rather than overflow. */
+        uint64_t d = k ? (uint64_t)q[k] - previous : 0;
+        uint64_t r = k == 0 ? (uint64_t)q[0] : k == 1 ? d : d - delta;
+        previous = q[k];
+        delta = d;
+        out = put_varint(out, (r << 1) ^ -(r >> 63));
+    }
+    return out;
+}
+
+
+/* Compress the block gathered so far, write it out and index it. */
+static void write_block()
+{
+    if (!g_block_rows) return;
+
+    uint8_t *out = g_block_bytes;
+    for (int c = 0; c <= g_log_values; c++)
+        out = put_column(out, g_block + c*COLUMN_BLOCK_ROWS, g_block_rows);
+
+    if (g_n_blocks == g_index_size) {
+        g_index_size = g_index_size ? 2*g_index_size : 64;
+        g_index = realloc(g_index, g_index_size * sizeof *g_index);
+        if (!g_index) die("Couldn't grow log index", NULL);
+    }
+    g_index[g_n_blocks++] = (struct column_index_entry){
+        .first_step = g_block[0], .offset = g_log_offset
+    };
+
+    struct column_block_header header = {
+        .magic = COLUMN_BLOCK_MAGIC, .n_rows = g_block_rows,
+        .size = out - g_block_bytes, .first_step = g_block[0]
+    };
+    write_bytes(&header, sizeof header);
+    write_bytes(g_block_bytes, header.size);
+    g_block_rows = 0;
+}
+
+
+static int64_t quantize(float value)
+{
+    float x = value / COLUMN_QUANTUM;
+    if (!(x > -COLUMN_MAX_QUANTIZED)) x = x != x ? 0 : -COLUMN_MAX_QUANTIZED;
+    if (x > COLUMN_MAX_QUANTIZED) x = COLUMN_MAX_QUANTIZED;
+    return llrintf(x);
+}
+
+
+static void add_column_row(const struct log_record *rec)
+{
+    int64_t *column = g_block + g_block_rows;
+    *column = rec->step;
+    for (int i = 0; i < g_log_values; i++)
+        column[(i+1) * COLUMN_BLOCK_ROWS] = quantize(rec->values[i]);
+    if (++g_block_rows == COLUMN_BLOCK_ROWS) write_block();
+}
+
+
+/* The last block, then the index and the trailer that finds it. */
+static void finish_column_log()
+{
+    write_block();
+    struct column_log_trailer trailer = {
+        .index_offset = g_log_offset, .n_blocks = g_n_blocks,
+        .magic = COLUMN_INDEX_MAGIC
+    };
+    write_bytes(g_index, g_n_blocks * sizeof *g_index);
+    write_bytes(&trailer, sizeof trailer);
+}
+
+
+/*
+ * Format one record the same way the controllers used to print each
+ * step, just dump it as-is for a binary log, or add it to the block for
+ * a compressed one.
+ */
+static void write_record(const struct log_record *rec)
+{
+    if (g_log_format == LOG_BINARY) {
+        fwrite(rec, g_record_size, 1, g_logfile);
+        return;
+    }
+    if (g_log_format == LOG_COLUMNS) {
+        add_column_row(rec);
+        return;
+    }
+
+    fprintf(g_logfile, "%f", (float)(rec->step * dt_ms()));
+    for (int i = 0; i < g_log_values; i++)
+        fprintf(g_logfile, ", %f", rec->values[i]);
+    fputc('\n', g_logfile);
+}
+
+
+static void *log_writer(void *arg)
+{
+    (void)arg;
+
+    /* Stay out of the way of the control loop. */
+    demote_thread();
+
+    size_t tail = g_ring_tail;
+    for (;;) {
+        bool stopping = __atomic_load_n(&g_log_stopping, __ATOMIC_ACQUIRE);
+        size_t head = __atomic_load_n(&g_ring_head, __ATOMIC_ACQUIRE);
+
+        if (tail == head) {
+            if (stopping) break;
+            fflush(g_logfile);
+            usleep(LOG_IDLE_US);
+            continue;
+        }
+
+        for (; tail != head; tail++) {
+            write_record(ring_record(tail));
+            __atomic_store_n(&g_ring_tail, tail+1, __ATOMIC_RELEASE);
+        }
+    }
+
+    if (g_log_format == LOG_COLUMNS) finish_column_log();
+    fflush(g_logfile);
+    return NULL;
+}
+
+
+/*
+ * Store the pointer to the logfile object for debug logging.
+ */
+void open_logfile(const char *path)
+{
+    size_t len = strlen(path);
+    if (len > 4 && !strcmp(path + len - 4, ".bin")) g_log_format = LOG_BINARY;
+    if (len > 4 && !strcmp(path + len - 4, ".nbz")) g_log_format = LOG_COLUMNS;
+
+    if (!strncmp("-", path, 2)) g_logfile = stdout;
+    else g_logfile = fopen(path, "w");
+
+    if (g_logfile == NULL) {
+        perror("Couldn't open logfile");
+        exit(1);
+    }
+}
+
+
+void set_log_overflow(enum log_overflow policy)
+{
+    g_log_overflow = policy;
+}
+
+
+void set_log_decimation(int every)
+{
+    g_log_every = every;
+}
+
+
+/*
+ * Before the log has started, this builds up the header line; there
+ * is deliberately no way to write formatted text from the loop itself.
+ */
+int datalogf(const char *fmt, ...)
+{
+    if (g_logfile == NULL || g_log_started) return 0;
+
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    g_log_header = realloc(g_log_header, g_log_header_len + len + 1);
+    if (!g_log_header) die("Couldn't grow log header", NULL);
+
+    va_start(args, fmt);
+    vsnprintf(g_log_header + g_log_header_len, len + 1, fmt, args);
+    va_end(args);
+    g_log_header_len += len;
+    return len;
+}
+
+
+/*
+ * Fix the number of values logged per step, write out the header, and
+ * start the writer thread. The ring is allocated and touched up front
+ * so the loop never takes a page fault on it.
+ */
+void start_log(int n_values)
+{
+    g_log_values = n_values;
+    g_record_size = sizeof(struct log_record) + n_values*sizeof(float);
+    g_record_size = (g_record_size + 7) & ~(size_t)7;
+
+    g_scratch_record = calloc(1, g_record_size);
+    if (!g_scratch_record) die("Couldn't allocate log record", NULL);
+    if (g_logfile == NULL) return;
+
+    g_ring = malloc(LOG_RING_RECORDS * g_record_size);
+    if (!g_ring) die("Couldn't allocate log ring", NULL);
+    memset(g_ring, 0, LOG_RING_RECORDS * g_record_size);
+
+    if (g_log_format == LOG_BINARY) {
+        struct log_file_header header = {
+            .magic = LOG_MAGIC, .version = LOG_VERSION,
+            .n_values = n_values, .record_size = g_record_size,
+            .dt_us = g_dt_us, .header_len = g_log_header_len
+        };
+        fwrite(&header, sizeof header, 1, g_logfile);
+        fwrite(g_log_header, 1, g_log_header_len, g_logfile);
+    } else if (g_log_format == LOG_COLUMNS) {
+        size_t n = (n_values + 1) * COLUMN_BLOCK_ROWS;
+        g_block = malloc(n * sizeof *g_block);
+        g_block_bytes = malloc(n * 10);  /* The longest varints. */
+        if (!g_block || !g_block_bytes)
+            die("Couldn't allocate log block", NULL);
+
+        struct column_log_header header = {
+            .magic = COLUMN_LOG_MAGIC, .version = COLUMN_LOG_VERSION,
+            .n_values = n_values, .block_rows = COLUMN_BLOCK_ROWS,
+            .dt_us = g_dt_us, .header_len = g_log_header_len,
+            .quantum = COLUMN_QUANTUM
+        };
+        write_bytes(&header, sizeof header);
+        write_bytes(g_log_header, g_log_header_len);
+    } else {
+        fprintf(g_logfile, "%.*s\n", (int)g_log_header_len,
+                g_log_header ? g_log_header : "");
+    }
+
+    if (pthread_create(&g_log_thread, NULL, log_writer, NULL))
+        die("Couldn't start log writer", NULL);
+    g_log_started = true;
+}
+
+
+/*
+ * Get the row for this step's logged values. If the ring is full, the
+ * overflow policy decides whether to wait for the writer or hand back
+ * a scratch row whose contents are thrown away and counted. Ticks the
+ * decimation leaves out get the scratch row too, uncounted.
+ */
+float *log_row()
+{
+    g_row_dropped = false;
+    g_row_skipped = g_shedding || g_num_dts / g_io_steps % g_log_every != 0;
+    if (!g_log_started || g_row_skipped) return g_scratch_record->values;
+
+    size_t head = g_ring_head;
+    for (int spin = 0; head - __atomic_load_n(&g_ring_tail, __ATOMIC_ACQUIRE)
+            >= LOG_RING_RECORDS; spin++) {
+        if (g_log_overflow == LOG_DROP) {
+            g_row_dropped = true;
+            return g_scratch_record->values;
+        }
+        if (spin < LOG_BLOCK_SPINS) cpu_relax();
+        else usleep(LOG_BLOCK_NAP_US);
+    }
+    return ring_record(head)->values;
+}
+
+
+/* Hand the row from log_row() over to the writer. */
+void log_commit()
+{
+    if (!g_log_started || g_row_skipped) return;
+    if (g_row_dropped) {
+        g_log_dropped++;
+        return;
+    }
+
+    ring_record(g_ring_head)->step = g_num_dts;
+    __atomic_store_n(&g_ring_head, g_ring_head + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Let the writer drain whatever is left in the ring, then close up.
+ */
+void close_log()
+{
+    if (g_log_started) {
+        __atomic_store_n(&g_log_stopping, true, __ATOMIC_RELEASE);
+        pthread_join(g_log_thread, NULL);
+        g_log_started = false;
+
+        if (g_log_dropped)
+            fprintf(stderr, "Dropped %ld log records.\n", g_log_dropped);
+    }
+
+    if (g_logfile != NULL && g_logfile != stdout) fclose(g_logfile);
+    g_logfile = NULL;
+}
@@ -0,0 +1,261 @@
+/*
+ *
+ * fixcheck.c
+ *
+ * How far the fixed-point engine's trajectories stray from the float
+ * engine's on one generated CPG, and with -P how far both stray from the
+ * Python model's, given a trace of it from "python3 forwards.py --trace
+ * STEPS file". Like the sweep, it's built per network ("make
+ * fixcheck_forwards").
+ *
+ * Both engines start the way CPGBase.start() does, with cell 0 firing
+ * on the first step, and run the simulated actuators in closed loop;
+ * the feedback is off by default since the Python model has none.
+ * For each pair of runs it reports the largest voltage difference over
+ * the first 100ms, the first second and the whole run, when any cell
+ * first differs by more than ONSET_MV, the spike counts, and the mean
+ * error in the timing of each cell's spikes, paired off in order.
+ *
+ */
+
+#include "libneurobot.h"
+
+#include NETWORK
+
+#define DEFAULT_STEPS 20000
+
+/* A difference in any voltage that counts as the runs having diverged. */
+#define ONSET_MV 1.f
+
+/* Lengths of the windows the largest difference is reported over. */
+static const float window_ms[] = {100, 1000};
+#define N_WINDOWS (int)(sizeof window_ms / sizeof *window_ms)
+
+/* Every cell's voltage after each step of one run, and what it cost. */
+struct trace {
+    const char *name;
+    long n_steps;
+    float *v;
+    uint64_t ns;
+};
+
+struct divergence {
+    float max_dv[N_WINDOWS + 1];
+    long onset;
+    long spikes_a, spikes_b;
+    float spike_dt;
+};
+
+static SIMD_ALIGN float g_i_in[N_PADDED];
+static SIMD_ALIGN float g_v0[N_PADDED], g_u0[N_PADDED];
+static SIMD_ALIGN float g_i0[N_PADDED], g_j0[N_PADDED];
+static struct fixed_network *g_fixed = NULL;
+
+
+static float *alloc_trace(long n_steps)
+{
+    float *v = malloc(n_steps * N_CELLS * sizeof *v);
+    if (!v) die("Couldn't allocate trace", NULL);
+    return v;
+}
+
+
+static void run(bool fixed, long n_steps, float feedback, struct trace *t)
+{
+    memcpy(network.v, g_v0, sizeof g_v0);
+    memcpy(network.u, g_u0, sizeof g_u0);
+    memcpy(network.i, g_i0, sizeof g_i0);
+    memcpy(network.j, g_j0, sizeof g_j0);
+    memset(g_i_in, 0, sizeof g_i_in);
+    network.v[0] = network.vp[0];
+
+    network.fixed = NULL;
+    if (fixed) {
+        network.fixed = g_fixed;
+        start_fixed_point(&network, &synapses);
+        g_fixed = network.fixed;
+    }
+
+    t->name = fixed ? "fixed" : "float";
+    t->n_steps = n_steps;
+    t->v = alloc_trace(n_steps);
+
+    float position[4], signed_duty[4];
+    for (int a = 0; a < 4; a++) position[a] = SIM_START_POSITION;
+    float dt_s = dt_ms() / MS_PER_SEC;
+
+    uint64_t start_ns = now_ns();
+    for (long step = 0; step < n_steps; step++) {
+        check_spikes_all(&network, NULL);
+        synaptic_currents(&synapses, &network, g_i_in);
+        feedback_currents(feedback_taps, N_FEEDBACK, position, feedback,
+                g_i_in);
+        resolve_dynamics_all(&network, g_i_in);
+
+        for (int m = 0; m < N_MOTORS && m < 4; m++) {
+            float a = motor_activation(&network, &motors[m]);
+            if (a > 1) a = 1;
+            if (a < -1) a = -1;
+            signed_duty[m] = a * g_pwm_max;
+        }
+        plant_advance(position, signed_duty, dt_s);
+        memcpy(&t->v[step * N_CELLS], network.v, N_CELLS * sizeof(float));
+    }
+    t->ns = now_ns() - start_ns;
+}
+
+
+/*
+ * Read a trace written by the Python side: a header line, then one
+ * line per step of the time in ms and every cell's voltage.
+ */
+static void read_trace(const char *path, long n_steps, struct trace *t)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) die("Couldn't open Python trace", path);
+
+    char *line = NULL;
+    size_t size = 0;
+    if (getline(&line, &size, f) < 0) die("Empty Python trace", path);
+    int n_columns = 1;
+    for (char *c = line; *c; c++) n_columns += *c == ',';
+    if (n_columns != N_CELLS + 1)
+        die("Python trace is for a different network", path);
+
+    t->name = "python";
+    t->v = alloc_trace(n_steps);
+    t->ns = 0;
+    long step = 0;
+    for (; step < n_steps && getline(&line, &size, f) > 0; step++) {
+        char *p = line, *end;
+        float time = strtod(p, &end);
+        if (fabsf(time - step * dt_ms()) > 1e-3f)
+            die("Python trace has a different timestep", path);
+        for (int c = 0; c < N_CELLS; c++) {
+            if (*end != ',') die("Malformed Python trace", path);
+            p = end + 1;
+            t->v[step * N_CELLS + c] = strtod(p, &end);
+        }
+    }
+    t->n_steps = step;
+    free(line);
+    fclose(f);
+}
+
+
+/* The first step from the given one on where the cell fired. */
+static long next_spike(const struct trace *t, int c, long from, long n)
+{
+    for (long s = from > 1 ? from : 1; s < n; s++)
+        if (t->v[(s-1) * N_CELLS + c] >= network.vp[c]) return s;
+    return -1;
+}
+
+
+static void compare(const struct trace *a, const struct trace *b,
+        struct divergence *d)
+{
+    long n = a->n_steps < b->n_steps ? a->n_steps : b->n_steps;
+    memset(d, 0, sizeof *d);
+    d->onset = -1;
+
+    for (long s = 0; s < n; s++) {
+        float dv = 0;
+        for (int c = 0; c < N_CELLS; c++) {
+            float diff = fabsf(a->v[s*N_CELLS + c] - b->v[s*N_CELLS + c]);
+            if (diff > dv) dv = diff;
+        }
+        if (dv > ONSET_MV && d->onset < 0) d->onset = s;
+        for (int w = 0; w <= N_WINDOWS; w++) {
+            bool inside = w == N_WINDOWS || s * dt_ms() < window_ms[w];
+            if (inside && dv > d->max_dv[w]) d->max_dv[w] = dv;
+        }
+    }
+
+    double sum_dt = 0;
+    long n_paired = 0;
+    for (int c = 0; c < N_CELLS; c++) {
+        long sa = 0, sb = 0;
+        for (long s = 0; (s = next_spike(a, c, s, n)) >= 0; s++)
+            d->spikes_a++;
+        for (long s = 0; (s = next_spike(b, c, s, n)) >= 0; s++)
+            d->spikes_b++;
+        for (;;) {
+            sa = next_spike(a, c, sa, n);
+            sb = next_spike(b, c, sb, n);
+            if (sa < 0 || sb < 0) break;
+            sum_dt += labs(sa - sb) * dt_ms();
+            n_paired++;
+            sa++, sb++;
+        }
+    }
+    d->spike_dt = n_paired ? sum_dt / n_paired : NAN;
+}
+
+
+static void report(const struct trace *a, const struct trace *b)
+{
+    struct divergence d;
+    compare(a, b, &d);
+
+    char name[32];
+    snprintf(name, sizeof name, "%s vs %s", a->name, b->name);
+    printf("%-16s", name);
+    for (int w = 0; w <= N_WINDOWS; w++) printf(" %9.3g", d.max_dv[w]);
+    if (d.onset < 0) printf(" %10s", "never");
+    else printf(" %10.1f", d.onset * dt_ms());
+    printf(" %6ld/%-6ld %10.3g\n", d.spikes_a, d.spikes_b, d.spike_dt);
+}
+
+
+int main(int argc, char **argv)
+{
+    float feedback = 0;
+    long n_steps = DEFAULT_STEPS;
+    const char *python_path = NULL;
+
+    int opt;
+    char *endptr;
+    while ((opt = getopt(argc, argv, COMMON_OPTIONS "k:n:P:")) != -1) {
+        if (opt == 'k') {
+            feedback = strtod(optarg, &endptr);
+            if (*endptr != '\0') die("Invalid feedback constant", optarg);
+        } else if (opt == 'n') {
+            n_steps = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || n_steps < 1)
+                die("Invalid number of steps", optarg);
+        } else if (opt == 'P') {
+            python_path = optarg;
+        } else if (!common_option(opt, optarg))
+            die("Unrecognized argument", NULL);
+    }
+    if (optind != argc) die("Too many arguments!", NULL);
+    if (python_path && feedback != 0)
+        die("The Python model has no feedback; leave out -k", NULL);
+
+    memcpy(g_v0, network.v, sizeof g_v0);
+    memcpy(g_u0, network.u, sizeof g_u0);
+    memcpy(g_i0, network.i, sizeof g_i0);
+    memcpy(g_j0, network.j, sizeof g_j0);
+
+    struct trace fl, fx, py;
+    run(false, n_steps, feedback, &fl);
+    run(true, n_steps, feedback, &fx);
+
+    printf("%d cells, %ld steps of %gms, feedback %g; float %.1f ns/step, "
+            "fixed %.1f ns/step.\n", N_CELLS, n_steps, dt_ms(), feedback,
+            (double)fl.ns / n_steps, (double)fx.ns / n_steps);
+    printf("%-16s %29s %10s %13s %10s\n", "", "max |dV| (mV) over",
+            "diverged", "spikes", "spike dt");
+    printf("%-16s", "comparison");
+    for (int w = 0; w < N_WINDOWS; w++)
+        printf(" %7gms", window_ms[w]);
+    printf(" %9s %10s %13s %10s\n", "all", "at (ms)", "", "(ms)");
+
+    report(&fx, &fl);
+    if (python_path) {
+        read_trace(python_path, n_steps, &py);
+        report(&fl, &py);
+        report(&fx, &py);
+    }
+}
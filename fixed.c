@@ -0,0 +1,307 @@
+/*
+ *
+ * fixed.c
+ *
+ * A fixed-point version of the network engine, for targets without a
+ * usable FPU and for dynamics that don't depend on how the compiler
+ * treats floating point. The state is scaled 32-bit integers and every
+ * operation saturates rather than wrapping:
+ *
+ *   v, u, currents, and the cell parameters   Q16.16  (to ±32768)
+ *   synaptic i and j                          Q6.26   (to ±32)
+ *   step coefficients h/C, h*a, h/tau         Q3.29   (to ±4)
+ *
+ * Products are formed in 64 bits and rounded to nearest on the way back
+ * down. The quantization error of one step is then a few units in the
+ * last place of each variable, about 1e-5 mV in v; the dynamics amplify
+ * it like any other perturbation, so trajectories track the float
+ * engine's closely until one cell's spike lands on a different step
+ * (fixcheck.c measures how long that takes).
+ *
+ * Only the midpoint method is implemented. The engine attaches to a
+ * float network and takes over its state; the float arrays are kept
+ * up to date as a copy after every step, so logging and motor
+ * activation work unchanged, and the batch routines in libneurobot.c
+ * hand over to the functions here whenever net->fixed is set. The
+ * synaptic currents, conductance scale included, are summed here in
+ * Q16.16 and stay that way: fixed_synaptic_currents() keeps them in the
+ * engine and zeroes i_in, so that i_in carries only what the caller
+ * adds on top. Right shifts of negative numbers are assumed to be
+ * arithmetic, as they are on every compiler we care about.
+ *
+ * Those other inputs are still floats, though: the feedback current
+ * (feedback_currents(), from the actuator positions) and any external
+ * currents are summed in float arithmetic built with -ffast-math, then
+ * rounded to Q16.16 once per cell per step. A different compiler or
+ * different flags can round those sums differently, and the difference
+ * then grows like any other. So only runs with no feedback and no
+ * external input repeat bit for bit across builds; otherwise the engine
+ * is exact only given the same input currents.
+ *
+ */
+
+#include "libneurobot.h"
+
+
+typedef int32_t fix_t;
+
+#define FIX_SHIFT 16
+#define SYN_SHIFT 26
+#define COEF_SHIFT 29
+
+#define SYN_ONE ((fix_t)1 << SYN_SHIFT)
+
+/* One cell's parameters, and its coefficients for a step of some h. */
+struct fixed_cell {
+    fix_t k, b, vr, vt, vp, c, d;
+};
+
+struct fixed_coefs {
+    fix_t h_C, h_a, h_tau;
+};
+
+struct fixed_synapse {
+    int pre;
+    fix_t g, vn;
+};
+
+struct fixed_state {
+    fix_t v, u, i, j;
+};
+
+struct fixed_network {
+    struct fixed_state *state;
+    struct fixed_cell *cell;
+    struct fixed_coefs *full, *half;
+    const int *row;
+    struct fixed_synapse *syn;
+    fix_t *i_syn;
+};
+
+
+static inline fix_t saturate(int64_t x)
+{
+    return x > INT32_MAX ? INT32_MAX : x < INT32_MIN ? INT32_MIN : x;
+}
+
+static inline fix_t add(fix_t a, fix_t b)
+{
+    return saturate((int64_t)a + b);
+}
+
+static inline fix_t sub(fix_t a, fix_t b)
+{
+    return saturate((int64_t)a - b);
+}
+
+/* The product of a and b, shifted back down by shift bits. */
+static inline int64_t product(fix_t a, fix_t b, int shift)
+{
+    return ((int64_t)a * b + ((int64_t)1 << (shift - 1))) >> shift;
+}
+
+static inline fix_t mul(fix_t a, fix_t b)
+{
+    return saturate(product(a, b, FIX_SHIFT));
+}
+
+/* A coefficient times a value in any format, in the same format. */
+static inline fix_t scale(fix_t coef, fix_t x)
+{
+    return saturate(product(coef, x, COEF_SHIFT));
+}
+
+
+/* Scaling by a power of two is exact, and the rounding is done by hand
+ * so as not to depend on the FPU's rounding mode. */
+static inline fix_t to_fix(float x, int shift)
+{
+    float scaled = x * (float)(1 << shift);
+    if (scaled >= 2147483520.f) return INT32_MAX;
+    if (scaled <= -2147483648.f) return INT32_MIN;
+    return scaled + (scaled < 0 ? -0.5f : 0.5f);
+}
+
+static inline float from_fix(fix_t x, int shift)
+{
+    return x * (1.f / (1 << shift));
+}
+
+
+static void fill_coefs(const struct network *net, float h,
+        struct fixed_coefs *coefs)
+{
+    for (int i = 0; i < net->n; i++) {
+        float h_tau = h * net->inv_tau[i];
+        if (h_tau >= 1 << (31 - COEF_SHIFT))
+            die("Timestep too long for the fixed-point engine", NULL);
+        coefs[i].h_C = to_fix(h * net->inv_C[i], COEF_SHIFT);
+        coefs[i].h_a = to_fix(h * net->a[i], COEF_SHIFT);
+        coefs[i].h_tau = to_fix(h_tau, COEF_SHIFT);
+    }
+}
+
+
+/* Write one cell's state back to the float arrays. */
+static void export_cell(struct network *net, int c)
+{
+    const struct fixed_state *x = &net->fixed->state[c];
+    net->v[c] = from_fix(x->v, FIX_SHIFT);
+    net->u[c] = from_fix(x->u, FIX_SHIFT);
+    net->i[c] = from_fix(x->i, SYN_SHIFT);
+    net->j[c] = from_fix(x->j, SYN_SHIFT);
+}
+
+
+/*
+ * Reload one cell's state from the float arrays, for anything that
+ * changes it from outside the engine.
+ */
+void fixed_import(struct network *net, int c)
+{
+    struct fixed_state *x = &net->fixed->state[c];
+    x->v = to_fix(net->v[c], FIX_SHIFT);
+    x->u = to_fix(net->u[c], FIX_SHIFT);
+    x->i = to_fix(net->i[c], SYN_SHIFT);
+    x->j = to_fix(net->j[c], SYN_SHIFT);
+}
+
+
+/*
+ * Convert the network's current state, parameters and synapses to fixed
+ * point and attach the result, after which the network runs in fixed
+ * point. Calling it again reloads the state from the float arrays.
+ */
+void start_fixed_point(struct network *net, const struct synapses *syn)
+{
+    if (g_integrator != INTEGRATE_MIDPOINT || g_substeps != 1)
+        die("The fixed-point engine only has the midpoint method", NULL);
+
+    struct fixed_network *fx = net->fixed;
+    int n = net->n, n_syn = syn->row[n];
+    if (!fx) {
+        fx = malloc(sizeof *fx);
+        if (fx) {
+            fx->state = malloc(n * sizeof *fx->state);
+            fx->cell = malloc(n * sizeof *fx->cell);
+            fx->full = malloc(n * sizeof *fx->full);
+            fx->half = malloc(n * sizeof *fx->half);
+            fx->syn = malloc(n_syn * sizeof *fx->syn);
+            fx->i_syn = malloc(n * sizeof *fx->i_syn);
+        }
+        if (!fx || !fx->state || !fx->cell || !fx->full || !fx->half
+                || (n_syn && !fx->syn) || !fx->i_syn)
+            die("Couldn't allocate fixed-point network", NULL);
+        net->fixed = fx;
+    }
+
+    for (int c = 0; c < n; c++) {
+        fx->cell[c] = (struct fixed_cell){
+            .k = to_fix(net->k[c], FIX_SHIFT),
+            .b = to_fix(net->b[c], FIX_SHIFT),
+            .vr = to_fix(net->vr[c], FIX_SHIFT),
+            .vt = to_fix(net->vt[c], FIX_SHIFT),
+            .vp = to_fix(net->vp[c], FIX_SHIFT),
+            .c = to_fix(net->c[c], FIX_SHIFT),
+            .d = to_fix(net->d[c], FIX_SHIFT),
+        };
+        fixed_import(net, c);
+        fx->i_syn[c] = 0;
+    }
+    fill_coefs(net, dt_ms(), fx->full);
+    fill_coefs(net, dt_ms()/2, fx->half);
+
+    fx->row = syn->row;
+    for (int k = 0; k < n_syn; k++) {
+        fx->syn[k] = (struct fixed_synapse){
+            .pre = syn->syn[k].pre,
+            .g = to_fix(syn->syn[k].g, FIX_SHIFT),
+            .vn = to_fix(syn->syn[k].vn, FIX_SHIFT),
+        };
+    }
+}
+
+
+int fixed_check_spikes(struct network *net, bool *fired)
+{
+    struct fixed_network *fx = net->fixed;
+    int n_fired = 0;
+    for (int c = 0; c < net->n; c++) {
+        struct fixed_state *x = &fx->state[c];
+        const struct fixed_cell *p = &fx->cell[c];
+        bool spike = x->v >= p->vp;
+        if (fired) fired[c] = spike;
+        if (!spike) continue;
+
+        x->v = p->c;
+        x->u = add(x->u, p->d);
+        x->j = add(x->j, SYN_ONE);
+        export_cell(net, c);
+        if (g_spike_log) log_spike(c);
+        n_fired++;
+    }
+    return n_fired;
+}
+
+
+/*
+ * The CSR gather of synaptic_currents(). Each term is rounded to Q16.16
+ * on its own and the sum kept in 64 bits, so the order doesn't matter;
+ * the conductance scale is applied in Q16.16 too. The result stays in
+ * the engine, and i_in is cleared for the float inputs.
+ */
+void fixed_synaptic_currents(const struct network *net, float *i_in)
+{
+    const struct fixed_network *fx = net->fixed;
+    fix_t g_scale = to_fix(g_conductance_scale, FIX_SHIFT);
+    for (int c = 0; c < net->n; c++) {
+        fix_t v = fx->state[c].v;
+        int64_t i_syn = 0;
+        for (int k = fx->row[c]; k < fx->row[c+1]; k++) {
+            const struct fixed_synapse *s = &fx->syn[k];
+            i_syn += product(mul(s->g, sub(s->vn, v)),
+                    fx->state[s->pre].i, SYN_SHIFT);
+        }
+        fx->i_syn[c] = mul(g_scale, saturate(i_syn));
+        i_in[c] = 0;
+    }
+}
+
+
+/* The change in state over h at the rates given by state x. */
+static inline struct fixed_state increment(struct fixed_state x, fix_t iin,
+        const struct fixed_cell *p, const struct fixed_coefs *h)
+{
+    fix_t i_na = mul(p->k, mul(sub(x.v, p->vr), sub(x.v, p->vt)));
+    fix_t i_syn = x.i >> (SYN_SHIFT - FIX_SHIFT);
+    return (struct fixed_state){
+        scale(h->h_C, add(add(sub(i_na, x.u), i_syn), iin)),
+        scale(h->h_a, sub(mul(p->b, sub(x.v, p->vr)), x.u)),
+        scale(h->h_tau, x.j),
+        sub(0, scale(h->h_tau, add(x.i, add(x.j, x.j))))
+    };
+}
+
+static inline struct fixed_state advance(struct fixed_state x,
+        struct fixed_state d)
+{
+    return (struct fixed_state){
+        add(x.v, d.v), add(x.u, d.u), add(x.i, d.i), add(x.j, d.j)
+    };
+}
+
+
+void fixed_resolve_dynamics(struct network *net, const float *i_in)
+{
+    struct fixed_network *fx = net->fixed;
+    for (int c = 0; c < net->n; c++) {
+        struct fixed_state x = fx->state[c];
+        const struct fixed_cell *p = &fx->cell[c];
+        fix_t iin = add(fx->i_syn[c], to_fix(i_in[c], FIX_SHIFT));
+
+        struct fixed_state mid = advance(x,
+                increment(x, iin, p, &fx->half[c]));
+        fx->state[c] = advance(x, increment(mid, iin, p, &fx->full[c]));
+        export_cell(net, c);
+    }
+}
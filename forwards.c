@@ -24,16 +24,13 @@ int main(int argc, char**argv)
 
     int opt;
     char *endptr;
-    while ((opt = getopt(argc, argv, "p:k:")) != -1) {
-        if (opt == 'p') {
-            set_pwm_max(strtod(optarg, &endptr));
-            if (endptr && *endptr != '\0')
-                die("Invalid PWM maximum", optarg);
-        } else if (opt == 'k') {
+    while ((opt = getopt(argc, argv, COMMON_OPTIONS "k:")) != -1) {
+        if (opt == 'k') {
             feedback = strtod(optarg, &endptr);
             if (endptr && *endptr != '\0') 
                 die("Invalid feedback constant", optarg);
-        } else die("Unrecognized argument", NULL);
+        } else if (!common_option(opt, optarg)) 
+            die("Unrecognized argument", NULL);
     }
 
     /* 
@@ -45,72 +42,69 @@ int main(int argc, char**argv)
         open_logfile(argv[optind]);
 
 
+    /* The control plane (-K) may retune this between ticks. */
+    control_bind(CONTROL_FEEDBACK, &feedback);
+
     setup();
     float actuator_position[4];
+    SIMD_ALIGN float i_in[N_PADDED] = {0};
 
-    states[0].v = 0;
+    network.v[0] = 0;
+    start_network(&network, &synapses);
     datalogf("t,A0,A1,A2,A3");
     for (int i=0; i<N_CELLS; i++)
         datalogf(",V%d", i);
-    datalogf("\n");
+    start_log(4 + N_CELLS);
     while (!g_please_die_kthxbai) {
-        datalogf("%f", get_current_time());
+        float *row = log_row();
 
         for (int i = 0; i < 4; ++i) {
             actuator_position[i] = read_adc(i);
-            datalogf(", %f", actuator_position[i]);
-        }
-
-        /* 
-         * Need to check all spikes before doing any dynamics for
-         * consistency with the Python version. 
-         */
-        for (int i = 0; i < N_CELLS; i++) {
-            check_spike(&states[i], params[i]);
+            row[i] = actuator_position[i];
         }
+        phase_done(PHASE_ADC);
 
-        /* 
-         * Now run the continuous dynamics, with input currents
-         * calculated both for the synapses and for feedback.
+        /*
+         * The network runs g_io_steps steps on each tick's readings,
+         * or more if it's catching up on an overrun.
          */
-        for (int i = 0; i < N_CELLS; i++) {
-            float i_in = 0;
+        for (int step = 0; step < g_tick_steps; step++) {
+            /* 
+             * Need to check all spikes before doing any dynamics for
+             * consistency with the Python version. 
+             */
+            check_spikes_all(&network, NULL);
+            phase_done(PHASE_SPIKES);
 
             /* 
-             * Compute synaptic current.
+             * Now run the continuous dynamics, with input currents
+             * calculated both for the synapses and for feedback.
              */
-            for (int j = 0; j < N_CELLS; j++) {
-                float deltaV = params[j]->vn - states[i].v;
-                i_in += G[i][j] * deltaV * states[j].i;
-            }
+            active_synaptic_currents(&fanout, &network, i_in);
 
             /* Compute feedback current. */
-            if (i < N_CELLS-4 && (i%3)==0) {
-                int prev = (i/3+3)%4;
-                int next = (i/3+1)%4;
-                
-                float prev_err = fabs(1 - actuator_position[prev]);
-                float next_err = fabs(0 - actuator_position[next]);
-                i_in += -feedback*(prev_err + next_err);
-            }
-
-            resolve_dynamics(&states[i], params[i], i_in);
-
-            float vlog = states[i].v;
-            if (vlog > params[i]->vp) vlog = params[i]->vp;
-            datalogf(", %f", vlog);
+            feedback_currents(feedback_taps, N_FEEDBACK, actuator_position,
+                    feedback, i_in);
+
+            resolve_dynamics_all(&network, i_in);
+            phase_done(PHASE_DYNAMICS);
         }
 
         /* This part actually communicates with the motor. */
-        for (int i = 0; i < 4; i++) {
-            int flexor = i + N_CELLS-4;
-            int extensor = (i + 2)%4 + N_CELLS-4;
-            float activation = states[flexor].v - states[extensor].v;
+        for (int i = 0; i < N_MOTORS; i++)
+            apply_actuator(i, motor_activation(&network, &motors[i]));
+        commit_actuators();
+        phase_done(PHASE_ACTUATOR);
 
-            apply_actuator(i, activation);
+        for (int i = 0; i < N_CELLS; i++) {
+            float vlog = network.v[i];
+            if (vlog > network.vp[i]) vlog = network.vp[i];
+            row[4+i] = vlog;
         }
 
-        datalogf("\n");
+        log_commit();
+        phase_done(PHASE_LOG);
+
         synchronize_loop();
     }
 
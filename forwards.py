@@ -41,7 +41,22 @@ if __name__ == '__main__':
     parser = argparse.ArgumentParser(
             description='Generate C code for a forward CPG.')
     parser.add_argument('file', help='output filename')
+    parser.add_argument('--step', action='store_true',
+            help='emit a specialized step function instead of the data')
+    parser.add_argument('--binary', action='store_true',
+            help='write a binary network file for the cpg controller')
+    parser.add_argument('--trace', type=int, metavar='STEPS',
+            help='run the Python model open loop and write its voltages')
+    parser.add_argument('--dt', type=float, default=0.5,
+            help='timestep in ms for --step and --trace')
     args = parser.parse_args()
 
-    with open(args.file, 'w') as f:
-        SingleCPG().dump_source(f)
+    with open(args.file, 'wb' if args.binary else 'w') as f:
+        if args.binary:
+            SingleCPG().dump_binary(f)
+        elif args.trace:
+            SingleCPG().dump_trace(f, args.trace, args.dt)
+        elif args.step:
+            SingleCPG().dump_step(f, args.dt)
+        else:
+            SingleCPG().dump_source(f)
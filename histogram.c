@@ -0,0 +1,76 @@
+/*
+ *
+ * histogram.c
+ *
+ * Streaming histograms of durations in nanoseconds, for the loop timing
+ * reports. Buckets are log-linear: exact below 2^HIST_SUB_BITS, then
+ * each power of two is split into 2^HIST_SUB_BITS equal buckets, which
+ * keeps quantiles within about 6% across the whole range for the price
+ * of a couple of kilobytes and a count-leading-zeros per sample.
+ *
+ */
+
+#include "libneurobot.h"
+
+
+static int bucket_index(uint32_t value)
+{
+    if (value < 2*HIST_SUB) return value;
+    int shift = 31 - __builtin_clz(value) - HIST_SUB_BITS;
+    return (shift + 1)*HIST_SUB + (value >> shift) - HIST_SUB;
+}
+
+/* The largest value that lands in a given bucket. */
+static uint64_t bucket_limit(int index)
+{
+    if (index < 2*HIST_SUB) return index;
+    int shift = index/HIST_SUB - 1;
+    uint64_t lower = (uint64_t)(HIST_SUB + index%HIST_SUB) << shift;
+    return lower + ((uint64_t)1 << shift) - 1;
+}
+
+
+void histogram_reset(struct histogram *h)
+{
+    memset(h, 0, sizeof *h);
+    h->min = UINT64_MAX;
+}
+
+
+void histogram_add(struct histogram *h, uint64_t value)
+{
+    h->count++;
+    h->sum += value;
+    if (value < h->min) h->min = value;
+    if (value > h->max) h->max = value;
+    h->buckets[bucket_index(value > UINT32_MAX ? UINT32_MAX : value)]++;
+}
+
+
+/*
+ * Estimate the given quantile (in [0,1]) as the upper edge of the
+ * bucket it falls in, which never understates a latency.
+ */
+uint64_t histogram_quantile(const struct histogram *h, double q)
+{
+    if (h->count == 0) return 0;
+
+    uint64_t rank = (uint64_t)ceil(q * h->count);
+    if (rank < 1) rank = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t limit = bucket_limit(i);
+            return limit < h->max ? limit : h->max;
+        }
+    }
+    return h->max;
+}
+
+
+uint64_t histogram_mean(const struct histogram *h)
+{
+    return h->count ? h->sum / h->count : 0;
+}
@@ -0,0 +1,273 @@
+/*
+ *
+ * integrate.c
+ *
+ * Batch integration of the continuous cell dynamics, VEC_WIDTH cells at
+ * a time. There's a choice of methods: forward Euler, the midpoint
+ * method the controllers have always used, classic RK4, and an
+ * exponential-Euler variant which propagates the synaptic i/j system
+ * exactly (it's linear, with a double eigenvalue at -1/tau) and uses
+ * the midpoint method for v and u. Everything that depends only on the
+ * cell parameters and the step size is worked out once per setting and
+ * kept in per-cell tables, so the loop itself is just multiply-adds.
+ *
+ * With substeps enabled, a vector of cells where any cell is above its
+ * threshold voltage vt at either end of the step, and so on the fast
+ * upswing of a spike, gets that many smaller steps instead of one;
+ * everywhere else the dynamics are slow enough for the full step. A cell
+ * that reaches its peak partway through is reset there, just as
+ * check_spikes_all() would, and carries on for the rest of the substeps,
+ * so both the reset and the synaptic kick land within a substep of the
+ * spike rather than at the next step. The next spike check counts it
+ * from fired_early. The logs only see the end of a step, so they don't
+ * show such a cell's peak.
+ *
+ */
+
+#include "libneurobot.h"
+
+
+#define MAX_SUBSTEPS 64
+
+const char *const integrator_names[N_INTEGRATORS] = {
+    [INTEGRATE_EULER] = "euler",
+    [INTEGRATE_MIDPOINT] = "midpoint",
+    [INTEGRATE_RK4] = "rk4",
+    [INTEGRATE_EXP] = "exp",
+};
+
+enum integrator g_integrator = INTEGRATE_MIDPOINT;
+int g_substeps = 1;
+
+
+void select_integrator(const char *name)
+{
+    for (int m = 0; m < N_INTEGRATORS; m++) {
+        if (!strcmp(name, integrator_names[m])) {
+            g_integrator = m;
+            return;
+        }
+    }
+    die("No such integrator", name);
+}
+
+
+static void fill_coefs(const struct network *net, float h,
+        struct step_coefs *c)
+{
+    for (int i = 0; i < PADDED(net->n); i++) {
+        float s = h * net->inv_tau[i];
+        c->h_C[i] = h * net->inv_C[i];
+        c->h_a[i] = h * net->a[i];
+        c->h_tau[i] = s;
+        c->decay[i] = expf(-s);
+        c->decay_s[i] = s * expf(-s);
+    }
+}
+
+
+/*
+ * Work out the coefficient tables for the current integrator, timestep
+ * and substeps, replacing any there were before. The tables are all
+ * carved out of one aligned block.
+ */
+void prepare_dynamics(struct network *net)
+{
+    if (g_substeps < 1 || g_substeps > MAX_SUBSTEPS)
+        die("Invalid number of substeps", NULL);
+
+    struct dynamics *dyn = net->dyn;
+    if (!dyn) {
+        size_t n = PADDED(net->n);
+        void *block = NULL;
+        dyn = malloc(sizeof *dyn);
+        if (!dyn || posix_memalign(&block, 4*NETWORK_PAD,
+                    4 * 5 * n * sizeof(float)))
+            die("Couldn't allocate integrator coefficients", NULL);
+        float *next = block;
+
+        struct step_coefs *sets[] = {
+            &dyn->full, &dyn->half, &dyn->sub_full, &dyn->sub_half
+        };
+        for (int k = 0; k < 4; k++) {
+            sets[k]->h_C = next; next += n;
+            sets[k]->h_a = next; next += n;
+            sets[k]->h_tau = next; next += n;
+            sets[k]->decay = next; next += n;
+            sets[k]->decay_s = next; next += n;
+        }
+        net->dyn = dyn;
+    }
+
+    if (g_substeps > 1 && !net->fired_early) {
+        size_t size = PADDED(net->n) * sizeof *net->fired_early;
+        if (posix_memalign((void **)&net->fired_early, 4*NETWORK_PAD, size))
+            die("Couldn't allocate substep spike flags", NULL);
+        memset(net->fired_early, 0, size);
+    }
+
+    dyn->method = g_integrator;
+    dyn->dt_us = g_dt_us;
+    dyn->substeps = g_substeps;
+
+    float dt = dt_ms(), sub = dt / g_substeps;
+    fill_coefs(net, dt, &dyn->full);
+    fill_coefs(net, dt/2, &dyn->half);
+    fill_coefs(net, sub, &dyn->sub_full);
+    fill_coefs(net, sub/2, &dyn->sub_half);
+}
+
+
+/* One vector of cells' state, parameters, and step coefficients. */
+struct vcell {
+    vfloat v, u, i, j;
+};
+
+struct vparams {
+    vfloat k, b, vr, vt;
+};
+
+struct vcoefs {
+    vfloat h_C, h_a, h_tau, decay, decay_s;
+};
+
+static inline struct vcoefs load_coefs(const struct step_coefs *c, int i)
+{
+    return (struct vcoefs){
+        VLOAD(&c->h_C[i]), VLOAD(&c->h_a[i]), VLOAD(&c->h_tau[i]),
+        VLOAD(&c->decay[i]), VLOAD(&c->decay_s[i])
+    };
+}
+
+
+/* The change in state over h at the rates given by state x. */
+static inline struct vcell increment(struct vcell x, vfloat iin,
+        const struct vparams *p, const struct vcoefs *c)
+{
+    return (struct vcell){
+        c->h_C * (p->k*(x.v - p->vr)*(x.v - p->vt) - x.u + x.i + iin),
+        c->h_a * (p->b*(x.v - p->vr) - x.u),
+        c->h_tau * x.j,
+        -c->h_tau * (x.i + 2*x.j)
+    };
+}
+
+static inline struct vcell add(struct vcell x, float s, struct vcell d)
+{
+    return (struct vcell){
+        x.v + s*d.v, x.u + s*d.u, x.i + s*d.i, x.j + s*d.j
+    };
+}
+
+/* The synaptic variables exactly h later. */
+static inline void propagate(struct vcell *x, const struct vcoefs *c)
+{
+    vfloat i = x->i, j = x->j;
+    x->i = (c->decay + c->decay_s)*i + c->decay_s*j;
+    x->j = -c->decay_s*i + (c->decay - c->decay_s)*j;
+}
+
+
+static inline struct vcell step(struct vcell x, vfloat iin,
+        const struct vparams *p, enum integrator method,
+        const struct vcoefs *full, const struct vcoefs *half)
+{
+    switch (method) {
+    case INTEGRATE_EULER:
+        return add(x, 1, increment(x, iin, p, full));
+
+    case INTEGRATE_MIDPOINT: {
+        struct vcell mid = add(x, 1, increment(x, iin, p, half));
+        return add(x, 1, increment(mid, iin, p, full));
+    }
+
+    case INTEGRATE_RK4: {
+        struct vcell k1 = increment(x, iin, p, full);
+        struct vcell k2 = increment(add(x, 0.5f, k1), iin, p, full);
+        struct vcell k3 = increment(add(x, 0.5f, k2), iin, p, full);
+        struct vcell k4 = increment(add(x, 1, k3), iin, p, full);
+        x = add(x, 1.f/6, k1);
+        x = add(x, 1.f/3, k2);
+        x = add(x, 1.f/3, k3);
+        return add(x, 1.f/6, k4);
+    }
+
+    case INTEGRATE_EXP:
+    default: {
+        struct vcell mid = add(x, 1, increment(x, iin, p, half));
+        mid.i = x.i;
+        mid.j = x.j;
+        propagate(&mid, half);
+        struct vcell out = add(x, 1, increment(mid, iin, p, full));
+        out.i = x.i;
+        out.j = x.j;
+        propagate(&out, full);
+        return out;
+    }
+    }
+}
+
+
+void resolve_dynamics_all(struct network *net, const float *i_in)
+{
+    if (net->fixed) {
+        fixed_resolve_dynamics(net, i_in);
+        return;
+    }
+
+    struct dynamics *dyn = net->dyn;
+    if (!dyn || dyn->method != g_integrator || dyn->dt_us != g_dt_us
+            || dyn->substeps != g_substeps)
+        prepare_dynamics(net);
+    resolve_dynamics_range(net, i_in, 0, net->n);
+}
+
+
+/*
+ * The same for cells lo up to hi, where lo is a multiple of VEC_WIDTH,
+ * with the coefficients already prepared.
+ */
+void resolve_dynamics_range(struct network *net, const float *i_in,
+        int lo, int hi)
+{
+    const struct dynamics *dyn = net->dyn;
+    for (int i = lo; i < hi; i += VEC_WIDTH) {
+        struct vcell x = {
+            VLOAD(&net->v[i]), VLOAD(&net->u[i]),
+            VLOAD(&net->i[i]), VLOAD(&net->j[i])
+        };
+        struct vparams p = {
+            VLOAD(&net->k[i]), VLOAD(&net->b[i]),
+            VLOAD(&net->vr[i]), VLOAD(&net->vt[i])
+        };
+        vfloat iin = VLOAD(&i_in[i]);
+
+        struct vcoefs full = load_coefs(&dyn->full, i);
+        struct vcoefs half = load_coefs(&dyn->half, i);
+        struct vcell next = step(x, iin, &p, dyn->method, &full, &half);
+
+        if (dyn->substeps > 1 && vany((x.v > p.vt) | (next.v > p.vt))) {
+            full = load_coefs(&dyn->sub_full, i);
+            half = load_coefs(&dyn->sub_half, i);
+            vfloat vp = VLOAD(&net->vp[i]), zero = {0};
+            vmask fired = {0};
+            for (int s = 0; s < dyn->substeps; s++) {
+                x = step(x, iin, &p, dyn->method, &full, &half);
+                vmask m = x.v >= vp;
+                if (!vany(m)) continue;
+                x.v = vselect(m, VLOAD(&net->c[i]), x.v);
+                x.u += vselect(m, VLOAD(&net->d[i]), zero);
+                x.j += vselect(m, zero + 1, zero);
+                fired |= m;
+            }
+            *(vmask *)&net->fired_early[i] = fired;
+        } else {
+            x = next;
+        }
+
+        VSTORE(&net->v[i], x.v);
+        VSTORE(&net->u[i], x.u);
+        VSTORE(&net->i[i], x.i);
+        VSTORE(&net->j[i], x.j);
+    }
+}
@@ -8,29 +8,52 @@
  * neurobot module thanks to cffi. :)
  */
 
-#include <libpruio/pruio.h>
-#include <libpruio/pruio_pins.h>
+#define _GNU_SOURCE
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 #include "libneurobot.h"
 
 
-/* Constant PWM frequency. */
-#define PWM_FREQ_HZ 200.f
-
-
-
+/*
+ * The I/O backends compiled into this build, in order of preference;
+ * see backend_*.c. The host build leaves out the PRU, since libpruio
+ * only exists on the BeagleBone.
+ */
+static const struct backend *const g_backends[] = {
+#ifndef NO_PRUIO
+    &pruio_backend,
+#endif
+    &sim_backend,
+};
+#define N_BACKENDS (sizeof g_backends / sizeof g_backends[0])
 
-FILE *g_logfile = NULL;
-pruIo *g_pru = NULL;
-uint8_t g_pinmodes[4] = {};
+const struct backend *g_backend = NULL;
 
-const int pwm_pins[4] = {
-    P9_31, P9_29, P9_14, P9_16
-};
+void select_backend(const char *name)
+{
+    for (size_t i = 0; i < N_BACKENDS; i++) {
+        if (!strcmp(g_backends[i]->name, name)) {
+            g_backend = g_backends[i];
+            return;
+        }
+    }
+    die("No such backend in this build", name);
+}
 
-const int gpio_pins[4] = {
-    P8_07, P8_08, P8_10, P8_09
-};
+/*
+ * Streaming acquisition: off unless a sample rate is given (-S), in
+ * which case each channel reads as either the newest sample or, with
+ * -F, the average of everything sampled during the last step.
+ */
+int g_adc_rate_hz = 0;
+bool g_adc_average = false;
+static struct adc_ring g_adc_ring;
 
 
 void state_update(float dt, float i_in, 
@@ -53,9 +76,86 @@ void die(const char *message, const char *error)
 /* 
  * High-resolution timers to ensure that the loop
  * executes in real time according to the timestep.
+ * Everything is kept as 64-bit nanoseconds on the
+ * monotonic clock, and each step sleeps until an
+ * absolute deadline rather than for a relative time,
+ * so oversleeping one step never delays the next.
  */
 long g_num_dts = 0;
-struct timespec g_start_time, g_last_time;
+static uint64_t g_start_ns, g_deadline_ns;
+
+/* When this tick started, and how far behind the clock that was. */
+static uint64_t g_tick_ns, g_tick_late_ns;
+
+uint64_t now_ns()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * NS_PER_SEC + t.tv_nsec;
+}
+
+/*
+ * Per-phase profiling. Both a cumulative histogram for the final report
+ * and one for the current snapshot interval are kept for each phase.
+ */
+bool g_profiling = false;
+static uint64_t g_snapshot_ns = 0, g_next_snapshot_ns = 0;
+static uint64_t g_phase_mark_ns = 0;
+static struct histogram g_phase_total[N_PHASES], g_phase_recent[N_PHASES];
+
+static const char *phase_names[N_PHASES] = {
+    [PHASE_ADC] = "adc", [PHASE_SPIKES] = "spikes",
+    [PHASE_DYNAMICS] = "dynamics", [PHASE_ACTUATOR] = "actuator",
+    [PHASE_LOG] = "log"
+};
+
+void profile_phase(enum phase phase)
+{
+    uint64_t now = now_ns();
+    histogram_add(&g_phase_total[phase], now - g_phase_mark_ns);
+    histogram_add(&g_phase_recent[phase], now - g_phase_mark_ns);
+    g_phase_mark_ns = now;
+}
+
+static void print_phases(const struct histogram *phases)
+{
+    fprintf(stderr, " %-10s %9s %9s %9s %9s %9s  (μs)\n",
+            "phase", "min", "mean", "p50", "p99", "max");
+    for (int p = 0; p < N_PHASES; p++) {
+        const struct histogram *h = &phases[p];
+        if (h->count == 0) continue;
+        fprintf(stderr, " %-10s %9.2f %9.2f %9.2f %9.2f %9.2f\n",
+                phase_names[p], (double)h->min / NS_PER_US,
+                (double)histogram_mean(h) / NS_PER_US,
+                (double)histogram_quantile(h, 0.5) / NS_PER_US,
+                (double)histogram_quantile(h, 0.99) / NS_PER_US,
+                (double)h->max / NS_PER_US);
+    }
+}
+
+static void profile_start(uint64_t now)
+{
+    for (int p = 0; p < N_PHASES; p++) {
+        histogram_reset(&g_phase_total[p]);
+        histogram_reset(&g_phase_recent[p]);
+    }
+    g_phase_mark_ns = now;
+    g_next_snapshot_ns = now + g_snapshot_ns;
+}
+
+/*
+ * Print and restart the recent histograms if a snapshot is due. This
+ * happens in the loop thread, so it's only on when asked for.
+ */
+static void profile_snapshot(uint64_t now)
+{
+    if (!g_snapshot_ns || now < g_next_snapshot_ns) return;
+    g_next_snapshot_ns += g_snapshot_ns;
+
+    fprintf(stderr, "Profile at %.1fs:\n", get_current_time() / MS_PER_SEC);
+    print_phases(g_phase_recent);
+    for (int p = 0; p < N_PHASES; p++) histogram_reset(&g_phase_recent[p]);
+}
 
 float get_current_time()
 {
@@ -64,80 +164,52 @@ float get_current_time()
 
 void setup()
 {
-    /* Set up the clocks. */
-    clock_gettime(CLOCK_MONOTONIC, &g_last_time);
-    g_start_time = g_last_time;
-
-    /*
-     * Create the device driver object. 
-     * The first parameter is a 16-bit mask specifying which 
-     * subsystems to activate; here, we turn them all on.
-     * Next is an exponential moving-average filter time 
-     * constant, in sample numbers, followed by the delay
-     * in cycles between configuration and the start of
-     * ADC readings; finally, a sample delay describing
-     * how long to wait between reading the ADC. It's probably
-     * wasteful to leave this at 0 considering how slowly we
-     * sample, but for now it'll do...
-     */
-    g_pru = pruio_new(PRUIO_DEF_ACTIVE, 4, 0x98, 0);
-    if (!g_pru) {
-        perror(NULL);
-        exit(1);
-    }
+    /* A tick that would all but fill the ADC ring on its own is too long. */
+    if (g_adc_rate_hz && (uint64_t)g_dt_us * g_io_steps * g_adc_rate_hz
+            >= (uint64_t)ADC_RING_SAFE_SAMPLES(ADC_RING_SAMPLES) * US_PER_SEC)
+        die("The ADC ring is too small for this sample rate and tick", NULL);
+
+    if (g_rt_priority) enable_realtime();
+
+    /* A replay shouldn't drive the real robot unless asked to. */
+    if (!g_backend) g_backend = g_replaying ? &sim_backend : g_backends[0];
+    g_backend->setup(g_adc_rate_hz, &g_adc_ring);
 
     signal(SIGTERM, die_gracefully);
     signal(SIGINT, die_gracefully);
-    if (g_pru->Errr) 
-        die("PruIO initialization failed", g_pru->Errr);
-
-    /*
-     * Save a constant necessary for correctly setting GPIOs.
-     * I still don't know why it works this way, but for 
-     * some reason, you have to set the pin to pinmode|128 
-     * to turn it on, or just pinmode to turn it off.
-     */
-    for (int i = 0; i < 4; i++) {
-        g_pinmodes[i] = g_pru->BallConf[gpio_pins[i]];
-    }
 
-    /*
-     * Initialize the four PWM pins corresponding to the
-     * motors' enable lines. These begin at 0% duty cycle.
-     */
-    for (int i = 0; i < 4; i++) {
-        if (pruio_pwm_setValue(g_pru, pwm_pins[i], PWM_FREQ_HZ, 0))
-            die("Couldn't set PWM", g_pru->Errr);
+    /* Wait for the first samples so the first step has something. */
+    if (g_adc_rate_hz) {
+        for (int i = 0; i < 100 && !adc_ring_poll(&g_adc_ring, now_ns());
+                i++)
+            usleep(100);
     }
 
-    /*
-     * Send the config to the PRU. The parameters set the
-     * driver to IO mode (i.e. sampling on demand), activate
-     * the four ADC channels we're actually using, give zero
-     * sampling frequency because that's not used in IO mode,
-     * and say to return raw 12-bit values.
+    /* 
+     * Start the clock only now that the slow driver setup is
+     * done, or the first few steps would all be overruns.
      */
-    if (pruio_config(g_pru, 1, 0xF<<1, 0, 0)) 
-        die("Config failed", g_pru->Errr);
+    start_trace();
+    histogram_reset(&g_lateness);
+    histogram_reset(&g_latency);
+    g_start_ns = g_deadline_ns = now_ns();
+    if (g_profiling) profile_start(g_start_ns);
+    g_tick_steps = g_io_steps;
+    if (g_pipelined) start_pipeline();
+    g_tick_ns = now_ns();
 }
 
 
 void cleanup() 
 {
-    if (g_logfile != NULL && g_logfile != stdin) fclose(g_logfile);
-
-    /* Zero all the PWMs first because if left nonzero, they will do
-     * horrible things. */
-    for (int i = 0; i < 4; i++) {
-        if (pruio_pwm_setValue(g_pru, pwm_pins[i], -1, 0))
-            die("Couldn't set PWM", g_pru->Errr);
-    }
-
-    /* Sleep for 100ms to leave some space to shut down. */
-    usleep(100000);
+    stop_pipeline();
+    close_log();
+    close_trace();
+    close_telemetry();
+    close_spike_log();
+    close_control();
 
-    /* Reset the PRU state */
-    pruio_destroy(g_pru);
+    g_backend->cleanup();
 
     fprintf(stderr, "Cleaned up. :)\n");
 }
@@ -151,42 +223,42 @@ void die_gracefully(int signal)
     fprintf(stderr, "Caught signal, exiting.\n");
 }
 
-int datalogf(const char *fmt, ...) 
+/* Pick up the samples that arrived during the last step. */
+void poll_adc()
 {
-    if (g_logfile == NULL) return 0;
-
-    va_list args;
-    va_start(args, fmt);
-    int ret = vfprintf(g_logfile, fmt, args);
-    va_end(args);
-    return ret;
+    if (g_adc_rate_hz) adc_ring_poll(&g_adc_ring, now_ns());
 }
 
-
-
 /*
- * Store the pointer to the logfile object for debug logging.
+ * Read the ADC value, taking a 12-bit ADC value and converting it to a
+ * floating-point number in the interval [0,1]. 
  */
-void open_logfile(const char *path) 
+float sample_adc(int i)
 {
-    if (!strncmp("-", path, 2)) g_logfile = stdout;
-    else g_logfile = fopen(path, "w");
+    if (g_adc_rate_hz) return g_adc_ring.value[i];
 
-    if (g_logfile == NULL) {
-        perror("Couldn't open logfile");
-        exit(1);
-    }
+    uint16_t raw = g_backend->read_adc(i);
+    return 1.f*raw / (1<<12);
 }
 
+/* When this step first read the sensors, for the latency. */
+static uint64_t g_sensed_ns = 0;
 
-/*
- * Read the ADC value, taking a 12-bit ADC value and converting it to a
- * floating-point number in the interval [0,1]. 
- */
+/* The loop's reading, from the ADC, a replayed trace or the pipeline. */
 float read_adc(int i)
 {
-    uint16_t raw = g_pru->Adc->Value[i+1];
-    return 1.f*raw / (1<<12);
+    float value;
+    if (g_replaying) {
+        value = trace_adc(i, 0);
+    } else if (g_pipelined) {
+        value = trace_adc(i, pipelined_adc(i));
+    } else {
+        if (!g_sensed_ns) g_sensed_ns = now_ns();
+        value = trace_adc(i, sample_adc(i));
+    }
+    if (g_telemetry) telemetry_adc(i, value);
+    if (g_spike_log) spike_log_adc(i, value);
+    return value;
 }
 
 
@@ -207,6 +279,67 @@ bool check_spike(struct state *state, const struct params *params)
 }
 
 
+float g_conductance_scale = 1;
+
+
+/*
+ * Total synaptic current into every cell, walking only the synapses
+ * that actually exist rather than whole rows of a connectivity matrix.
+ * The fixed-point engine keeps it to itself and leaves i_in zero, ready
+ * for the feedback and any other inputs to be added.
+ */
+void synaptic_currents(const struct synapses *synapses,
+        const struct network *net, float *i_in)
+{
+    if (net->fixed) {
+        fixed_synaptic_currents(net, i_in);
+        return;
+    }
+    gather_currents(synapses, net->v, net->i, i_in, 0, net->n);
+}
+
+
+/*
+ * The same for cells lo up to hi only, with the presynaptic i taken
+ * from i_pre, which needn't be the network's own. Everything that
+ * gathers goes through here so the sums come out the same everywhere.
+ */
+void gather_currents(const struct synapses *synapses, const float *v_post,
+        const float *i_pre, float *i_in, int lo, int hi)
+{
+    for (int i = lo; i < hi; i++) {
+        float v = v_post[i];
+        float i_syn = 0;
+        for (int k = synapses->row[i]; k < synapses->row[i+1]; k++) {
+            const struct synapse *s = &synapses->syn[k];
+            i_syn += s->g * (s->vn - v) * i_pre[s->pre];
+        }
+        i_in[i] = i_syn * g_conductance_scale;
+    }
+}
+
+
+/*
+ * Add the feedback current for each tap, given the actuator positions
+ * and the strength of the feedback in pA.
+ */
+void feedback_currents(const struct feedback_tap *taps, int n_taps,
+        const float *position, float gain, float *i_in)
+{
+    for (int t = 0; t < n_taps; t++) {
+        float prev_err = fabs(1 - position[taps[t].prev]);
+        float next_err = fabs(0 - position[taps[t].next]);
+        i_in[taps[t].cell] += -gain*(prev_err + next_err);
+    }
+}
+
+
+float motor_activation(const struct network *net, const struct motor *m)
+{
+    return net->v[m->flexor] - net->v[m->extensor];
+}
+
+
 /*
  * Midpoint-method integration of the cell dynamics.  There's no
  * particular reason for the choice of integration method besides that
@@ -222,6 +355,130 @@ void resolve_dynamics(struct state *state, const struct params *param,
 }
 
 
+/*
+ * Batch version of check_spike() which handles a whole network at once,
+ * VEC_WIDTH cells per instruction.
+ */
+int check_spikes_all(struct network *net, bool *fired)
+{
+    if (g_spike_log) spike_log_step();
+    if (net->fixed) return fixed_check_spikes(net, fired);
+    return check_spikes_range(net, fired, 0, net->n);
+}
+
+
+/* The same for cells lo up to hi, where lo is a multiple of VEC_WIDTH. */
+int check_spikes_range(struct network *net, bool *fired, int lo, int hi)
+{
+    int n_fired = 0;
+    for (int i = lo; i < hi; i += VEC_WIDTH) {
+        vfloat v = VLOAD(&net->v[i]);
+        vmask m = v >= VLOAD(&net->vp[i]);
+
+        /* Cells which fired during a substep have been reset already. */
+        vmask early = {0};
+        if (net->fired_early) {
+            early = *(vmask *)&net->fired_early[i];
+            if (vany(early)) *(vmask *)&net->fired_early[i] = (vmask){0};
+        }
+
+        /* Skip the stores entirely in the common case of no spikes. */
+        if (!vany(m | early)) {
+            if (fired)
+                for (int l = 0; l < VEC_WIDTH; l++) fired[i+l] = false;
+            continue;
+        }
+
+        vfloat zero = {0};
+        VSTORE(&net->v[i], vselect(m, VLOAD(&net->c[i]), v));
+        VSTORE(&net->u[i], VLOAD(&net->u[i]) 
+                + vselect(m, VLOAD(&net->d[i]), zero));
+        VSTORE(&net->j[i], VLOAD(&net->j[i]) 
+                + vselect(m, zero + 1, zero));
+
+        m |= early;
+        for (int l = 0; l < VEC_WIDTH; l++) {
+            if (fired) fired[i+l] = m[l] != 0;
+            if (m[l]) activate_cell(net, i+l);
+            if (m[l] && g_spike_log) log_spike(i+l);
+            n_fired += m[l] != 0;
+        }
+    }
+    return n_fired;
+}
+
+/*
+ * Advance a network n_steps steps in one call, for the Python module
+ * (see build_neurobot.py), on the CSR path with whatever integrator and
+ * timestep are set. External currents i_ext, if given, are added to the
+ * synaptic ones; v_out gets every cell's voltage after each step, and
+ * raster which cells fired at the start of each step. All three are
+ * n_steps rows of net->n and any of them can be NULL. Returns the number
+ * of spikes, or -1 if the scratch space couldn't be allocated.
+ */
+long network_run(struct network *net, const struct synapses *synapses,
+        long n_steps, const float *i_ext, float *v_out, bool *raster)
+{
+    int n = net->n;
+    float *i_in = NULL;
+    bool *fired = malloc(PADDED(n) * sizeof *fired);
+    if (!fired || posix_memalign((void **)&i_in, 4*NETWORK_PAD,
+                PADDED(n) * sizeof *i_in)) {
+        free(fired);
+        return -1;
+    }
+    memset(i_in, 0, PADDED(n) * sizeof *i_in);
+
+    long spikes = 0;
+    for (long s = 0; s < n_steps; s++) {
+        spikes += check_spikes_all(net, raster ? fired : NULL);
+        synaptic_currents(synapses, net, i_in);
+        if (i_ext)
+            for (int c = 0; c < n; c++) i_in[c] += i_ext[s*n + c];
+        resolve_dynamics_all(net, i_in);
+
+        if (v_out) memcpy(&v_out[s*n], net->v, n * sizeof *v_out);
+        if (raster) memcpy(&raster[s*n], fired, n * sizeof *raster);
+    }
+
+    free(i_in);
+    free(fired);
+    return spikes;
+}
+
+
+/*
+ * Get a network ready for the loop under whichever engine this build
+ * runs: event-driven propagation normally, or fixed point when built
+ * with FIXED_POINT. A controller without one (reset) calls it with
+ * none, so the spike log and telemetry still start before the loop.
+ */
+void start_network(struct network *net, const struct synapses *syn)
+{
+    if (net) {
+#ifdef FIXED_POINT
+        start_fixed_point(net, syn);
+#else
+        (void)syn;
+        start_active_set(net);
+#endif
+    }
+    telemetry_network(net);
+    spike_log_network(net);
+    control_network(net);
+}
+
+
+/*
+ * Set a cell's synaptic j to 1 the same way a spike would, from outside
+ * the loop's own spike checks, whichever engine holds the state.
+ */
+void kick_cell(struct network *net, int cell)
+{
+    net->j[cell] = 1;
+    if (net->fixed) fixed_import(net, cell);
+    activate_cell(net, cell);
+}
 
 
 /* 
@@ -230,33 +487,97 @@ void resolve_dynamics(struct state *state, const struct params *param,
 #define DEFAULT_PWM_MAX 0.3
 float g_pwm_max = DEFAULT_PWM_MAX;
 
+/*
+ * The driver calls are the expensive part of actuation, and the PWM
+ * only runs at PWM_FREQ_HZ anyway, so apply_actuator() just stages the
+ * new values and commit_actuators() decides once per step what to
+ * actually send. A duty cycle goes out when it has moved by more than
+ * the deadband since the last write, or when it has changed at all and
+ * a PWM period has gone by, so small changes are at most one period
+ * late. The direction pin is only written when it flips.
+ */
+#define DEFAULT_PWM_DEADBAND 0.002f
+float g_pwm_deadband = DEFAULT_PWM_DEADBAND;
+
+static struct {
+    float duty, sent_duty;
+    bool negative, sent_negative, sent_any;
+    long sent_period;
+} g_actuators[4];
+
+static long g_writes_issued = 0, g_writes_skipped = 0;
+
 /* 
  * Apply an activation effort to the ith actuator, using the sign to set
  * the direction pin and the magnitude to calculate the duty cycle for
- * the enable pin (as a fraction of the allowed maximum).
+ * the enable pin (as a fraction of the allowed maximum). Nothing is
+ * sent to the hardware until commit_actuators().
  */
 void apply_actuator(size_t i, float activation) 
+{
+    if (g_telemetry) telemetry_actuator(i, activation);
+    if (g_spike_log) spike_log_actuator(i, activation);
+    if (g_pipelined) pipelined_actuator(i, activation);
+    else stage_actuator(i, activation);
+}
+
+
+void stage_actuator(size_t i, float activation)
 {
     if (activation > 1) activation = 1;
     if (activation < -1) activation = -1;
     float duty_cycle = activation * g_pwm_max;
 
-    /* 
-     * Set the PWM duty cycle. The argument of -1 says to keep the
-     * frequency the same.
-     */
-    if (pruio_pwm_setValue(g_pru, pwm_pins[i], -1, 
-                fabs(duty_cycle)))
-        die("Couldn't set PWM A", g_pru->Errr);
+    g_actuators[i].duty = fabs(duty_cycle);
+    g_actuators[i].negative = signbit(duty_cycle);
+}
 
-    /*
-     * Also set the direction of the motor based on the
-     * sign of the actuation effort.
-     */
-    bool is_negative = signbit(duty_cycle);
-    int mask = (is_negative?0:128) | g_pinmodes[i];
-    if (pruio_gpio_setValue(g_pru, gpio_pins[i], mask))
-        die("Couldn't do GPIO", g_pru->Errr);
+
+void commit_actuators()
+{
+    if (g_pipelined) {
+        pipelined_commit();
+    } else {
+        write_actuators(g_sensed_ns);
+        g_sensed_ns = 0;
+    }
+}
+
+
+/*
+ * Send whatever has changed to the hardware, and if the activations
+ * came from sensor readings taken at sensed_ns, count the latency.
+ */
+void write_actuators(uint64_t sensed_ns)
+{
+    long period = io_step() * g_dt_us / (long)(US_PER_SEC / PWM_FREQ_HZ);
+
+    for (int i = 0; i < 4; i++) {
+        float change = fabs(g_actuators[i].duty - g_actuators[i].sent_duty);
+        bool new_period = period != g_actuators[i].sent_period;
+
+        if (change > g_pwm_deadband || (change > 0 && new_period)) {
+            g_backend->set_pwm(i, g_actuators[i].duty);
+            g_actuators[i].sent_duty = g_actuators[i].duty;
+            g_actuators[i].sent_period = period;
+            g_writes_issued++;
+        } else g_writes_skipped++;
+
+        /*
+         * Also set the direction of the motor based on the
+         * sign of the actuation effort.
+         */
+        bool negative = g_actuators[i].negative;
+        if (!g_actuators[i].sent_any 
+                || negative != g_actuators[i].sent_negative) {
+            g_backend->set_direction(i, negative);
+            g_actuators[i].sent_negative = negative;
+            g_actuators[i].sent_any = true;
+            g_writes_issued++;
+        } else g_writes_skipped++;
+    }
+
+    if (sensed_ns) histogram_add(&g_latency, now_ns() - sensed_ns);
 }
 
 
@@ -271,60 +592,370 @@ void set_pwm_max(float percent) {
 }
 
 
-/* The simulation timestep. */
+/*
+ * Handle the command-line options every controller accepts, so that
+ * each main() only needs to deal with its own. Returns whether the
+ * option was one of these.
+ */
+bool common_option(int opt, const char *arg)
+{
+    char *endptr;
+    if (opt == 'p') {
+        set_pwm_max(strtod(arg, &endptr));
+        if (endptr && *endptr != '\0')
+            die("Invalid PWM maximum", arg);
+    } else if (opt == 'Q') {
+        g_pwm_deadband = strtod(arg, &endptr) / 100;
+        if ((endptr && *endptr != '\0') || g_pwm_deadband < 0)
+            die("Invalid PWM deadband", arg);
+    } else if (opt == 'B') {
+        select_backend(arg);
+    } else if (opt == 'R') {
+        g_rt_priority = strtol(arg, &endptr, 10);
+        if ((endptr && *endptr != '\0') || g_rt_priority < 1 
+                || g_rt_priority > 99)
+            die("Invalid real-time priority", arg);
+    } else if (opt == 'C') {
+        g_rt_cpu = strtol(arg, &endptr, 10);
+        if ((endptr && *endptr != '\0') || g_rt_cpu < 0)
+            die("Invalid CPU number", arg);
+    } else if (opt == 'T') {
+        float period = strtod(arg, &endptr);
+        if ((endptr && *endptr != '\0') || period < 0)
+            die("Invalid profiling snapshot period", arg);
+        g_profiling = true;
+        g_snapshot_ns = period * NS_PER_SEC;
+    } else if (opt == 'S') {
+        g_adc_rate_hz = strtol(arg, &endptr, 10);
+        if ((endptr && *endptr != '\0') || g_adc_rate_hz < 1 
+                || g_adc_rate_hz > ADC_MAX_RATE_HZ)
+            die("Invalid ADC sample rate", arg);
+    } else if (opt == 'F') {
+        g_adc_average = true;
+    } else if (opt == 'I') {
+        select_integrator(arg);
+    } else if (opt == 'U') {
+        g_substeps = strtol(arg, &endptr, 10);
+        if ((endptr && *endptr != '\0') || g_substeps < 1)
+            die("Invalid number of substeps", arg);
+    } else if (opt == 'd') {
+        g_dt_us = strtol(arg, &endptr, 10);
+        if ((endptr && *endptr != '\0') || g_dt_us < MIN_DT_US
+                || g_dt_us > MAX_DT_US)
+            die("Invalid timestep", arg);
+    } else if (opt == 'W') {
+        record_trace(arg);
+    } else if (opt == 'X') {
+        replay_trace(arg);
+    } else if (opt == 'Y') {
+        open_telemetry(arg);
+    } else if (opt == 'E') {
+        open_spike_log(arg);
+    } else if (opt == 'K') {
+        open_control(arg);
+    } else if (opt == 'V') {
+        set_overrun_policy(arg);
+    } else if (opt == 'A') {
+        g_pipelined = true;
+    } else if (opt == 'M') {
+        g_io_steps = strtol(arg, &endptr, 10);
+        if ((endptr && *endptr != '\0') || g_io_steps < 1
+                || g_io_steps > MAX_IO_STEPS)
+            die("Invalid number of steps per I/O tick", arg);
+    } else if (opt == 'L') {
+        int every = strtol(arg, &endptr, 10);
+        if ((endptr && *endptr != '\0') || every < 1)
+            die("Invalid log decimation", arg);
+        set_log_decimation(every);
+    } else if (opt == 'O') {
+        if (!strcmp(arg, "drop")) set_log_overflow(LOG_DROP);
+        else if (!strcmp(arg, "block")) set_log_overflow(LOG_BLOCK);
+        else die("Invalid log overflow policy", arg);
+    } else return false;
+    return true;
+}
+
+
+/* The simulation timestep, and how many of them make an I/O tick. */
 int g_dt_us = 500;
+int g_io_steps = 1;
+int g_tick_steps = 1;
 
 float dt_ms() {
     return (float)g_dt_us / US_PER_MS;
 }
 
 
-static long g_total_sleep_us = 0;
+/*
+ * Optional real-time mode: SCHED_FIFO at the given priority, pinned to
+ * one CPU if requested, with all memory locked and prefaulted so the
+ * loop never waits on the pager. Zero priority means it's off.
+ */
+int g_rt_priority = 0;
+int g_rt_cpu = -1;
 
+/* How much stack to touch up front so it's already resident. */
+#define PREFAULT_STACK_BYTES (256*1024)
 
-/* 
- * Check how long it has been, then sleep for the rest of the timestep.
- * Then update the official start time of the timestep such that we'll
- * correct for "oversleeping".
+static void prefault_stack()
+{
+    volatile char stack[PREFAULT_STACK_BYTES];
+    for (size_t i = 0; i < sizeof stack; i += 4096) stack[i] = 0;
+}
+
+void enable_realtime()
+{
+    /* Keep freed heap memory around instead of handing it back. */
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+    if (mlockall(MCL_CURRENT | MCL_FUTURE))
+        die("Couldn't lock memory", strerror(errno));
+    prefault_stack();
+
+    if (g_rt_cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(g_rt_cpu, &cpus);
+        if (sched_setaffinity(0, sizeof cpus, &cpus))
+            die("Couldn't pin to CPU", strerror(errno));
+    }
+
+    struct sched_param param = { .sched_priority = g_rt_priority };
+    if (sched_setscheduler(0, SCHED_FIFO, &param))
+        die("Couldn't set SCHED_FIFO", strerror(errno));
+}
+
+
+/*
+ * Background threads (the log writer and so on) inherit the loop's
+ * scheduling, so they call this to go back to being ordinary,
+ * low-priority threads free to run on any CPU.
  */
-void synchronize_loop()
+void demote_thread()
 {
-    struct timespec this_time;
+    struct sched_param param = { .sched_priority = 0 };
+    pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
 
-    clock_gettime(CLOCK_MONOTONIC, &this_time);
-    long delta_t_us = 
-        (this_time.tv_nsec - g_last_time.tv_nsec) / NS_PER_US
-        + (this_time.tv_sec - g_last_time.tv_sec) * US_PER_SEC;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (long i = 0; i < sysconf(_SC_NPROCESSORS_ONLN); i++)
+        CPU_SET(i, &cpus);
+    sched_setaffinity(0, sizeof cpus, &cpus);
 
-    g_last_time.tv_nsec += g_dt_us * NS_PER_US;
-    if (g_last_time.tv_nsec > NS_PER_SEC) {
-        g_last_time.tv_sec += 1;
-        g_last_time.tv_nsec -= NS_PER_SEC;
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+}
+
+
+static uint64_t g_total_sleep_ns = 0;
+static long g_num_waits = 0;
+long g_num_overruns = 0;
+struct histogram g_lateness, g_latency;
+
+/* The defaults for -V catchup and -V shed, in I/O ticks. */
+#define DEFAULT_CATCHUP_TICKS 4
+#define MAX_CATCHUP_TICKS 16
+#define DEFAULT_SHED_TICKS 200
+
+/*
+ * What to do about overruns (-V): at most how many missed ticks' steps
+ * to catch up on without I/O, how many ticks to shed optional work for
+ * afterwards, and after how many in a row to give up. Zero means don't.
+ */
+static int g_catchup_ticks = 0, g_shed_ticks = 0, g_abort_streak = 0;
+static int g_catchup_next = 0;
+static uint64_t g_shed_until_ns = 0;
+bool g_shedding = false;
+
+static long g_streak = 0, g_longest_streak = 0, g_num_streaks = 0;
+static long g_missed_ticks = 0, g_caught_up_steps = 0, g_shed_total = 0;
+
+
+void set_overrun_policy(const char *spec)
+{
+    char *copy = strdup(spec), *save = NULL, *end;
+    if (!copy) die("Couldn't allocate overrun policy", NULL);
+    for (char *opt = strtok_r(copy, ",", &save); opt;
+            opt = strtok_r(NULL, ",", &save)) {
+        char *value = strchr(opt, '=');
+        if (value) *value++ = '\0';
+        int n = value ? strtol(value, &end, 10) : 0;
+        if (value && (*end || n < 1)) die("Invalid overrun policy", value);
+
+        if (!strcmp(opt, "catchup")) {
+            g_catchup_ticks = value ? n : DEFAULT_CATCHUP_TICKS;
+            if (g_catchup_ticks > MAX_CATCHUP_TICKS)
+                die("Too many ticks to catch up on", value);
+        } else if (!strcmp(opt, "shed")) {
+            g_shed_ticks = value ? n : DEFAULT_SHED_TICKS;
+        } else if (!strcmp(opt, "abort") && value) {
+            g_abort_streak = n;
+        } else die("Invalid overrun policy", opt);
     }
+    free(copy);
+}
 
-    if (delta_t_us < g_dt_us) {
-        g_total_sleep_us += g_dt_us - delta_t_us;
-        usleep(g_dt_us - delta_t_us);
-    } 
 
-    g_num_dts++;
+/* The most network steps any one tick can run. */
+int max_tick_steps()
+{
+    return g_io_steps * (1 + g_catchup_ticks);
 }
 
 
-void print_final_time()
+/*
+ * The tick whose deadline this was overran, finishing at now: keep
+ * count, and apply the policies. Catching up moves the deadlines on
+ * past the ticks that were missed, and the next tick runs their steps.
+ */
+static void overrun(uint64_t now)
 {
-    struct timespec stop_time;
-    clock_gettime(CLOCK_MONOTONIC, &stop_time);
-    long delta_t_us = 
-        (stop_time.tv_nsec - g_start_time.tv_nsec) / NS_PER_US
-        + (stop_time.tv_sec - g_start_time.tv_sec) * US_PER_SEC;
-    fprintf(stderr, "Simulated %ld steps in %ldms.\n", 
-            g_num_dts, delta_t_us / 1000);
-    fprintf(stderr, " (Timestep %ldμs actual, %dμs nominal.)\n",
-            delta_t_us / g_num_dts, g_dt_us);
-    fprintf(stderr, " (Slept on average %ldμs per step.)\n",
-            g_total_sleep_us / g_num_dts);
+    uint64_t tick_ns = (uint64_t)g_dt_us * g_io_steps * NS_PER_US;
+    long missed = (now - g_deadline_ns) / tick_ns;
+    g_num_overruns++;
+    g_missed_ticks += missed;
+    if (g_streak++ == 0) g_num_streaks++;
+    if (g_streak > g_longest_streak) g_longest_streak = g_streak;
+
+    if (g_catchup_ticks && missed) {
+        g_catchup_next = missed < g_catchup_ticks ? missed : g_catchup_ticks;
+        g_deadline_ns += g_catchup_next * tick_ns;
+    }
+    if (g_shed_ticks)
+        __atomic_store_n(&g_shed_until_ns, now + g_shed_ticks * tick_ns,
+                __ATOMIC_RELAXED);
+    if (g_abort_streak && g_streak == g_abort_streak) {
+        fprintf(stderr, "Aborting after %ld overruns in a row.\n", g_streak);
+        g_please_die_kthxbai = true;
+    }
 }
 
 
+/* 
+ * Sleep until the deadline for the end of this step, or don't sleep at
+ * all if it has already passed. Either way, record how late we ended
+ * up relative to the deadline, which is the jitter when we did sleep
+ * and the size of the overrun when we didn't, which overrun() deals
+ * with. Returns the time after.
+ * With the pipeline on, it's the I/O thread that keeps time.
+ */
+uint64_t wait_for_deadline()
+{
+    g_deadline_ns += (uint64_t)g_dt_us * g_io_steps * NS_PER_US;
+    g_num_waits++;
+
+    uint64_t now = now_ns();
+    if (g_replaying) {
+        /* Replays run flat out, with no deadline to meet. */
+        g_deadline_ns = now;
+    } else if (now < g_deadline_ns) {
+        g_total_sleep_ns += g_deadline_ns - now;
+
+        struct timespec deadline = {
+            .tv_sec = g_deadline_ns / NS_PER_SEC,
+            .tv_nsec = g_deadline_ns % NS_PER_SEC
+        };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                    &deadline, NULL) == EINTR && !g_please_die_kthxbai);
+        now = now_ns();
+        g_streak = 0;
+    } else {
+        overrun(now);
+    }
+
+    /* A signal can wake us early, which shouldn't count as jitter. */
+    histogram_add(&g_lateness, 
+            now > g_deadline_ns ? now - g_deadline_ns : 0);
+    return now;
+}
+
 
+/* The end of a tick: wait for the next one, or its sensor readings. */
+void synchronize_loop()
+{
+    if (g_profiling || g_telemetry || g_control) {
+        uint64_t done = now_ns();
+        if (g_profiling && !g_shedding) profile_snapshot(done);
+        if (g_telemetry && !g_shedding)
+            send_telemetry(g_tick_late_ns, done - g_tick_ns);
+        if (g_control) control_tick(g_tick_late_ns, done - g_tick_ns);
+    }
+    if (g_spike_log) spike_log_tick();
+
+    uint64_t now;
+    if (g_pipelined) {
+        now = pipelined_wait();
+        trace_step();
+    } else {
+        now = wait_for_deadline();
+        g_num_dts += g_tick_steps;
+        trace_step();
+
+        /* A replay catches up wherever the recording did. */
+        int catchup = trace_catchup(g_catchup_next);
+        g_tick_steps = (1 + catchup) * g_io_steps;
+        g_caught_up_steps += catchup * g_io_steps;
+        g_catchup_next = 0;
+    }
+
+    /* Don't charge the sleep to whichever phase comes first. */
+    g_phase_mark_ns = now;
+    if (!g_pipelined) poll_adc();
+
+    uint64_t nominal = g_start_ns
+        + (uint64_t)g_num_dts * g_dt_us * NS_PER_US;
+    g_tick_ns = now;
+    g_tick_late_ns = now > nominal ? now - nominal : 0;
+
+    g_shedding = now < __atomic_load_n(&g_shed_until_ns, __ATOMIC_RELAXED);
+    if (g_shedding) g_shed_total++;
+}
+
+
+void print_final_time()
+{
+    /* The I/O thread keeps some of these counts, so it stops first. */
+    stop_pipeline();
+    uint64_t delta_t_us = (now_ns() - g_start_ns) / NS_PER_US;
+    fprintf(stderr, "Simulated %ld steps in %lldms.\n", 
+            g_num_dts, (long long)delta_t_us / US_PER_MS);
+    if (g_num_dts == 0) return;
+
+    fprintf(stderr, " (Timestep %lldμs actual, %dμs nominal.)\n",
+            (long long)delta_t_us / g_num_dts, g_dt_us);
+    if (g_num_waits)
+        fprintf(stderr, " (Slept on average %lldμs per I/O tick.)\n",
+                (long long)g_total_sleep_ns / NS_PER_US / g_num_waits);
+    if (g_io_steps > 1)
+        fprintf(stderr, " (%d steps per I/O tick of %dμs.)\n",
+                g_io_steps, g_io_steps * g_dt_us);
+    fprintf(stderr, " (Lateness max %.1fμs, p99 %.1fμs, p99.9 %.1fμs;"
+            " %ld overruns.)\n",
+            (double)g_lateness.max / NS_PER_US,
+            (double)histogram_quantile(&g_lateness, 0.99) / NS_PER_US,
+            (double)histogram_quantile(&g_lateness, 0.999) / NS_PER_US,
+            g_num_overruns);
+    if (g_num_streaks)
+        fprintf(stderr, " (Overruns came in %ld streaks, the longest %ld"
+                " ticks; %ld whole ticks missed.)\n",
+                g_num_streaks, g_longest_streak, g_missed_ticks);
+    if (g_caught_up_steps)
+        fprintf(stderr, " (Caught up %ld steps without I/O.)\n",
+                g_caught_up_steps);
+    if (g_adc_ring.overruns)
+        fprintf(stderr, " (ADC ring lapped %ld times between polls.)\n",
+                g_adc_ring.overruns);
+    if (g_shed_total)
+        fprintf(stderr, " (Shed logging and telemetry for %ld ticks.)\n",
+                g_shed_total);
+    if (g_latency.count)
+        fprintf(stderr, " (Sensor to actuator latency p50 %.1fμs, "
+                "p99 %.1fμs, max %.1fμs.)\n",
+                (double)histogram_quantile(&g_latency, 0.5) / NS_PER_US,
+                (double)histogram_quantile(&g_latency, 0.99) / NS_PER_US,
+                (double)g_latency.max / NS_PER_US);
+    if (g_pipelined) print_pipeline_stats();
+    fprintf(stderr, " (Actuator writes: %ld issued, %ld skipped.)\n",
+            g_writes_issued, g_writes_skipped);
+
+    if (g_profiling) print_phases(g_phase_total);
+}
@@ -19,10 +19,81 @@
 #define US_PER_SEC (US_PER_MS * MS_PER_SEC)
 #define NS_PER_SEC (NS_PER_US * US_PER_SEC)
 
-/* The simulation timestep. */
+/* The simulation timestep, and the range -d accepts. */
+#define MIN_DT_US 10
+#define MAX_DT_US 10000
 extern int g_dt_us;
 float dt_ms();
 
+/*
+ * Network steps per I/O tick (-M): the loop reads the sensors, works
+ * out the feedback and drives the actuators once a tick, and integrates
+ * the network this many steps of g_dt_us in between.
+ */
+#define MAX_IO_STEPS 100
+extern int g_io_steps;
+
+/*
+ * Network steps the current tick runs: g_io_steps, or a few ticks'
+ * worth more when catching up on an overrun (-V catchup).
+ */
+extern int g_tick_steps;
+int max_tick_steps();
+
+/*
+ * Whether the loop is shedding optional work, such as logging and
+ * telemetry, after an overrun (-V shed).
+ */
+extern bool g_shedding;
+
+void set_overrun_policy(const char *spec);
+
+/* 
+ * Width of the vectors the batch routines work in, in cells. This
+ * follows whatever the compiler has been told the target supports: NEON
+ * on the Cortex-A8, SSE or AVX on x86, or plain scalar code otherwise.
+ */
+#if defined(__AVX__)
+#define VEC_WIDTH 8
+#elif defined(__SSE__) || defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define VEC_WIDTH 4
+#else
+#define VEC_WIDTH 1
+#endif
+
+/*
+ * Per-cell arrays are padded out to a multiple of the widest vector so
+ * the batch routines never need a scalar tail loop. The padding cells
+ * sit at their resting potential with no input, where they stay put.
+ */
+#define NETWORK_PAD 8
+#define PADDED(n) (((n) + NETWORK_PAD - 1) / NETWORK_PAD * NETWORK_PAD)
+#define SIMD_ALIGN __attribute__((aligned(4*NETWORK_PAD)))
+
+/*
+ * The batch routines rely on GCC vector extensions rather than
+ * intrinsics so the same code becomes NEON or SSE/AVX depending on the
+ * target; note that GCC will only put float math in NEON registers when
+ * -ffast-math is on.
+ */
+typedef float vfloat __attribute__((vector_size(4*VEC_WIDTH)));
+typedef int32_t vmask __attribute__((vector_size(4*VEC_WIDTH)));
+
+#define VLOAD(p) (*(const vfloat *)(p))
+#define VSTORE(p, x) (*(vfloat *)(p) = (x))
+
+static inline vfloat vselect(vmask m, vfloat yes, vfloat no)
+{
+    return (vfloat)((m & (vmask)yes) | (~m & (vmask)no));
+}
+
+static inline bool vany(vmask m)
+{
+    bool any = false;
+    for (int l = 0; l < VEC_WIDTH; l++) any |= m[l] != 0;
+    return any;
+}
+
 /* Each neuron's state variables. */
 struct state {
 
@@ -36,6 +107,164 @@ struct params {
     float vr, vt, vp, vn;
 };
 
+/* 
+ * Synaptic connectivity in compressed sparse row form: the synapses
+ * onto cell i are syn[row[i]] up to but not including syn[row[i+1]].
+ * Each one carries its presynaptic cell's reversal potential so the
+ * inner loop doesn't have to chase the params pointer.
+ */
+struct synapse {
+    int pre;
+    float g, vn;
+};
+
+struct synapses {
+    const int *row;
+    const struct synapse *syn;
+};
+
+/*
+ * The same synapses grouped by presynaptic cell instead (compressed
+ * sparse column): the synapses out of cell j are out[col[j]] up to but
+ * not including out[col[j+1]].
+ */
+struct synapse_out {
+    int post;
+    float g, vn;
+};
+
+struct fanout {
+    const int *col;
+    const struct synapse_out *out;
+};
+
+/*
+ * The presynaptic cells whose synaptic variables haven't yet decayed
+ * away, for event-driven propagation; see activeset.c. slot[i] is
+ * where cell i sits in cells[], or -1 if it's quiescent.
+ */
+#define ACTIVE_EPSILON 1e-6f
+
+struct active_set {
+    int n;
+    int *cells, *slot;
+};
+
+/*
+ * Ways of integrating the continuous dynamics over a step, chosen with
+ * -I, with the option of -U substeps for vectors of cells that are
+ * above threshold and on their way to a spike; see integrate.c. The
+ * per-cell coefficients for the current settings hang off the network
+ * and are redone whenever the settings change.
+ */
+enum integrator {
+    INTEGRATE_EULER, INTEGRATE_MIDPOINT, INTEGRATE_RK4, INTEGRATE_EXP,
+    N_INTEGRATORS
+};
+
+extern const char *const integrator_names[N_INTEGRATORS];
+extern enum integrator g_integrator;
+extern int g_substeps;
+
+/* Coefficients for steps of some size h: h/C, h*a, h/tau, and the
+ * exact propagator of the synaptic i/j system, exp(-h/tau) and
+ * (h/tau)*exp(-h/tau). */
+struct step_coefs {
+    float *h_C, *h_a, *h_tau;
+    float *decay, *decay_s;
+};
+
+struct dynamics {
+    enum integrator method;
+    int dt_us, substeps;
+    struct step_coefs full, half, sub_full, sub_half;
+};
+
+/*
+ * Proprioceptive feedback into one cell: it's inhibited in proportion
+ * to how far actuator prev is from fully extended and actuator next is
+ * from fully retracted.
+ */
+struct feedback_tap {
+    int cell, prev, next;
+};
+
+/* The muscle cells whose voltage difference drives one actuator. */
+struct motor {
+    int flexor, extensor;
+};
+
+/*
+ * A whole network of cells as a structure of arrays, each holding
+ * PADDED(n) entries, so that the batch routines can load several cells'
+ * worth of any one variable at a time. The parameters are stored per
+ * cell rather than per type, with C and tau kept as reciprocals since
+ * NEON has no vector divide. If active is set, spiking cells are
+ * entered into it for active_synaptic_currents(); dyn is filled in by
+ * resolve_dynamics_all() as needed. With substeps, fired_early marks the
+ * cells which fired and were reset partway through the last step, for
+ * the next spike check to count; prepare_dynamics() allocates it if it
+ * isn't there. If fixed is set, the fixed-point engine owns the state
+ * and the float arrays are only a copy of it.
+ */
+struct fixed_network;
+
+struct network {
+    int n;
+    float *v, *u, *i, *j;
+    const float *k, *inv_C, *inv_tau;
+    const float *a, *b, *c, *d;
+    const float *vr, *vt, *vp;
+    struct active_set *active;
+    struct dynamics *dyn;
+    int32_t *fired_early;
+    struct fixed_network *fixed;
+};
+
+
+/*
+ * Binary network files, written by cpgcompiler.py with --binary and
+ * mapped read-only by load_network() so that one controller can run any
+ * CPG. After the header come the sections at the given byte offsets,
+ * each aligned to NETWORK_FILE_ALIGN: the initial v, u, i and j and
+ * then the parameters k through vp in struct network order, PADDED(n)
+ * floats apiece; the CSR rows and synapses; the fan-out columns and
+ * synapses; the feedback taps; and the motors. Everything is in the
+ * in-memory layout of a little-endian target.
+ */
+#define NETWORK_FILE_MAGIC 0x574e424e /* "NBNW" */
+#define NETWORK_FILE_VERSION 1
+#define NETWORK_FILE_ALIGN (4*NETWORK_PAD)
+
+/*
+ * The most cells and synapses a file may claim, well past any body but
+ * low enough that no section size can overflow even a 32-bit size_t.
+ */
+#define NETWORK_FILE_MAX_CELLS (1 << 22)
+#define NETWORK_FILE_MAX_SYNAPSES (1 << 26)
+
+struct network_file_header {
+    uint32_t magic, version;
+    uint32_t n_cells, n_synapses, n_feedback, n_motors;
+    uint64_t state, params, rows, synapses, cols, fanout, taps, motors;
+    uint64_t size;
+};
+
+/* A loaded network file: everything but the state points into the map. */
+struct loaded_network {
+    void *map;
+    size_t map_size;
+    int n_synapses, n_feedback, n_motors;
+    struct network net;
+    struct synapses synapses;
+    struct fanout fanout;
+    const struct feedback_tap *feedback_taps;
+    const struct motor *motors;
+};
+
+void load_network(const char *path, struct loaded_network *ln);
+
+void unload_network(struct loaded_network *ln);
 
 void state_update(float dt, float i_in, 
         const struct state *current_state, 
@@ -44,6 +273,39 @@ void state_update(float dt, float i_in,
 
 void die(const char *message, const char *error);
 
+/* Constant PWM frequency. */
+#define PWM_FREQ_HZ 200.f
+
+struct adc_ring;
+
+/*
+ * An I/O backend: everything that touches the hardware (or pretends
+ * to). Setup brings the outputs up at zero, and if stream_hz is nonzero
+ * also starts sampling the ADC at that rate and points the ring at the
+ * samples. read_adc returns a raw 12-bit sample for on-demand reads.
+ * Errors are fatal, as everywhere else.
+ */
+struct backend {
+    const char *name;
+    void (*setup)(int stream_hz, struct adc_ring *ring);
+    uint16_t (*read_adc)(int channel);
+    void (*set_pwm)(int channel, float duty_cycle);
+    void (*set_direction)(int channel, bool negative);
+    void (*cleanup)();
+};
+
+extern const struct backend pruio_backend, sim_backend;
+
+/* 
+ * The simulated actuators' travel per second at 100% duty cycle, in
+ * full strokes, and where they start out.
+ */
+#define SIM_SPEED 3.f
+#define SIM_START_POSITION 0.5f
+void plant_advance(float position[4], const float signed_duty[4], float dt_s);
+extern const struct backend *g_backend;
+void select_backend(const char *name);
+
 void setup();
 
 void cleanup();
@@ -51,23 +313,540 @@ void cleanup();
 extern bool g_please_die_kthxbai;
 void die_gracefully(int signal);
 
+/* 
+ * Binary data logs start with this header, followed by the CSV header
+ * line (without its newline) and then the records themselves.
+ */
+#define LOG_MAGIC 0x474c424e /* "NBLG" */
+#define LOG_VERSION 1
+
+struct log_file_header {
+    uint32_t magic, version;
+    uint32_t n_values, record_size;
+    uint32_t dt_us, header_len;
+};
+
+/*
+ * Compressed logs, for filenames ending in ".nbz", are columnar (see
+ * datalog.c). After this header and the CSV header line come blocks of
+ * up to block_rows steps, each a struct column_block_header and then,
+ * for the step numbers and each value in turn, one zigzag varint per
+ * row: the first quantized value, the first difference, and then the
+ * second differences. A value is quantized as round(value / quantum).
+ * An index of the blocks and a trailer end the file; a log whose run
+ * died before writing them can still be read block by block.
+ */
+#define COLUMN_LOG_MAGIC 0x5a4c424e /* "NBLZ" */
+#define COLUMN_BLOCK_MAGIC 0x4b4c424e /* "NBLK" */
+#define COLUMN_INDEX_MAGIC 0x584c424e /* "NBLX" */
+#define COLUMN_LOG_VERSION 1
+
+struct column_log_header {
+    uint32_t magic, version;
+    uint32_t n_values, block_rows;
+    uint32_t dt_us, header_len;
+    float quantum;
+    uint32_t reserved;
+};
+
+struct column_block_header {
+    uint32_t magic, n_rows;
+    uint32_t size, reserved;
+    int64_t first_step;
+};
+
+struct column_index_entry {
+    int64_t first_step;
+    uint64_t offset;
+};
+
+struct column_log_trailer {
+    uint64_t index_offset;
+    uint32_t n_blocks, magic;
+};
+
+/* One logged step: the timestep number and the values for that step. */
+struct log_record {
+    int64_t step;
+    float values[];
+};
+
+/* What to do when the log ring is full. */
+enum log_overflow { LOG_DROP, LOG_BLOCK };
+
 int datalogf(const char *fmt, ...);
 
 void open_logfile(const char *path);
 
+void set_log_overflow(enum log_overflow policy);
+
+void set_log_decimation(int every);
+
+void start_log(int n_values);
+
+float *log_row();
+
+void log_commit();
+
+void close_log();
+
+/*
+ * Sensor traces for record and replay (-W and -X); see trace.c. After
+ * the header, each I/O tick is a frame of its ADC readings in units of
+ * 1/65536, preceded by a frame for each event during that tick, which
+ * has TRACE_EVENT_MARK in place of the first reading and the event in
+ * the second. An EVENT_CATCHUP frame has the number of missed ticks the
+ * tick caught up on in the third.
+ */
+#define TRACE_MAGIC 0x5254424e /* "NBTR" */
+#define TRACE_VERSION 3
+#define TRACE_CHANNELS 4
+#define TRACE_EVENT_MARK 0xffff
+
+struct trace_file_header {
+    uint32_t magic, version;
+    uint32_t dt_us, io_steps, n_channels;
+    uint32_t catchup_ticks; /* The most any one tick caught up on. */
+};
+
+struct trace_frame {
+    uint16_t sample[TRACE_CHANNELS];
+};
+
+enum trace_event { EVENT_REVERSAL, EVENT_CATCHUP, N_TRACE_EVENTS };
+
+extern bool g_recording, g_replaying;
+
+void record_trace(const char *path);
+
+void replay_trace(const char *path);
+
+void start_trace();
+
+float trace_adc(int channel, float value);
+
+bool trace_event(enum trace_event event, bool happens);
+
+void trace_step();
+
+int trace_catchup(int ticks);
+
+void close_trace();
+
+/*
+ * Telemetry datagrams (-Y; see telemetry.c): a header and then n_values
+ * floats, in the order named by the last layout datagram, which has
+ * TELEMETRY_LAYOUT_MAGIC and the names as comma-separated text in place
+ * of the values. The step is counted in network steps of dt_us.
+ */
+#define TELEMETRY_MAGIC 0x4d54424e /* "NBTM" */
+#define TELEMETRY_LAYOUT_MAGIC 0x4c54424e /* "NBTL" */
+#define TELEMETRY_MAX_FRAME 60000
+
+struct telemetry_header {
+    uint32_t magic, seq;
+    int64_t step;
+    uint32_t n_values, dt_us;
+};
+
+extern bool g_telemetry;
+
+void open_telemetry(const char *spec);
+
+void telemetry_network(const struct network *net);
+
+void telemetry_adc(int channel, float value);
+
+void telemetry_actuator(size_t i, float activation);
+
+void send_telemetry(uint64_t late_ns, uint64_t busy_ns);
+
+void close_telemetry();
+
+/*
+ * Spike logs (-E; see spikelog.c) are this header and then 32-bit
+ * words, each a type in the top byte and a payload below. Steps are
+ * network steps of dt_us, starting from 0: a SPIKE_LOG_STEP word moves
+ * on by its payload, and the words after it happen at the step it
+ * reaches. A SPIKE_LOG_SPIKE word is the number of a cell that fired.
+ * Samples, every sample_every I/O ticks, are a word for each ADC
+ * channel and then each actuator, with the channel in bits 16-23 and
+ * the value below: readings in units of 1/65536 and activations as
+ * signed 16-bit fractions of full scale.
+ */
+#define SPIKE_LOG_MAGIC 0x4541424e /* "NBAE" */
+#define SPIKE_LOG_VERSION 1
+#define SPIKE_LOG_MAX_PAYLOAD 0xffffff
+
+enum spike_log_word {
+    SPIKE_LOG_SPIKE, SPIKE_LOG_STEP, SPIKE_LOG_ADC, SPIKE_LOG_ACT
+};
+
+struct spike_log_header {
+    uint32_t magic, version;
+    uint32_t dt_us, io_steps;
+    uint32_t n_cells, sample_every;
+};
+
+extern bool g_spike_log;
+
+void open_spike_log(const char *spec);
+
+void spike_log_network(const struct network *net);
+
+void spike_log_step();
+
+void log_spike(int cell);
+
+void spike_log_adc(int channel, float value);
+
+void spike_log_actuator(size_t i, float activation);
+
+void spike_log_tick();
+
+void close_spike_log();
+
+/*
+ * The shared-memory control plane (-K; see control.c): a POSIX shared
+ * memory object holding one struct control_block, through which the
+ * tune tool watches a running controller and changes its parameters.
+ * The controller publishes a snapshot of the loop and its cells under
+ * snapshot_seq; tools write params under params_seq, taking the lock
+ * among themselves by moving it from even to odd with a compare and
+ * swap, and the loop picks up a finished write at the end of a tick.
+ * bound says which params this controller has, by bit.
+ */
+#define CONTROL_MAGIC 0x5043424e /* "NBCP" */
+#define CONTROL_VERSION 1
+#define CONTROL_MAX_CELLS 1024
+
+/* Units are those of the matching options: %, pA, a factor, ms. */
+enum control_param {
+    CONTROL_PWM_MAX, CONTROL_FEEDBACK, CONTROL_CONDUCTANCE,
+    CONTROL_REVERSAL, CONTROL_KP, CONTROL_KI, N_CONTROL_PARAMS
+};
+
+#define CONTROL_PARAM_NAMES { \
+    "pwm_max", "feedback", "conductance", "reversal", "k_p", "k_i" \
+}
+
+struct control_snapshot {
+    int64_t step;
+    uint64_t elapsed_ns;
+    int64_t overruns;
+    float late_us, busy_us;
+    uint32_t params_seq, n_cells;
+    float v[CONTROL_MAX_CELLS], u[CONTROL_MAX_CELLS];
+    float i[CONTROL_MAX_CELLS], j[CONTROL_MAX_CELLS];
+};
+
+struct control_block {
+    uint32_t magic, version;
+    int32_t pid;
+    uint32_t bound;
+    uint32_t params_seq __attribute__((aligned(64)));
+    float params[N_CONTROL_PARAMS];
+    uint32_t snapshot_seq __attribute__((aligned(64)));
+    struct control_snapshot snapshot;
+};
+
+extern bool g_control;
+
+void open_control(const char *name);
+
+void control_bind(enum control_param param, float *value);
+
+void control_network(const struct network *net);
+
+void control_tick(uint64_t late_ns, uint64_t busy_ns);
+
+void close_control();
+
+/*
+ * A continuously sampled ADC ring buffer: some producer writes samples
+ * of n_channels interleaved values into a ring of length values at
+ * rate_hz and keeps *write_index pointing at where it will write next.
+ * See adcring.c for the consumer side. ADC_RING_SAFE_SAMPLES(n) is how
+ * many samples a ring of n can take between polls before the poll
+ * counts it as lapped.
+ */
+#define ADC_MAX_CHANNELS 8
+#define ADC_RING_SAMPLES 1024
+#define ADC_MAX_RATE_HZ 200000
+#define ADC_RING_SAFE_SAMPLES(n) ((n) - (n) / 8)
+
+struct adc_ring {
+    const volatile uint16_t *values;
+    const volatile uint32_t *write_index;
+    uint32_t length, read_index;
+    int n_channels, rate_hz;
+    bool average;
+    uint64_t polled_ns;
+    long overruns;
+    float value[ADC_MAX_CHANNELS];
+};
+
+void adc_ring_init(struct adc_ring *ring, const volatile uint16_t *values,
+        const volatile uint32_t *write_index, uint32_t n_samples,
+        int n_channels, int rate_hz, bool average);
+
+int adc_ring_poll(struct adc_ring *ring, uint64_t now_ns);
+
+extern int g_adc_rate_hz;
+extern bool g_adc_average;
+void poll_adc();
+
 float read_adc(int channel_index);
 
 bool check_spike(struct state *state, const struct params *params);
 
+/* All synaptic currents are scaled by this, for tuning a running CPG. */
+extern float g_conductance_scale;
+
+void synaptic_currents(const struct synapses *synapses,
+        const struct network *net, float *i_in);
+
+void gather_currents(const struct synapses *synapses, const float *v_post,
+        const float *i_pre, float *i_in, int lo, int hi);
+
+void start_active_set(struct network *net);
+
+void activate_cell(struct network *net, int cell);
+
+void active_synaptic_currents(const struct fanout *fanout,
+        struct network *net, float *i_in);
+
+void feedback_currents(const struct feedback_tap *taps, int n_taps,
+        const float *position, float gain, float *i_in);
+
+float motor_activation(const struct network *net, const struct motor *m);
+
+int check_spikes_all(struct network *net, bool *fired);
+
+int check_spikes_range(struct network *net, bool *fired, int lo, int hi);
+
+void select_integrator(const char *name);
+
+void prepare_dynamics(struct network *net);
+
+void resolve_dynamics_all(struct network *net, const float *i_in);
+
+void resolve_dynamics_range(struct network *net, const float *i_in,
+        int lo, int hi);
+
 void resolve_dynamics(struct state *state, 
         const struct params *param, float i_in);
 
+/*
+ * The fixed-point engine; see fixed.c. The batch routines above switch
+ * over to it once start_fixed_point() has been called on a network,
+ * which start_network() does in builds with FIXED_POINT defined
+ * ("make FIXED=1").
+ */
+void start_fixed_point(struct network *net, const struct synapses *syn);
+
+void fixed_import(struct network *net, int cell);
+
+int fixed_check_spikes(struct network *net, bool *fired);
+
+void fixed_synaptic_currents(const struct network *net, float *i_in);
+
+void fixed_resolve_dynamics(struct network *net, const float *i_in);
+
+void start_network(struct network *net, const struct synapses *syn);
+
+long network_run(struct network *net, const struct synapses *synapses,
+        long n_steps, const float *i_ext, float *v_out, bool *raster);
+
+/*
+ * A pool of threads stepping one network between them, each owning a
+ * range of its cells; see parallel.c. The results are the same as the
+ * serial CSR path's, bit for bit.
+ */
+struct pool;
+
+#define MAX_POOL_THREADS 64
+
+struct pool *start_pool(struct network *net, const struct synapses *syn,
+        const struct feedback_tap *taps, int n_taps, int n_threads);
+
+int pool_step(struct pool *pool, const float *position, float feedback);
+
+void stop_pool(struct pool *pool);
+
+/* What to do in a busy-wait loop, as a hint to the CPU. */
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__arm__) || defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+/*
+ * A sequence lock for handing a small block of data from one writer
+ * thread to readers that must never block it. The count is odd while a
+ * write is under way; a reader copies the data out and tries again if
+ * the count was odd or changed meanwhile. seqlock_read() returns the
+ * count the copy belongs to, which goes up by two per write. A write
+ * made in place, for data that isn't in one piece, goes between
+ * seqlock_write_begin() and seqlock_write_end().
+ */
+static inline void seqlock_write_begin(uint32_t *seq)
+{
+    uint32_t s = __atomic_load_n(seq, __ATOMIC_RELAXED);
+    __atomic_store_n(seq, s + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seqlock_write_end(uint32_t *seq)
+{
+    uint32_t s = __atomic_load_n(seq, __ATOMIC_RELAXED);
+    __atomic_store_n(seq, s + 1, __ATOMIC_RELEASE);
+}
+
+static inline void seqlock_write(uint32_t *seq, void *data,
+        const void *value, size_t size)
+{
+    seqlock_write_begin(seq);
+    memcpy(data, value, size);
+    seqlock_write_end(seq);
+}
+
+static inline uint32_t seqlock_read(const uint32_t *seq, const void *data,
+        void *value, size_t size)
+{
+    uint32_t before, after;
+    do {
+        before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+        memcpy(value, data, size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(seq, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+    return before;
+}
+
+/*
+ * A single attempt at seqlock_read(), for a reader that mustn't wait on
+ * the writer either: returns false, with value undefined, if the data
+ * was being written.
+ */
+static inline bool seqlock_try_read(const uint32_t *seq, const void *data,
+        void *value, size_t size, uint32_t *count)
+{
+    uint32_t before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+    if (before & 1) return false;
+    memcpy(value, data, size);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    *count = before;
+    return __atomic_load_n(seq, __ATOMIC_RELAXED) == before;
+}
+
+/*
+ * The optional two-stage pipeline (-A; see pipeline.c): an I/O thread
+ * owns the backend, sampling the ADC and writing the actuators on the
+ * loop's clock, while the loop itself only computes. The functions
+ * below are what read_adc(), apply_actuator(), commit_actuators() and
+ * synchronize_loop() turn into when it's on; the ones after them are
+ * the parts of those the I/O thread uses.
+ */
+extern bool g_pipelined;
+
+void start_pipeline();
+
+void stop_pipeline();
+
+float pipelined_adc(int channel);
+
+void pipelined_actuator(size_t i, float activation);
+
+void pipelined_commit();
+
+uint64_t pipelined_wait();
+
+long io_step();
+
+void print_pipeline_stats();
+
+float sample_adc(int channel);
+
+void stage_actuator(size_t i, float activation);
+
+void write_actuators(uint64_t sensed_ns);
+
+uint64_t wait_for_deadline();
+
+void kick_cell(struct network *net, int cell);
+
 void apply_actuator(size_t i, float signed_fractional_activation);
 
+void commit_actuators();
+
+extern float g_pwm_max;
 void set_pwm_max(float percentage);
 
+/* Options accepted by every controller, handled by common_option(). */
+#define COMMON_OPTIONS "p:O:Q:B:R:C:T:S:FI:U:d:W:X:AM:L:Y:E:K:V:"
+bool common_option(int opt, const char *arg);
+
+extern long g_num_dts;
 float get_current_time();
 
+uint64_t now_ns();
+
+/*
+ * Log-linear histogram of durations in ns; see histogram.c. The exact
+ * range covers everything below 2*HIST_SUB, and anything past 2^32 ns
+ * is lumped into the last bucket.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((33 - HIST_SUB_BITS) * HIST_SUB)
+
+struct histogram {
+    uint64_t count, sum, min, max;
+    uint32_t buckets[HIST_BUCKETS];
+};
+
+void histogram_reset(struct histogram *h);
+
+void histogram_add(struct histogram *h, uint64_t value);
+
+uint64_t histogram_quantile(const struct histogram *h, double q);
+
+uint64_t histogram_mean(const struct histogram *h);
+
+/* Real-time mode, off unless g_rt_priority is set (-R). */
+extern int g_rt_priority, g_rt_cpu;
+void enable_realtime();
+
+void demote_thread();
+
+/*
+ * Phases of one step of the control loop, timed separately when
+ * profiling is on (-T). Each phase_done() call charges the time since
+ * the previous one (or since the loop woke up) to the given phase.
+ */
+enum phase {
+    PHASE_ADC, PHASE_SPIKES, PHASE_DYNAMICS, PHASE_ACTUATOR, PHASE_LOG,
+    N_PHASES
+};
+
+extern bool g_profiling;
+void profile_phase(enum phase phase);
+
+static inline void phase_done(enum phase phase)
+{
+    if (g_profiling) profile_phase(phase);
+}
+
+/*
+ * How late each step's wakeup was relative to its deadline, and how
+ * long it took from reading the sensors to writing the actuators.
+ */
+extern struct histogram g_lateness, g_latency;
+extern long g_num_overruns;
 void synchronize_loop();
 
 void print_final_time();
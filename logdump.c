@@ -0,0 +1,191 @@
+/*
+ *
+ * logdump.c
+ *
+ * Turn a binary or compressed data log written by one of the
+ * controllers back into the same CSV the controller would have written
+ * directly, optionally only the rows from FROM to TO ms:
+ *
+ *     logdump run.nbz [FROM [TO]]
+ *
+ * A compressed log's index lets it skip straight to FROM.
+ *
+ */
+
+#include "libneurobot.h"
+
+
+/* Same as die(), but this doesn't link against the rest of libneurobot. */
+static void fail(const char *message, const char *arg)
+{
+    if (arg) fprintf(stderr, "%s: %s\n", message, arg);
+    else fprintf(stderr, "%s :(\n", message);
+    exit(1);
+}
+
+
+static char *read_columns(FILE *in, uint32_t len, const char *path)
+{
+    char *columns = malloc(len + 1);
+    if (!columns) fail("Out of memory", NULL);
+    if (fread(columns, 1, len, in) != len)
+        fail("Truncated log header", path);
+    columns[len] = '\0';
+    printf("%s\n", columns);
+    return columns;
+}
+
+
+static void dump_binary(FILE *in, const char *path, double from, double to)
+{
+    struct log_file_header header;
+    if (fread(&header, sizeof header, 1, in) != 1)
+        fail("Not a binary neurobot log", path);
+    if (header.version != LOG_VERSION)
+        fail("Unsupported log version", path);
+
+    char *columns = read_columns(in, header.header_len, path);
+    struct log_record *rec = malloc(header.record_size);
+    if (!rec) fail("Out of memory", NULL);
+
+    float dt_ms = (float)header.dt_us / US_PER_MS;
+    while (fread(rec, header.record_size, 1, in) == 1) {
+        double t = rec->step * dt_ms;
+        if (t < from) continue;
+        if (t > to) break;
+        printf("%f", (float)(rec->step * dt_ms));
+        for (uint32_t i = 0; i < header.n_values; i++)
+            printf(", %f", rec->values[i]);
+        printf("\n");
+    }
+
+    free(columns);
+    free(rec);
+}
+
+
+static const uint8_t *get_varint(const uint8_t *in, const uint8_t *end,
+        uint64_t *x)
+{
+    *x = 0;
+    for (int shift = 0; in < end && shift < 64; shift += 7) {
+        *x |= (uint64_t)(*in & 0x7f) << shift;
+        if (!(*in++ & 0x80)) return in;
+    }
+    return NULL;
+}
+
+
+/* Undo datalog.c's put_column(). */
+static const uint8_t *get_column(const uint8_t *in, const uint8_t *end,
+        int64_t *q, int n)
+{
+    uint64_t value = 0, delta = 0;
+    for (int k = 0; k < n && in; k++) {
+        uint64_t z, r;
+        in = get_varint(in, end, &z);
+        r = (z >> 1) ^ -(z & 1);
+        if (k == 0) value = r;
+        else value += delta += r;
+        q[k] = value;
+    }
+    return in;
+}
+
+
+/*
+ * Find where to start reading for the given step: the offset of the
+ * last block starting at or before it, going by the index, or else the
+ * first block.
+ */
+static long seek_block(FILE *in, long first_block, int64_t step)
+{
+    struct column_log_trailer trailer;
+    if (fseek(in, -(long)sizeof trailer, SEEK_END)
+            || fread(&trailer, sizeof trailer, 1, in) != 1
+            || trailer.magic != COLUMN_INDEX_MAGIC
+            || fseek(in, trailer.index_offset, SEEK_SET))
+        return first_block;
+
+    long offset = first_block;
+    struct column_index_entry entry;
+    for (uint32_t b = 0; b < trailer.n_blocks; b++) {
+        if (fread(&entry, sizeof entry, 1, in) != 1
+                || entry.first_step > step)
+            break;
+        offset = entry.offset;
+    }
+    return offset;
+}
+
+
+static void dump_columns(FILE *in, const char *path, double from, double to)
+{
+    struct column_log_header header;
+    if (fread(&header, sizeof header, 1, in) != 1)
+        fail("Not a compressed neurobot log", path);
+    if (header.version != COLUMN_LOG_VERSION)
+        fail("Unsupported log version", path);
+
+    char *columns = read_columns(in, header.header_len, path);
+    int n_columns = header.n_values + 1;
+    int64_t *block = malloc(n_columns * header.block_rows * sizeof *block);
+    uint8_t *bytes = malloc(n_columns * header.block_rows * 10);
+    if (!block || !bytes) fail("Out of memory", NULL);
+
+    float dt_ms = (float)header.dt_us / US_PER_MS;
+    long start = seek_block(in, ftell(in), from > 0 ? from / dt_ms : 0);
+    if (fseek(in, start, SEEK_SET)) fail("Couldn't seek in log", path);
+
+    struct column_block_header bh;
+    while (fread(&bh, sizeof bh, 1, in) == 1
+            && bh.magic == COLUMN_BLOCK_MAGIC) {
+        if (bh.n_rows > header.block_rows
+                || bh.size > n_columns * header.block_rows * 10
+                || fread(bytes, 1, bh.size, in) != bh.size)
+            fail("Corrupt log block", path);
+
+        const uint8_t *p = bytes, *end = bytes + bh.size;
+        for (int c = 0; c < n_columns && p; c++)
+            p = get_column(p, end, block + c*bh.n_rows, bh.n_rows);
+        if (!p) fail("Corrupt log block", path);
+
+        for (uint32_t k = 0; k < bh.n_rows; k++) {
+            double t = block[k] * dt_ms;
+            if (t < from) continue;
+            if (t > to) goto done;
+            printf("%f", (float)(block[k] * dt_ms));
+            for (int c = 1; c < n_columns; c++)
+                printf(", %f", (float)(block[c*bh.n_rows + k]
+                            * (double)header.quantum));
+            printf("\n");
+        }
+    }
+
+done:
+    free(columns);
+    free(block);
+    free(bytes);
+}
+
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 4)
+        fail("Usage: logdump file.bin|file.nbz [FROM [TO]]", NULL);
+
+    double from = argc > 2 ? atof(argv[2]) : -INFINITY;
+    double to = argc > 3 ? atof(argv[3]) : INFINITY;
+
+    FILE *in = fopen(argv[1], "rb");
+    if (!in) fail("Couldn't open log", argv[1]);
+
+    uint32_t magic;
+    if (fread(&magic, sizeof magic, 1, in) != 1) magic = 0;
+    rewind(in);
+    if (magic == LOG_MAGIC) dump_binary(in, argv[1], from, to);
+    else if (magic == COLUMN_LOG_MAGIC) dump_columns(in, argv[1], from, to);
+    else fail("Not a binary neurobot log", argv[1]);
+
+    fclose(in);
+}
@@ -0,0 +1,159 @@
+"""
+Loading the controllers' compressed logs (filenames ending in .nbz; see
+datalog.c and struct column_log_header) into NumPy, a block at a time
+and without any per-value Python, or streaming them back out as CSV:
+
+    from logreader import load
+    names, t, values = load('run.nbz', start=1000, end=2000)
+
+    python3 logreader.py run.nbz [--from MS] [--to MS] [--npz OUT]
+
+t is in ms, and values has one row per logged step and one column per
+name. The index at the end of the log is used to skip straight to the
+blocks covering start, if the run lived long enough to write it.
+"""
+import argparse
+import struct
+import sys
+
+import numpy as np
+
+COLUMN_LOG_MAGIC = 0x5a4c424e
+COLUMN_BLOCK_MAGIC = 0x4b4c424e
+COLUMN_INDEX_MAGIC = 0x584c424e
+COLUMN_LOG_VERSION = 1
+HEADER = struct.Struct('<6Ifi')
+BLOCK = struct.Struct('<4Iq')
+INDEX_ENTRY = struct.Struct('<qQ')
+TRAILER = struct.Struct('<QII')
+
+
+def decode_varints(data, count):
+    """The first count zigzag varints in data, as int64s."""
+    b = np.frombuffer(data, np.uint8)
+    ends = np.flatnonzero(b < 0x80)[:count]
+    if len(ends) < count:
+        raise ValueError('corrupt log block')
+    starts = np.empty_like(ends)
+    starts[0] = 0
+    starts[1:] = ends[:-1] + 1
+    b = b[:ends[-1] + 1]
+    shift = np.arange(len(b)) - np.repeat(starts, ends - starts + 1)
+    parts = (b & 0x7f).astype(np.uint64) << (7 * shift).astype(np.uint64)
+    z = np.bitwise_or.reduceat(parts, starts)
+    return ((z >> np.uint64(1)).astype(np.int64)
+            ^ -(z & np.uint64(1)).astype(np.int64))
+
+
+def decode_block(data, n_columns, n_rows):
+    """A block's columns as int64s, one row per column."""
+    q = decode_varints(data, n_columns * n_rows).reshape(n_columns, n_rows)
+    # Second differences, so sum twice; the first value stands alone.
+    q[:, 1:] = np.cumsum(q[:, 1:], axis=1)
+    return np.cumsum(q, axis=1)
+
+
+class Log:
+    def __init__(self, path):
+        self.f = open(path, 'rb')
+        (magic, version, self.n_values, self.block_rows, self.dt_us,
+                header_len, self.quantum, _) = HEADER.unpack(
+                        self.f.read(HEADER.size))
+        if magic != COLUMN_LOG_MAGIC:
+            raise ValueError(f'{path} is not a compressed neurobot log')
+        if version != COLUMN_LOG_VERSION:
+            raise ValueError(f'{path} has unsupported version {version}')
+        self.names = self.f.read(header_len).decode().split(',')
+        self.first_block = self.f.tell()
+        self.index = self.read_index()
+
+    def read_index(self):
+        """The (first step, offset) of each block, or None."""
+        self.f.seek(0, 2)
+        if self.f.tell() < self.first_block + TRAILER.size:
+            return None
+        self.f.seek(-TRAILER.size, 2)
+        index_offset, n_blocks, magic = TRAILER.unpack(
+                self.f.read(TRAILER.size))
+        if magic != COLUMN_INDEX_MAGIC:
+            return None
+        self.f.seek(index_offset)
+        return list(INDEX_ENTRY.iter_unpack(
+                self.f.read(n_blocks * INDEX_ENTRY.size)))
+
+    def blocks(self, start_step=None):
+        """Yield (steps, values) for each block, from start_step on."""
+        offset = self.first_block
+        for first_step, block_offset in self.index or ():
+            if start_step is None or first_step > start_step:
+                break
+            offset = block_offset
+        self.f.seek(offset)
+
+        n_columns = self.n_values + 1
+        while True:
+            header = self.f.read(BLOCK.size)
+            if len(header) < BLOCK.size:
+                return
+            magic, n_rows, size, _, _ = BLOCK.unpack(header)
+            if magic != COLUMN_BLOCK_MAGIC:
+                return
+            q = decode_block(self.f.read(size), n_columns, n_rows)
+            yield q[0], (q[1:].T * float(self.quantum)).astype(np.float32)
+
+    def rows(self, start=None, end=None):
+        """Yield (t, values) a block at a time for start <= t <= end ms."""
+        dt_ms = self.dt_us / 1000
+        start_step = None if start is None else int(start // dt_ms)
+        for steps, values in self.blocks(start_step):
+            t = (steps * dt_ms).astype(np.float32)
+            keep = np.ones(len(t), bool)
+            if start is not None:
+                keep &= t >= start
+            if end is not None:
+                keep &= t <= end
+            if keep.any():
+                yield t[keep], values[keep]
+            if end is not None and t[-1] > end:
+                return
+
+
+def load(path, start=None, end=None):
+    """
+    The names of the logged values (after t), the times in ms and the
+    values, from start to end ms if given.
+    """
+    log = Log(path)
+    parts = list(log.rows(start, end))
+    if not parts:
+        return (log.names[1:], np.empty(0, np.float32),
+                np.empty((0, log.n_values), np.float32))
+    t, values = zip(*parts)
+    return log.names[1:], np.concatenate(t), np.concatenate(values)
+
+
+def write_csv(log, out, start=None, end=None):
+    """The same CSV the controller would have written."""
+    out.write(','.join(log.names) + '\n')
+    for t, values in log.rows(start, end):
+        np.savetxt(out, np.column_stack((t, values)), fmt='%f',
+                delimiter=', ')
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(
+            description='Decode a compressed controller log.')
+    parser.add_argument('log', help='.nbz log written by a controller')
+    parser.add_argument('--from', dest='start', type=float, metavar='MS',
+            help='first time to decode')
+    parser.add_argument('--to', dest='end', type=float, metavar='MS',
+            help='last time to decode')
+    parser.add_argument('--npz', metavar='OUT',
+            help='save NumPy arrays t and values here instead of CSV')
+    args = parser.parse_args()
+
+    if args.npz:
+        names, t, values = load(args.log, args.start, args.end)
+        np.savez(args.npz, names=names, t=t, values=values)
+    else:
+        write_csv(Log(args.log), sys.stdout, args.start, args.end)
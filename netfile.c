@@ -0,0 +1,136 @@
+/*
+ *
+ * netfile.c
+ *
+ * Loading binary network files (see struct network_file_header). The
+ * file is mapped read-only and the parameters, synapses, taps and motors
+ * are used where they lie; only the state, which the loop writes, is
+ * copied out. Checking is limited to what could otherwise send the
+ * batch routines outside their arrays: the section bounds and alignment,
+ * and the cell and actuator indices, which is one pass over the
+ * synapses and still well under a millisecond for tens of thousands.
+ *
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libneurobot.h"
+
+
+/* Where a section of the given size starts, if it fits. */
+static const void *section(const struct loaded_network *ln, uint64_t offset,
+        uint64_t size, const char *path)
+{
+    if (offset % NETWORK_FILE_ALIGN || offset > ln->map_size
+            || size > ln->map_size - offset)
+        die("Corrupt network file", path);
+    return (const char *)ln->map + offset;
+}
+
+
+static void check_index(int x, int n, const char *path)
+{
+    if (x < 0 || x >= n) die("Corrupt network file", path);
+}
+
+
+/* Check CSR or CSC starts and the cell indices they cover. */
+static void check_sparse(const int *start, const int *cells, size_t stride,
+        int n, int n_synapses, const char *path)
+{
+    if (start[0] != 0 || start[n] != n_synapses)
+        die("Corrupt network file", path);
+    for (int i = 0; i < n; i++)
+        if (start[i] > start[i+1]) die("Corrupt network file", path);
+    for (int k = 0; k < n_synapses; k++)
+        check_index(*(const int *)((const char *)cells + k*stride), n, path);
+}
+
+
+void load_network(const char *path, struct loaded_network *ln)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) die("Couldn't open network file", path);
+    struct stat st;
+    if (fstat(fd, &st)) die("Couldn't stat network file", path);
+    if ((size_t)st.st_size < sizeof(struct network_file_header))
+        die("Not a network file", path);
+
+    memset(ln, 0, sizeof *ln);
+    ln->map_size = st.st_size;
+    ln->map = mmap(NULL, ln->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ln->map == MAP_FAILED) die("Couldn't map network file", path);
+
+    const struct network_file_header *h = ln->map;
+    if (h->magic != NETWORK_FILE_MAGIC) die("Not a network file", path);
+    if (h->version != NETWORK_FILE_VERSION)
+        die("Unsupported network file version", path);
+    if (h->size != ln->map_size) die("Truncated network file", path);
+
+    /* Bound the counts before any sizes are worked out from them. */
+    if (h->n_cells < 1 || h->n_cells > NETWORK_FILE_MAX_CELLS
+            || h->n_synapses > NETWORK_FILE_MAX_SYNAPSES
+            || h->n_feedback > h->n_cells || h->n_motors > 4)
+        die("Corrupt network file", path);
+    int n = h->n_cells, n_syn = h->n_synapses;
+    size_t padded = PADDED(n), values = padded * sizeof(float);
+    uint64_t index_size = ((uint64_t)n + 1) * sizeof(int);
+    ln->n_synapses = n_syn;
+    ln->n_feedback = h->n_feedback;
+    ln->n_motors = h->n_motors;
+
+    const float *state = section(ln, h->state, 4 * (uint64_t)values, path);
+    const float *params = section(ln, h->params, 10 * (uint64_t)values,
+            path);
+    const int *rows = section(ln, h->rows, index_size, path);
+    const struct synapse *syn = section(ln, h->synapses,
+            (uint64_t)n_syn * sizeof *syn, path);
+    const int *cols = section(ln, h->cols, index_size, path);
+    const struct synapse_out *out = section(ln, h->fanout,
+            (uint64_t)n_syn * sizeof *out, path);
+    ln->feedback_taps = section(ln, h->taps,
+            (uint64_t)ln->n_feedback * sizeof *ln->feedback_taps, path);
+    ln->motors = section(ln, h->motors,
+            (uint64_t)ln->n_motors * sizeof *ln->motors, path);
+
+    check_sparse(rows, &syn->pre, sizeof *syn, n, n_syn, path);
+    check_sparse(cols, &out->post, sizeof *out, n, n_syn, path);
+    for (int t = 0; t < ln->n_feedback; t++) {
+        check_index(ln->feedback_taps[t].cell, n, path);
+        check_index(ln->feedback_taps[t].prev, 4, path);
+        check_index(ln->feedback_taps[t].next, 4, path);
+    }
+    for (int m = 0; m < ln->n_motors; m++) {
+        check_index(ln->motors[m].flexor, n, path);
+        check_index(ln->motors[m].extensor, n, path);
+    }
+
+    void *block = NULL;
+    if (posix_memalign(&block, NETWORK_FILE_ALIGN, 4 * values))
+        die("Couldn't allocate network state", NULL);
+    float *v = block;
+    memcpy(v, state, 4 * values);
+
+    ln->net = (struct network){
+        .n = n,
+        .v = v, .u = v + padded, .i = v + 2*padded, .j = v + 3*padded,
+        .k = params, .inv_C = params + padded,
+        .inv_tau = params + 2*padded, .a = params + 3*padded,
+        .b = params + 4*padded, .c = params + 5*padded,
+        .d = params + 6*padded, .vr = params + 7*padded,
+        .vt = params + 8*padded, .vp = params + 9*padded,
+    };
+    ln->synapses = (struct synapses){.row = rows, .syn = syn};
+    ln->fanout = (struct fanout){.col = cols, .out = out};
+}
+
+
+void unload_network(struct loaded_network *ln)
+{
+    free(ln->net.v);
+    munmap(ln->map, ln->map_size);
+    ln->map = NULL;
+}
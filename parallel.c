@@ -0,0 +1,273 @@
+/*
+ *
+ * parallel.c
+ *
+ * Stepping big networks on several cores. The cells are split into one
+ * contiguous range per thread, in whole vectors, balanced by how many
+ * synapses each range has to gather; the calling thread takes the first
+ * range and a pool of workers the rest. Within a step each thread checks
+ * its own cells for spikes, gathers their synaptic input, adds their
+ * feedback and integrates them, all without waiting for anyone else.
+ * That works because the only thing a cell needs from other threads'
+ * cells is their presynaptic i from the end of the previous step, which
+ * spike checks never touch: the gather reads it from a snapshot, and
+ * each thread writes its cells' new i into the other snapshot, so the
+ * two swap roles every step. The threads only meet at the start and end
+ * of each step.
+ *
+ * Every cell sees exactly the same arithmetic in the same order as in
+ * the serial CSR path (check_spikes_all(), synaptic_currents(),
+ * feedback_currents(), resolve_dynamics_all()), so the results are
+ * identical to it bit for bit, whatever the number of threads. They
+ * aren't quite the same as the event-driven path's, which sums each
+ * cell's synaptic input in a different order.
+ *
+ * The barriers spin for a while, which is what keeps a step of a few
+ * microseconds cheap, and then sleep on a futex so that idle workers
+ * don't burn a core; with more threads than CPUs they don't spin at
+ * all. With -C, worker k is pinned to the CPU k places after the loop's.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+
+#include "libneurobot.h"
+
+
+/* How many times to check a barrier before going to sleep on it. */
+#define BARRIER_SPINS 20000
+
+/* The cost of a cell's own update, in synapses' worth of gathering. */
+#define CELL_COST 8
+
+struct barrier {
+    int n_threads, spins;
+    int count, sleepers;
+    uint32_t generation;
+};
+
+/* Aligned so that no two threads' fired counts share a cache line. */
+struct worker {
+    struct pool *pool;
+    int lo, hi;
+    struct feedback_tap *taps;
+    int n_taps, fired;
+    pthread_t thread;
+} __attribute__((aligned(64)));
+
+struct pool {
+    struct network *net;
+    const struct synapses *synapses;
+    int n_threads;
+    struct worker *workers;
+    float *i_in, *i_snap[2];
+    struct barrier start, done;
+
+    /* The current step's inputs, set before the start barrier. */
+    const float *position;
+    float feedback;
+    long step;
+    bool stopping;
+};
+
+
+static void barrier_wait(struct barrier *b)
+{
+    uint32_t gen = __atomic_load_n(&b->generation, __ATOMIC_ACQUIRE);
+    if (__atomic_add_fetch(&b->count, 1, __ATOMIC_ACQ_REL)
+            == b->n_threads) {
+        __atomic_store_n(&b->count, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&b->generation, gen + 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&b->sleepers, __ATOMIC_SEQ_CST))
+            syscall(SYS_futex, &b->generation, FUTEX_WAKE_PRIVATE,
+                    INT32_MAX, NULL, NULL, 0);
+        return;
+    }
+
+    for (int spin = 0;
+            __atomic_load_n(&b->generation, __ATOMIC_ACQUIRE) == gen;
+            spin++) {
+        if (spin < b->spins) {
+            cpu_relax();
+            continue;
+        }
+        __atomic_add_fetch(&b->sleepers, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &b->generation, FUTEX_WAIT_PRIVATE, gen,
+                NULL, NULL, 0);
+        __atomic_sub_fetch(&b->sleepers, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+
+/* One thread's share of a step. */
+static void run_partition(struct worker *w)
+{
+    struct pool *pool = w->pool;
+    struct network *net = pool->net;
+    int cur = pool->step & 1;
+
+    w->fired = check_spikes_range(net, NULL, w->lo, w->hi);
+    gather_currents(pool->synapses, net->v, pool->i_snap[cur], pool->i_in,
+            w->lo, w->hi);
+    feedback_currents(w->taps, w->n_taps, pool->position, pool->feedback,
+            pool->i_in);
+    resolve_dynamics_range(net, pool->i_in, w->lo, w->hi);
+    memcpy(&pool->i_snap[!cur][w->lo], &net->i[w->lo],
+            (w->hi - w->lo) * sizeof(float));
+}
+
+
+static void *work(void *arg)
+{
+    struct worker *w = arg;
+    struct pool *pool = w->pool;
+    for (;;) {
+        barrier_wait(&pool->start);
+        if (pool->stopping) return NULL;
+        run_partition(w);
+        barrier_wait(&pool->done);
+    }
+}
+
+
+/*
+ * Split the cells into n ranges of whole NETWORK_PAD blocks with about
+ * the same work in each. With more threads than blocks, the last ones
+ * get empty ranges at the end.
+ */
+static void partition(struct pool *pool)
+{
+    const struct network *net = pool->net;
+    const int *row = pool->synapses->row;
+    int n = net->n, n_blocks = PADDED(n) / NETWORK_PAD;
+    long total = (long)row[n] + (long)CELL_COST * n;
+
+    int block = 0;
+    long done = 0;
+    for (int t = 0; t < pool->n_threads; t++) {
+        struct worker *w = &pool->workers[t];
+        long target = total * (t + 1) / pool->n_threads;
+        w->lo = block * NETWORK_PAD < n ? block * NETWORK_PAD : n;
+        bool last = t == pool->n_threads - 1;
+        while (block < n_blocks && (done < target || last)) {
+            int lo = block * NETWORK_PAD, hi = lo + NETWORK_PAD;
+            if (hi > n) hi = n;
+            done += row[hi] - row[lo] + (long)CELL_COST * (hi - lo);
+            block++;
+        }
+        w->hi = block * NETWORK_PAD < n ? block * NETWORK_PAD : n;
+    }
+}
+
+
+static void pin_worker(struct worker *w, int k)
+{
+    if (g_rt_cpu < 0) return;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET((g_rt_cpu + k) % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+    if (pthread_setaffinity_np(w->thread, sizeof cpus, &cpus))
+        die("Couldn't pin worker thread", NULL);
+}
+
+
+static float *alloc_cells(const struct network *net)
+{
+    void *p = NULL;
+    if (posix_memalign(&p, 4*NETWORK_PAD, PADDED(net->n) * sizeof(float)))
+        die("Couldn't allocate thread pool", NULL);
+    return memset(p, 0, PADDED(net->n) * sizeof(float));
+}
+
+
+/*
+ * Start n_threads - 1 workers on the network, with the given feedback
+ * taps. From here on the network should only be stepped with
+ * pool_step(). Do this after setup(), so the workers inherit any
+ * real-time scheduling.
+ */
+struct pool *start_pool(struct network *net, const struct synapses *syn,
+        const struct feedback_tap *taps, int n_taps, int n_threads)
+{
+    if (n_threads < 1 || n_threads > MAX_POOL_THREADS)
+        die("Invalid number of threads", NULL);
+    if (net->fixed || net->active)
+        die("The thread pool only runs the float CSR engine", NULL);
+
+    struct pool *pool = calloc(1, sizeof *pool);
+    if (pool) pool->workers = calloc(n_threads, sizeof *pool->workers);
+    if (!pool || !pool->workers) die("Couldn't allocate thread pool", NULL);
+    pool->net = net;
+    pool->synapses = syn;
+    pool->n_threads = n_threads;
+    pool->start.n_threads = pool->done.n_threads = n_threads;
+
+    /* Spinning only makes sense if everyone has a core to spin on. */
+    int spins = BARRIER_SPINS;
+    if (n_threads > sysconf(_SC_NPROCESSORS_ONLN)) spins = 0;
+    pool->start.spins = pool->done.spins = spins;
+    pool->i_in = alloc_cells(net);
+    for (int s = 0; s < 2; s++) pool->i_snap[s] = alloc_cells(net);
+    memcpy(pool->i_snap[0], net->i, net->n * sizeof(float));
+
+    /* Workers can't have the coefficients redone under them. */
+    prepare_dynamics(net);
+    telemetry_network(net);
+    spike_log_network(net);
+    control_network(net);
+
+    partition(pool);
+    for (int t = 0; t < n_threads; t++) {
+        struct worker *w = &pool->workers[t];
+        w->pool = pool;
+        w->taps = malloc((n_taps ? n_taps : 1) * sizeof *w->taps);
+        if (!w->taps) die("Couldn't allocate thread pool", NULL);
+        for (int k = 0; k < n_taps; k++)
+            if (taps[k].cell >= w->lo && taps[k].cell < w->hi)
+                w->taps[w->n_taps++] = taps[k];
+
+        if (t == 0) continue;
+        if (pthread_create(&w->thread, NULL, work, w))
+            die("Couldn't start worker thread", NULL);
+        pin_worker(w, t);
+    }
+    return pool;
+}
+
+
+/* One step of the whole network; returns how many cells fired. */
+int pool_step(struct pool *pool, const float *position, float feedback)
+{
+    pool->position = position;
+    pool->feedback = feedback;
+    if (g_spike_log) spike_log_step();
+    barrier_wait(&pool->start);
+    run_partition(&pool->workers[0]);
+    barrier_wait(&pool->done);
+    pool->step++;
+
+    int fired = 0;
+    for (int t = 0; t < pool->n_threads; t++)
+        fired += pool->workers[t].fired;
+    return fired;
+}
+
+
+void stop_pool(struct pool *pool)
+{
+    pool->stopping = true;
+    barrier_wait(&pool->start);
+    for (int t = 0; t < pool->n_threads; t++) {
+        if (t) pthread_join(pool->workers[t].thread, NULL);
+        free(pool->workers[t].taps);
+    }
+    free(pool->i_in);
+    free(pool->i_snap[0]);
+    free(pool->i_snap[1]);
+    free(pool->workers);
+    free(pool);
+}
@@ -0,0 +1,223 @@
+/*
+ *
+ * pipeline.c
+ *
+ * Splitting the loop into two stages (-A), so that time spent waiting
+ * on the PRU driver no longer adds to the time spent computing. An I/O
+ * thread owns the backend and keeps the loop's clock: on every tick it
+ * writes the newest activations the network has produced, samples the
+ * ADC and publishes the readings, then sleeps until the next tick. The
+ * controller's own loop becomes the compute stage, waiting in
+ * synchronize_loop() for each new set of readings and answering it
+ * through apply_actuator() and commit_actuators() as usual.
+ *
+ * The two exchange readings and activations through sequence locks,
+ * so neither ever blocks the other. The price is a delay of exactly
+ * one tick: activations computed from the readings of tick k go out at
+ * the start of tick k+1, whereas without the pipeline they go out at
+ * the end of tick k. If the network takes longer than a tick, the I/O
+ * keeps time regardless and the network skips to the newest readings,
+ * which are counted. Steps are numbered from the tick their readings
+ * came from, so logs and reversal times stay on the wall clock.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+
+#include "libneurobot.h"
+
+
+/* How many times to check for new readings before going to sleep. */
+#define PIPELINE_SPINS 20000
+
+bool g_pipelined = false;
+
+/* One tick's readings, and when they were taken. */
+struct readings {
+    long tick;
+    uint64_t sensed_ns;
+    float position[4];
+};
+
+/* The network's answer to the readings of one tick. */
+struct activations {
+    long tick;
+    uint64_t sensed_ns;
+    unsigned applied;
+    float activation[4];
+};
+
+static uint32_t g_readings_seq, g_activations_seq;
+static struct readings g_readings_shared;
+static struct activations g_activations_shared;
+static int g_sleepers;
+
+/* Each side's own copy. */
+static struct readings g_readings;
+static struct activations g_activations;
+static uint32_t g_readings_seen;
+static int g_spins;
+
+static long g_io_tick = 0, g_skipped = 0, g_busy = 0;
+static bool g_io_stopping = false, g_io_running = false;
+static pthread_t g_io_thread;
+
+
+/* The step the hardware is on, which the loop may be behind. */
+long io_step()
+{
+    if (!g_pipelined) return g_num_dts;
+    return __atomic_load_n(&g_io_tick, __ATOMIC_RELAXED) * g_io_steps;
+}
+
+
+static void publish_readings(long tick)
+{
+    struct readings r = { .tick = tick };
+    poll_adc();
+    r.sensed_ns = now_ns();
+    for (int i = 0; i < 4; i++) r.position[i] = sample_adc(i);
+
+    seqlock_write(&g_readings_seq, &g_readings_shared, &r, sizeof r);
+    if (__atomic_load_n(&g_sleepers, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &g_readings_seq, FUTEX_WAKE_PRIVATE, 1,
+                NULL, NULL, 0);
+}
+
+
+static void *io_loop(void *arg)
+{
+    (void)arg;
+    long answered = -1;
+    for (long tick = 0;; tick++) {
+        __atomic_store_n(&g_io_tick, tick, __ATOMIC_RELAXED);
+
+        /*
+         * The newest answer, if there's been one since last tick. If
+         * the network is in the middle of writing one, the I/O doesn't
+         * wait for it: the last activations go out again instead.
+         */
+        struct activations a;
+        uint32_t seq;
+        bool fresh = false;
+        if (seqlock_try_read(&g_activations_seq, &g_activations_shared,
+                    &a, sizeof a, &seq))
+            fresh = a.applied && a.tick > answered;
+        else
+            g_busy++;
+        if (fresh) {
+            for (int i = 0; i < 4; i++)
+                if (a.applied & (1u << i))
+                    stage_actuator(i, a.activation[i]);
+            answered = a.tick;
+        }
+        if (tick) write_actuators(fresh ? a.sensed_ns : 0);
+
+        if (__atomic_load_n(&g_io_stopping, __ATOMIC_ACQUIRE)) return NULL;
+        publish_readings(tick);
+        wait_for_deadline();
+    }
+}
+
+
+/*
+ * Wait for readings newer than the last ones the loop took, and take
+ * them. Returns the time they arrived.
+ */
+uint64_t pipelined_wait()
+{
+    uint32_t seq;
+    for (int spin = 0;
+            (seq = __atomic_load_n(&g_readings_seq, __ATOMIC_ACQUIRE))
+                == g_readings_seen || (seq & 1);
+            spin++) {
+        if (spin < g_spins) {
+            cpu_relax();
+            continue;
+        }
+        __atomic_add_fetch(&g_sleepers, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &g_readings_seq, FUTEX_WAIT_PRIVATE, seq,
+                NULL, NULL, 0);
+        __atomic_sub_fetch(&g_sleepers, 1, __ATOMIC_SEQ_CST);
+    }
+
+    long previous = g_readings.tick;
+    g_readings_seen = seqlock_read(&g_readings_seq, &g_readings_shared,
+            &g_readings, sizeof g_readings);
+    if (g_readings.tick > previous + 1)
+        g_skipped += g_readings.tick - previous - 1;
+    g_num_dts = g_readings.tick * g_io_steps;
+    return now_ns();
+}
+
+
+float pipelined_adc(int channel)
+{
+    return g_readings.position[channel];
+}
+
+
+void pipelined_actuator(size_t i, float activation)
+{
+    g_activations.activation[i] = activation;
+    g_activations.applied |= 1u << i;
+}
+
+
+void pipelined_commit()
+{
+    g_activations.tick = g_readings.tick;
+    g_activations.sensed_ns = g_readings.sensed_ns;
+    seqlock_write(&g_activations_seq, &g_activations_shared,
+            &g_activations, sizeof g_activations);
+}
+
+
+/*
+ * Start the I/O thread and wait for its first readings. This comes at
+ * the end of setup(), so it inherits any real-time scheduling; with -C
+ * it's pinned to the CPU after the loop's.
+ */
+void start_pipeline()
+{
+    if (g_replaying) die("A replay can't be pipelined", NULL);
+    if (max_tick_steps() > g_io_steps)
+        die("A pipelined loop can't catch up on overruns", NULL);
+
+    /* Spinning only makes sense if each stage has a core to itself. */
+    g_spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? PIPELINE_SPINS : 0;
+
+    if (pthread_create(&g_io_thread, NULL, io_loop, NULL))
+        die("Couldn't start I/O thread", NULL);
+    g_io_running = true;
+    if (g_rt_cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET((g_rt_cpu + 1) % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+        if (pthread_setaffinity_np(g_io_thread, sizeof cpus, &cpus))
+            die("Couldn't pin I/O thread", NULL);
+    }
+    pipelined_wait();
+}
+
+
+/* Let the I/O thread write the last activations and stop. */
+void stop_pipeline()
+{
+    if (!g_io_running) return;
+    __atomic_store_n(&g_io_stopping, true, __ATOMIC_RELEASE);
+    pthread_join(g_io_thread, NULL);
+    g_io_running = false;
+}
+
+
+void print_pipeline_stats()
+{
+    fprintf(stderr, " (Pipelined: %ld I/O ticks, %ld readings skipped"
+            " by the network, %ld answers caught mid-write.)\n",
+            io_step() / g_io_steps, g_skipped, g_busy);
+}
@@ -34,12 +34,8 @@ int main(int argc, char**argv)
 
     int opt;
     char *endptr;
-    while ((opt = getopt(argc, argv, "p:k:i:")) != -1) {
-        if (opt == 'p') {
-            set_pwm_max(strtod(optarg, &endptr));
-            if (endptr && *endptr != '\0')
-                die("Invalid PWM maximum", optarg);
-        } else if (opt == 'k') {
+    while ((opt = getopt(argc, argv, COMMON_OPTIONS "k:i:")) != -1) {
+        if (opt == 'k') {
             k_p = strtod(optarg, &endptr);
             if (endptr && *endptr != '\0') 
                 die("Invalid feedback constant", optarg);
@@ -47,7 +43,8 @@ int main(int argc, char**argv)
             k_i = strtod(optarg, &endptr);
             if (endptr && *endptr != '\0')
                 die("Invalid feedback constant", optarg);
-        } else die("Unrecognized argument", NULL);
+        } else if (!common_option(opt, optarg)) 
+            die("Unrecognized argument", NULL);
     }
 
     /* 
@@ -58,30 +55,41 @@ int main(int argc, char**argv)
     if (optind+1 == argc) 
         open_logfile(argv[optind]);
 
+    /* The control plane (-K) may retune these between ticks. */
+    control_bind(CONTROL_KP, &k_p);
+    control_bind(CONTROL_KI, &k_i);
+
     setup();
+    start_network(NULL, NULL);
     float actuator_position[4];
     float interr[4] = {0, 0, 0, 0};
 
-    datalogf("t,A0,A1,A2,A3,C0,C1,C2,C3\n");
+    datalogf("t,A0,A1,A2,A3,C0,C1,C2,C3");
+    start_log(8);
     while (!g_please_die_kthxbai) {
-        datalogf("%f", get_current_time());
+        float *row = log_row();
 
         for (int i = 0; i < 4; ++i) {
             actuator_position[i] = read_adc(i);
-            datalogf(", %f", actuator_position[i]);
+            row[i] = actuator_position[i];
         }
+        phase_done(PHASE_ADC);
 
         for (int i = 0; i < 4; ++i) {
             /* Pretty conservative linear PI control. */
             float err = actuator_position[i] - 0.5;
             float control = -k_p*err - k_i*interr[i];
             interr[i] = 0.999*interr[i] + 0.001*err;
-            datalogf(", %f", control);
+            row[4+i] = control;
 
             apply_actuator(i, control);
         }
+        commit_actuators();
+        phase_done(PHASE_ACTUATOR);
+
+        log_commit();
+        phase_done(PHASE_LOG);
 
-        datalogf("\n");
         synchronize_loop();
     }
 
@@ -0,0 +1,173 @@
+/*
+ *
+ * ringcheck.c
+ *
+ * Checks the consumer side of the streaming ADC ring (adcring.c)
+ * against a software stand-in for the PRU: a producer that writes
+ * known samples into a small ring, interleaved by channel, and moves
+ * the write index on the way the PRU does. Each check feeds some
+ * samples, polls, and compares the outputs with what they should be:
+ *
+ *  - the newest sample, with -F off;
+ *  - the mean of several samples per step, with -F on;
+ *  - a step with nothing new, which should change nothing;
+ *  - the write index wrapping around the end of the ring, in both
+ *    modes, including a step whose samples straddle the wrap;
+ *  - the producer lapping the ring between polls, which the index
+ *    can't show but the time since the last poll can;
+ *  - a sample only partly written, which should wait for the next poll.
+ *
+ *     ringcheck
+ *
+ * It prints each check and exits with an error if any fail; "make
+ * check" runs it.
+ *
+ */
+
+#include "libneurobot.h"
+
+/* A small ring, so that a few steps are enough to wrap it. */
+#define CHECK_SAMPLES 8
+#define CHECK_CHANNELS 4
+#define CHECK_RATE_HZ 1000
+
+/* The producer's ring, and the time as of its latest sample. */
+struct producer {
+    uint16_t values[CHECK_SAMPLES * CHECK_CHANNELS];
+    uint32_t write_index;
+    long n_written;
+    uint64_t now_ns;
+};
+
+static int g_failures = 0;
+
+
+/* The reading the producer gives channel c in its sample s. */
+static uint16_t sample_value(long s, int c)
+{
+    return (s * 37 + c * 1000) % 4096;
+}
+
+
+/* Write n whole samples, wrapping the index the way the PRU does. */
+static void produce(struct producer *p, int n)
+{
+    for (int k = 0; k < n; k++, p->n_written++) {
+        for (int c = 0; c < CHECK_CHANNELS; c++)
+            p->values[p->write_index + c] = sample_value(p->n_written, c);
+        p->write_index = (p->write_index + CHECK_CHANNELS)
+            % (CHECK_SAMPLES * CHECK_CHANNELS);
+        p->now_ns += NS_PER_SEC / CHECK_RATE_HZ;
+    }
+}
+
+
+/*
+ * Poll the ring and check it consumed n_samples and came out with the
+ * mean (or newest) of producer samples first up to first + n - 1.
+ */
+static void expect(const char *name, const struct producer *p,
+        struct adc_ring *ring, int n_samples, long first, int n)
+{
+    int consumed = adc_ring_poll(ring, p->now_ns);
+    bool ok = consumed == n_samples;
+    for (int c = 0; c < CHECK_CHANNELS; c++) {
+        float want = sample_value(first + n - 1, c);
+        if (ring->average) {
+            want = 0;
+            for (long s = first; s < first + n; s++)
+                want += sample_value(s, c);
+            want /= n;
+        }
+        want /= 1<<12;
+        if (fabsf(ring->value[c] - want) > 1e-6f) ok = false;
+    }
+    printf("%-40s %s\n", name, ok ? "ok" : "FAIL");
+    if (!ok) {
+        printf("  consumed %d of %d; got", consumed, n_samples);
+        for (int c = 0; c < CHECK_CHANNELS; c++)
+            printf(" %g", ring->value[c]);
+        printf("\n");
+        g_failures++;
+    }
+}
+
+
+static void check_mode(bool average)
+{
+    struct producer p = {.write_index = 0};
+    struct adc_ring ring;
+    const char *mode = average ? "mean" : "newest";
+    char name[64];
+
+    /* Start partway round, as a poll would pick up a running PRU. */
+    produce(&p, 3);
+    adc_ring_init(&ring, p.values, &p.write_index, CHECK_SAMPLES,
+            CHECK_CHANNELS, CHECK_RATE_HZ, average);
+
+    produce(&p, 1);
+    snprintf(name, sizeof name, "%s: one sample", mode);
+    expect(name, &p, &ring, 1, 3, 1);
+
+    produce(&p, 3);
+    snprintf(name, sizeof name, "%s: three samples", mode);
+    expect(name, &p, &ring, 3, 4, 3);
+
+    snprintf(name, sizeof name, "%s: nothing new", mode);
+    expect(name, &p, &ring, 0, 4, 3);
+
+    /* Samples 7 to 11 run from the last slot round to the fourth. */
+    produce(&p, 5);
+    snprintf(name, sizeof name, "%s: across the wrap", mode);
+    expect(name, &p, &ring, 5, 7, 5);
+
+    /* Round several more times, a step at a time. */
+    bool ok = true;
+    for (long s = 12; s < 12 + 5 * CHECK_SAMPLES; s += 2) {
+        produce(&p, 2);
+        if (adc_ring_poll(&ring, p.now_ns) != 2) ok = false;
+        for (int c = 0; c < CHECK_CHANNELS; c++) {
+            float want = average
+                ? (sample_value(s, c) + sample_value(s + 1, c)) / 2.f
+                : sample_value(s + 1, c);
+            if (fabsf(ring.value[c] - want / (1<<12)) > 1e-6f) ok = false;
+        }
+    }
+    snprintf(name, sizeof name, "%s: many times round", mode);
+    printf("%-40s %s\n", name, ok ? "ok" : "FAIL");
+    if (!ok) g_failures++;
+
+    /*
+     * Lapped: the index is only three samples on, but a ring and three
+     * samples' worth of time has passed, so all but the oldest sample
+     * in the ring are new.
+     */
+    produce(&p, CHECK_SAMPLES + 3);
+    snprintf(name, sizeof name, "%s: lapped", mode);
+    expect(name, &p, &ring, CHECK_SAMPLES - 1,
+            p.n_written - (CHECK_SAMPLES - 1), CHECK_SAMPLES - 1);
+    snprintf(name, sizeof name, "%s: lapped counts one overrun", mode);
+    printf("%-40s %s\n", name, ring.overruns == 1 ? "ok" : "FAIL");
+    if (ring.overruns != 1) g_failures++;
+
+    /*
+     * A sample with only two channels written yet: the index has moved
+     * but not past a whole sample, so it should be left for next time.
+     */
+    long s = p.n_written;
+    produce(&p, 1);
+    p.write_index = (p.write_index + 2) % (CHECK_SAMPLES * CHECK_CHANNELS);
+    snprintf(name, sizeof name, "%s: partial sample", mode);
+    expect(name, &p, &ring, 1, s, 1);
+}
+
+
+int main()
+{
+    check_mode(false);
+    check_mode(true);
+    if (g_failures) {
+        printf("FAIL: %d ADC ring checks\n", g_failures);
+        return 1;
+    }
+}
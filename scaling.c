@@ -0,0 +1,180 @@
+/*
+ *
+ * scaling.c
+ *
+ * Strong scaling of the thread pool (parallel.c) on a network file:
+ *
+ *     scaling [options] network.net
+ *
+ * It runs the same closed loop against the simulated actuators first on
+ * the serial CSR path and then on the pool with 1 up to -j threads (by
+ * default one per online CPU), and reports each one's best time per
+ * step, its speedup and parallel efficiency over the serial run, and the
+ * largest difference from the serial run's voltages at any step, which
+ * should be exactly zero. If the network has few enough blocks of cells,
+ * it also checks a pool with more threads than blocks, where the last
+ * threads get no cells at all. It fails if any run differs at all.
+ *
+ * For a network big enough to be worth splitting, body.py writes one
+ * with as many chained segments as wanted:
+ *
+ *     python3 body.py --segments 166 body.net && scaling body.net
+ *
+ */
+
+#include "libneurobot.h"
+
+#define DEFAULT_FEEDBACK 25
+#define DEFAULT_STEPS 2000
+#define DEFAULT_REPEATS 3
+
+
+static struct loaded_network g_ln;
+static float *g_state0, *g_i_in, *g_reference;
+
+
+/* The loaded state is one block, v through j. */
+static void reset_network()
+{
+    struct network *net = &g_ln.net;
+    memcpy(net->v, g_state0, 4 * PADDED(net->n) * sizeof(float));
+    if (net->fired_early)
+        memset(net->fired_early, 0, PADDED(net->n) * sizeof(int32_t));
+    net->v[0] = 0;
+}
+
+
+/* One run on n_threads threads, or serially if that's 0. */
+static uint64_t run(int n_threads, long n_steps, float feedback,
+        bool record, float *max_diff)
+{
+    struct network *net = &g_ln.net;
+    reset_network();
+    struct pool *pool = n_threads
+        ? start_pool(net, &g_ln.synapses, g_ln.feedback_taps,
+                g_ln.n_feedback, n_threads)
+        : NULL;
+
+    float position[4], signed_duty[4] = {0};
+    for (int a = 0; a < 4; a++) position[a] = SIM_START_POSITION;
+    float dt_s = dt_ms() / MS_PER_SEC;
+
+    *max_diff = 0;
+    uint64_t ns = 0;
+    for (long step = 0; step < n_steps; step++) {
+        uint64_t start_ns = now_ns();
+        if (pool) {
+            pool_step(pool, position, feedback);
+        } else {
+            check_spikes_all(net, NULL);
+            synaptic_currents(&g_ln.synapses, net, g_i_in);
+            feedback_currents(g_ln.feedback_taps, g_ln.n_feedback,
+                    position, feedback, g_i_in);
+            resolve_dynamics_all(net, g_i_in);
+        }
+        ns += now_ns() - start_ns;
+
+        for (int m = 0; m < g_ln.n_motors; m++) {
+            float a = motor_activation(net, &g_ln.motors[m]);
+            if (a > 1) a = 1;
+            if (a < -1) a = -1;
+            signed_duty[m] = a * g_pwm_max;
+        }
+        plant_advance(position, signed_duty, dt_s);
+
+        float *reference = &g_reference[step * net->n];
+        for (int c = 0; c < net->n; c++) {
+            if (record) reference[c] = net->v[c];
+            float diff = fabsf(net->v[c] - reference[c]);
+            if (diff > *max_diff) *max_diff = diff;
+        }
+    }
+
+    if (pool) stop_pool(pool);
+    return ns;
+}
+
+
+static uint64_t best_run(int n_threads, long n_steps, float feedback,
+        int n_repeats, bool record, float *max_diff)
+{
+    uint64_t best = UINT64_MAX;
+    *max_diff = 0;
+    for (int r = 0; r < n_repeats; r++) {
+        float diff;
+        uint64_t ns = run(n_threads, n_steps, feedback, record && !r, &diff);
+        if (ns < best) best = ns;
+        if (!r) *max_diff = diff;
+    }
+    return best;
+}
+
+
+int main(int argc, char **argv)
+{
+    float feedback = DEFAULT_FEEDBACK;
+    long n_steps = DEFAULT_STEPS;
+    int n_repeats = DEFAULT_REPEATS;
+    int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    char *endptr;
+    while ((opt = getopt(argc, argv, COMMON_OPTIONS "k:n:r:j:")) != -1) {
+        if (opt == 'k') {
+            feedback = strtod(optarg, &endptr);
+            if (*endptr != '\0') die("Invalid feedback constant", optarg);
+        } else if (opt == 'n') {
+            n_steps = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || n_steps < 1)
+                die("Invalid number of steps", optarg);
+        } else if (opt == 'r') {
+            n_repeats = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || n_repeats < 1)
+                die("Invalid number of repeats", optarg);
+        } else if (opt == 'j') {
+            max_threads = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || max_threads < 1)
+                die("Invalid number of threads", optarg);
+        } else if (!common_option(opt, optarg))
+            die("Unrecognized argument", NULL);
+    }
+    if (optind != argc - 1) die("Give one network file", NULL);
+
+    load_network(argv[optind], &g_ln);
+    struct network *net = &g_ln.net;
+    size_t padded = PADDED(net->n);
+    g_state0 = malloc(4 * padded * sizeof(float));
+    g_i_in = calloc(padded, sizeof(float));
+    g_reference = malloc(n_steps * net->n * sizeof(float));
+    if (!g_state0 || !g_i_in || !g_reference)
+        die("Couldn't allocate run state", NULL);
+    memcpy(g_state0, net->v, 4 * padded * sizeof(float));
+
+    printf("%s: %d cells, %d synapses, %ld steps of %gms, best of %d.\n",
+            argv[optind], net->n, g_ln.n_synapses, n_steps, dt_ms(),
+            n_repeats);
+    printf("%-8s %10s %9s %11s %12s\n", "threads", "ns/step", "speedup",
+            "efficiency", "max dV (mV)");
+
+    float diff;
+    bool differs = false;
+    uint64_t serial = best_run(0, n_steps, feedback, n_repeats, true, &diff);
+    printf("%-8s %10.1f\n", "serial", (double)serial / n_steps);
+    for (int t = 1; t <= max_threads; t++) {
+        uint64_t ns = best_run(t, n_steps, feedback, n_repeats, false, &diff);
+        printf("%-8d %10.1f %8.2fx %10.0f%% %12.3g\n", t,
+                (double)ns / n_steps, (double)serial / ns,
+                100. * serial / ns / t, diff);
+        differs |= diff != 0;
+    }
+
+    int n_blocks = padded / NETWORK_PAD;
+    if (n_blocks < MAX_POOL_THREADS && max_threads <= n_blocks) {
+        int t = n_blocks + 1;
+        run(t, n_steps, feedback, false, &diff);
+        printf("%-8d %10s %9s %11s %12.3g\n", t, "-", "-", "-", diff);
+        differs |= diff != 0;
+    }
+    unload_network(&g_ln);
+    if (differs) die("The pool doesn't match the serial run", NULL);
+}
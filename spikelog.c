@@ -0,0 +1,273 @@
+/*
+ *
+ * spikelog.c
+ *
+ * Logging spikes as address events (-E), for runs where the spike
+ * times are all that's wanted, alongside the usual log or instead of
+ * it. Whenever a cell fires, the spike check notes its number; at the
+ * end of the tick the loop turns the tick's spikes into 32-bit words
+ * (see struct spike_log_header) and hands them to a writer thread in
+ * chunks, like a trace. Every so many ticks the ADC readings and
+ * actuator activations go in too, so the gait can still be followed.
+ *
+ *     -E FILE[,every=N]
+ *
+ * A tick without spikes costs a couple of tests, and a step only a
+ * count. spikelog.py reads the file back into spike times, rasters and
+ * firing rates.
+ *
+ */
+
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "libneurobot.h"
+
+
+/* Words per chunk handed to the writer. */
+#define SPIKE_LOG_CHUNK_WORDS 8192
+
+/* Ticks between ADC and actuator samples unless given. */
+#define SPIKE_LOG_DEFAULT_EVERY 20
+
+bool g_spike_log = false;
+
+static FILE *g_file;
+static char *g_path;
+static int g_every = SPIKE_LOG_DEFAULT_EVERY;
+static bool g_started = false;
+
+/*
+ * This tick's spikes, each the cell number with the network step
+ * within the tick in the top byte. Workers of a pool add to it at once,
+ * in whatever order they get there.
+ */
+static uint32_t *g_spikes = NULL;
+static int g_max_spikes = 0, g_n_spikes = 0, g_substep = 0;
+static int g_n_cells = 0;
+
+/* The latest readings and activations. */
+static float g_adc[4], g_act[4];
+
+/* The step of the last word written, and counts for the report. */
+static long g_last_step = 0;
+static long g_total_spikes = 0, g_samples = 0, g_lost = 0, g_shed = 0;
+
+/* Two chunks, one filling while the writer drains the other. */
+static uint32_t g_chunks[2][SPIKE_LOG_CHUNK_WORDS];
+static int g_chunk, g_chunk_words, g_ready_words;
+static sem_t g_chunk_free, g_chunk_ready;
+static pthread_t g_thread;
+
+
+void open_spike_log(const char *spec)
+{
+    g_path = strdup(spec);
+    if (!g_path) die("Couldn't allocate spike log", NULL);
+    char *opt = strchr(g_path, ',');
+    if (opt) {
+        *opt++ = '\0';
+        char *end;
+        if (strncmp(opt, "every=", 6)) die("Invalid spike log option", opt);
+        g_every = strtol(opt + 6, &end, 10);
+        if (*end || g_every < 1) die("Invalid spike log sampling", opt);
+    }
+
+    g_file = fopen(g_path, "wb");
+    if (!g_file) die("Couldn't open spike log", g_path);
+    g_spike_log = true;
+}
+
+
+static void *spike_log_writer(void *arg)
+{
+    (void)arg;
+    demote_thread();
+
+    for (int chunk = 0;; chunk = !chunk) {
+        sem_wait(&g_chunk_ready);
+        int n = g_ready_words;
+        if (n && fwrite(g_chunks[chunk], sizeof **g_chunks, n, g_file)
+                != (size_t)n)
+            perror("Couldn't write spike log");
+        sem_post(&g_chunk_free);
+        if (n < SPIKE_LOG_CHUNK_WORDS) return NULL;
+    }
+}
+
+
+/* Hand the filling chunk to the writer; a short one is the last. */
+static void hand_off_chunk()
+{
+    sem_wait(&g_chunk_free);
+    g_ready_words = g_chunk_words;
+    sem_post(&g_chunk_ready);
+    g_chunk = !g_chunk;
+    g_chunk_words = 0;
+}
+
+
+static void put_word(uint32_t type, uint32_t payload)
+{
+    g_chunks[g_chunk][g_chunk_words++] = type << 24 | payload;
+    if (g_chunk_words == SPIKE_LOG_CHUNK_WORDS) hand_off_chunk();
+}
+
+
+/* Bring the log's step up to the given one. */
+static void put_step(long step)
+{
+    for (long delta; (delta = step - g_last_step) > 0; ) {
+        if (delta > SPIKE_LOG_MAX_PAYLOAD) delta = SPIKE_LOG_MAX_PAYLOAD;
+        put_word(SPIKE_LOG_STEP, delta);
+        g_last_step += delta;
+    }
+}
+
+
+/*
+ * Size the spike buffer for the given network, or none, and start the
+ * writer. Controllers get here through start_network() or start_pool(),
+ * before the loop; until then the loop logs nothing.
+ */
+void spike_log_network(const struct network *net)
+{
+    if (!g_spike_log || g_started) return;
+    g_n_cells = net ? net->n : 0;
+    if (g_n_cells > SPIKE_LOG_MAX_PAYLOAD)
+        die("Too many cells for the spike log", NULL);
+
+    /* A cell can fire at most once per network step. */
+    if (max_tick_steps() > 256)
+        die("Too many steps per tick for the spike log", NULL);
+    g_max_spikes = g_n_cells * max_tick_steps();
+    g_spikes = malloc((g_max_spikes ? g_max_spikes : 1) * sizeof *g_spikes);
+    if (!g_spikes) die("Couldn't allocate spike log", NULL);
+
+    struct spike_log_header header = {
+        .magic = SPIKE_LOG_MAGIC, .version = SPIKE_LOG_VERSION,
+        .dt_us = g_dt_us, .io_steps = g_io_steps,
+        .n_cells = g_n_cells, .sample_every = g_every
+    };
+    if (fwrite(&header, sizeof header, 1, g_file) != 1)
+        die("Couldn't write spike log", g_path);
+
+    sem_init(&g_chunk_free, 0, 1);
+    sem_init(&g_chunk_ready, 0, 0);
+    if (pthread_create(&g_thread, NULL, spike_log_writer, NULL))
+        die("Couldn't start spike log writer", NULL);
+    g_started = true;
+}
+
+
+/* The start of a network step, from whichever thread runs the spikes. */
+void spike_log_step()
+{
+    g_substep++;
+}
+
+
+/* A cell fired on this network step. */
+void log_spike(int cell)
+{
+    int k = __atomic_fetch_add(&g_n_spikes, 1, __ATOMIC_RELAXED);
+    if (k < g_max_spikes)
+        g_spikes[k] = (uint32_t)(g_substep - 1) << 24 | cell;
+}
+
+
+void spike_log_adc(int channel, float value)
+{
+    if (channel < 4) g_adc[channel] = value;
+}
+
+
+void spike_log_actuator(size_t i, float activation)
+{
+    if (i < 4) g_act[i] = activation > 1 ? 1 : activation < -1 ? -1
+        : activation;
+}
+
+
+/* Write out a sample of the readings and activations at this step. */
+static void put_sample()
+{
+    put_step(g_num_dts);
+    for (int c = 0; c < 4; c++) {
+        float scaled = g_adc[c] * 65536.f + 0.5f;
+        uint32_t stored = scaled < 0 ? 0 : scaled > 0xffff ? 0xffff : scaled;
+        put_word(SPIKE_LOG_ADC, c << 16 | stored);
+    }
+    for (int c = 0; c < 4; c++) {
+        int16_t stored = lrintf(g_act[c] * INT16_MAX);
+        put_word(SPIKE_LOG_ACT, c << 16 | (uint16_t)stored);
+    }
+    g_samples++;
+}
+
+
+/*
+ * Put the tick's spikes in order of step, then cell, as a serial run
+ * checks them. They come that way already but for a pool's workers
+ * racing each other within a step, so an insertion sort does, and
+ * needs no memory from the loop.
+ */
+static void sort_spikes(int n)
+{
+    for (int k = 1; k < n; k++) {
+        uint32_t spike = g_spikes[k];
+        int l = k;
+        for (; l > 0 && g_spikes[l-1] > spike; l--)
+            g_spikes[l] = g_spikes[l-1];
+        g_spikes[l] = spike;
+    }
+}
+
+
+/*
+ * The end of a tick's work: write out a sample if one is due, then the
+ * tick's spikes, sorted so that the log is the same whatever the number
+ * of threads. While shedding after an overrun (-V shed), the tick goes
+ * unlogged.
+ */
+void spike_log_tick()
+{
+    if (!g_started) return;
+    if (g_shedding) {
+        g_shed += g_n_spikes;
+        g_n_spikes = 0;
+    }
+    if (!g_shedding && g_num_dts / g_io_steps % g_every == 0) put_sample();
+    if (g_n_spikes) {
+        int n = g_n_spikes;
+        if (n > g_max_spikes) {
+            g_lost += n - g_max_spikes;
+            n = g_max_spikes;
+        }
+        sort_spikes(n);
+        for (int k = 0; k < n; k++) {
+            put_step(g_num_dts + (g_spikes[k] >> 24));
+            put_word(SPIKE_LOG_SPIKE, g_spikes[k] & SPIKE_LOG_MAX_PAYLOAD);
+        }
+        g_total_spikes += n;
+        g_n_spikes = 0;
+    }
+    g_substep = 0;
+}
+
+
+void close_spike_log()
+{
+    if (!g_spike_log) return;
+    if (g_started) {
+        hand_off_chunk();
+        pthread_join(g_thread, NULL);
+    }
+    fclose(g_file);
+    fprintf(stderr, "Spike log: %ld spikes, %ld samples", g_total_spikes,
+            g_samples);
+    if (g_lost) fprintf(stderr, ", %ld spikes lost", g_lost);
+    if (g_shed) fprintf(stderr, ", %ld spikes shed", g_shed);
+    fprintf(stderr, ".\n");
+    g_spike_log = false;
+}
@@ -0,0 +1,125 @@
+"""
+Reading spike logs written by the controllers with -E (see spikelog.c
+and struct spike_log_header) back into spike times, rasters and firing
+rates:
+
+    from spikelog import SpikeLog
+    log = SpikeLog('run.aer')
+    log.t, log.cells          # one entry per spike, t in ms
+    log.sample_t, log.adc, log.act
+    t, counts = log.raster(bin_ms=1)
+    t, hz = log.rates(window_ms=100)
+
+    python3 spikelog.py run.aer [--spikes | --rates MS | --raster OUT]
+
+With no option it prints each cell's spike count and mean rate.
+"""
+import argparse
+import struct
+import sys
+
+import numpy as np
+
+SPIKE_LOG_MAGIC = 0x4541424e
+SPIKE_LOG_VERSION = 1
+HEADER = struct.Struct('<6I')
+SPIKE, STEP, ADC, ACT = range(4)
+
+
+class SpikeLog:
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            (magic, version, self.dt_us, self.io_steps, self.n_cells,
+                    self.sample_every) = HEADER.unpack(f.read(HEADER.size))
+            if magic != SPIKE_LOG_MAGIC:
+                raise ValueError(f'{path} is not a spike log')
+            if version != SPIKE_LOG_VERSION:
+                raise ValueError(f'{path} has unsupported version {version}')
+            words = np.fromfile(f, '<u4')
+
+        self.dt_ms = self.dt_us / 1000
+        kind = words >> 24
+        payload = (words & 0xffffff).astype(np.int64)
+        step = np.cumsum(np.where(kind == STEP, payload, 0))
+        self.duration_ms = (step[-1] + 1 if len(step) else 0) * self.dt_ms
+
+        spikes = kind == SPIKE
+        self.steps = step[spikes]
+        self.t = self.steps * self.dt_ms
+        self.cells = payload[spikes]
+
+        # Samples are four words of each kind at the same step.
+        adc, act = kind == ADC, kind == ACT
+        n = min(adc.sum(), act.sum()) // 4
+        self.sample_t = step[adc][::4][:n] * self.dt_ms
+        self.adc = (payload[adc][:4*n] & 0xffff).reshape(n, 4) / 65536
+        self.act = ((payload[act][:4*n] & 0xffff).astype(np.uint16)
+                .view(np.int16).reshape(n, 4) / 32767)
+
+    def raster(self, bin_ms=None):
+        """
+        Bin start times and a cells by bins array of spike counts, in
+        bins of one network step unless given.
+        """
+        bin_steps = max(1, round((bin_ms or self.dt_ms) / self.dt_ms))
+        n_bins = int(np.ceil(self.duration_ms / self.dt_ms / bin_steps))
+        counts = np.zeros((self.n_cells, max(n_bins, 1)), np.int32)
+        np.add.at(counts, (self.cells, self.steps // bin_steps), 1)
+        return np.arange(counts.shape[1]) * bin_steps * self.dt_ms, counts
+
+    def rates(self, window_ms=100):
+        """Window start times and each cell's firing rate in Hz."""
+        t, counts = self.raster(window_ms)
+        return t, counts * (1000 / window_ms)
+
+    def counts(self):
+        return np.bincount(self.cells, minlength=self.n_cells)
+
+
+def plot_raster(log, path):
+    import matplotlib
+    matplotlib.use('Agg')
+    import matplotlib.pyplot as plt
+
+    fig, (top, bottom) = plt.subplots(2, sharex=True, figsize=(10, 6),
+            gridspec_kw={'height_ratios': [3, 1]})
+    top.scatter(log.t, log.cells, s=2, marker='|')
+    top.set_ylabel('cell')
+    for c in range(4):
+        bottom.plot(log.sample_t, log.adc[:, c], label=f'A{c}')
+    bottom.set_xlabel('t (ms)')
+    bottom.legend(loc='upper right')
+    fig.savefig(path)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(
+            description='Read a spike log written with -E.')
+    parser.add_argument('log', help='spike log written by a controller')
+    group = parser.add_mutually_exclusive_group()
+    group.add_argument('--spikes', action='store_true',
+            help='write every spike as CSV')
+    group.add_argument('--rates', type=float, metavar='MS',
+            help='write firing rates in windows of MS as CSV')
+    group.add_argument('--raster', metavar='OUT',
+            help='plot the raster and the ADC samples to this file')
+    args = parser.parse_args()
+
+    log = SpikeLog(args.log)
+    out = sys.stdout
+    if args.spikes:
+        out.write('t,cell\n')
+        for t, c in zip(log.t, log.cells):
+            out.write(f'{t:f}, {c}\n')
+    elif args.rates:
+        t, hz = log.rates(args.rates)
+        out.write('t,' + ','.join(f'V{c}' for c in range(log.n_cells)) + '\n')
+        np.savetxt(out, np.column_stack((t, hz.T)), fmt='%g', delimiter=', ')
+    elif args.raster:
+        plot_raster(log, args.raster)
+    else:
+        seconds = log.duration_ms / 1000
+        print(f'{len(log.t)} spikes from {log.n_cells} cells in '
+                f'{seconds:.3f}s, {len(log.sample_t)} samples.')
+        for c, n in enumerate(log.counts()):
+            print(f'V{c}: {n} spikes, {n / seconds if seconds else 0:.2f} Hz')
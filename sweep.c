@@ -0,0 +1,499 @@
+/*
+ *
+ * sweep.c
+ *
+ * Parameter sweeps over a CPG without the robot. Each parameter set
+ * scales the network's conductances and feedback constant, gets its
+ * own copy of the network hooked up to the simulated actuators from
+ * backend_sim.c, and runs as fast as the CPU allows; what comes out is
+ * one CSV line per set with the gait it produced. The network comes
+ * from the same generated header as the controller, selected at build
+ * time with -DNETWORK, so "make sweep_forwards" sweeps forwards.py.
+ *
+ * Sets are spread over a pool of worker threads. Each worker starts
+ * with an even share of the sets and works through them in order; one
+ * that runs out steals half of what's left from someone else, so a few
+ * slow sets (long transients, chaotic gaits) can't hold the rest up.
+ *
+ */
+
+#include <pthread.h>
+
+#include "libneurobot.h"
+
+#include NETWORK
+
+/* The strength of position feedback in pA, as in the controllers. */
+#define DEFAULT_FEEDBACK 25
+
+/* How long to simulate each set for, and how much of that to ignore. */
+#define DEFAULT_DURATION_S 20
+#define DEFAULT_TRANSIENT_S 5
+
+/*
+ * An actuator counts as switching on once its activation rises past
+ * this, and off once it falls back below minus this, so that muscle
+ * cells idling near each other don't register as a burst of edges.
+ */
+#define EDGE_HYSTERESIS 0.5f
+
+/* Edges kept per actuator for the phase lag estimate. */
+#define MAX_EDGES 1024
+
+#define MAX_WORKERS 256
+
+/* The generated conductance parameters, then the feedback constant. */
+#define N_PARAMS (N_SWEEP_PARAMS + 1)
+#define FEEDBACK_PARAM N_SWEEP_PARAMS
+
+
+/*
+ * The gait one set produced. The period is the mean time between
+ * actuator 0 switching on; each actuator's lag is where in that cycle
+ * it switches on, as a fraction of the period; its duty cycle is the
+ * fraction of the time it's pushing in the positive direction.
+ */
+struct gait {
+    float period_ms;
+    float lag[N_MOTORS];
+    float duty[N_MOTORS];
+    float spike_hz;
+};
+
+struct job {
+    float param[N_PARAMS];
+    struct gait gait;
+};
+
+/* One copy of the network's mutable state. */
+struct sim {
+    SIMD_ALIGN float v[N_PADDED], u[N_PADDED], i[N_PADDED], j[N_PADDED];
+    SIMD_ALIGN float i_in[N_PADDED];
+    SIMD_ALIGN int32_t fired_early[N_PADDED];
+    struct synapse syn[N_SYNAPSES];
+    struct network net;
+    struct synapses synapses;
+    float edges[N_MOTORS][MAX_EDGES];
+};
+
+/*
+ * Each worker's share of the jobs is the range [lo, hi), packed into
+ * one word as lo<<32 | hi so that taking from the bottom and stealing
+ * from the top are both a single compare-and-swap. The range gets its
+ * own cache line since other workers poll it.
+ */
+struct worker {
+    uint64_t range __attribute__((aligned(64)));
+    pthread_t thread;
+    int id;
+    struct sim sim __attribute__((aligned(64)));
+};
+
+static struct job *g_jobs = NULL;
+static int g_n_jobs = 0;
+static struct worker *g_workers = NULL;
+static int g_n_workers = 0;
+
+static float g_duration_s = DEFAULT_DURATION_S;
+static float g_transient_s = DEFAULT_TRANSIENT_S;
+
+
+static uint64_t pack_range(uint32_t lo, uint32_t hi)
+{
+    return (uint64_t)lo << 32 | hi;
+}
+
+
+/* Take the next job from the bottom of our own range. */
+static bool take_job(struct worker *w, int *job)
+{
+    uint64_t range = __atomic_load_n(&w->range, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint32_t lo = range >> 32, hi = (uint32_t)range;
+        if (lo >= hi) return false;
+        if (__atomic_compare_exchange_n(&w->range, &range,
+                    pack_range(lo+1, hi), false,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *job = lo;
+            return true;
+        }
+    }
+}
+
+
+/*
+ * Take the top half of a victim's range (all of it if there's only
+ * one left) and make it ours. Our own range is empty when we get here
+ * and nobody else touches an empty range, so a plain store will do.
+ */
+static bool steal_jobs(struct worker *thief, struct worker *victim)
+{
+    uint64_t range = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint32_t lo = range >> 32, hi = (uint32_t)range;
+        if (lo >= hi) return false;
+        uint32_t mid = lo + (hi - lo)/2;
+        if (__atomic_compare_exchange_n(&victim->range, &range,
+                    pack_range(lo, mid), false,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&thief->range, pack_range(mid, hi),
+                    __ATOMIC_RELEASE);
+            return true;
+        }
+    }
+}
+
+
+/* Mean angle of a set of phases in [0,1), as a phase in [0,1). */
+static float circular_mean(const float *phase, int n)
+{
+    if (n == 0) return NAN;
+    double s = 0, c = 0;
+    for (int k = 0; k < n; k++) {
+        s += sin(2*M_PI*phase[k]);
+        c += cos(2*M_PI*phase[k]);
+    }
+    double mean = atan2(s, c) / (2*M_PI);
+    return mean < 0 ? mean + 1 : mean;
+}
+
+
+/*
+ * Run one parameter set from the controllers' initial conditions: the
+ * same update order as forwards.c, with the simulated plant standing
+ * in for the ADC and the motors.
+ */
+static void simulate(struct sim *sim, struct job *job)
+{
+    memcpy(sim->v, cell_v, sizeof sim->v);
+    memcpy(sim->u, cell_u, sizeof sim->u);
+    memcpy(sim->i, cell_i, sizeof sim->i);
+    memcpy(sim->j, cell_j, sizeof sim->j);
+    memset(sim->i_in, 0, sizeof sim->i_in);
+    memset(sim->fired_early, 0, sizeof sim->fired_early);
+
+    sim->net = network;
+    sim->net.v = sim->v;
+    sim->net.u = sim->u;
+    sim->net.i = sim->i;
+    sim->net.j = sim->j;
+    sim->net.fired_early = sim->fired_early;
+    sim->net.v[0] = 0;
+
+    for (int k = 0; k < N_SYNAPSES; k++) {
+        sim->syn[k] = synapse_list[k];
+        sim->syn[k].g = 0;
+        for (int p = 0; p < N_SWEEP_PARAMS; p++)
+            sim->syn[k].g += sweep_basis[k][p] * job->param[p];
+    }
+    sim->synapses.row = synapse_rows;
+    sim->synapses.syn = sim->syn;
+
+    float position[4], signed_duty[4] = {0};
+    for (int a = 0; a < 4; a++) position[a] = SIM_START_POSITION;
+
+    float feedback = job->param[FEEDBACK_PARAM];
+    float dt = dt_ms();
+    long n_steps = g_duration_s * MS_PER_SEC / dt;
+    long n_transient = g_transient_s * MS_PER_SEC / dt;
+
+    bool on[N_MOTORS] = {false};
+    int n_edges[N_MOTORS] = {0};
+    long n_positive[N_MOTORS] = {0};
+    long n_spikes = 0;
+
+    for (long step = 0; step < n_steps; step++) {
+        int spikes = check_spikes_all(&sim->net, NULL);
+        synaptic_currents(&sim->synapses, &sim->net, sim->i_in);
+        feedback_currents(feedback_taps, N_FEEDBACK, position, feedback,
+                sim->i_in);
+        resolve_dynamics_all(&sim->net, sim->i_in);
+
+        for (int m = 0; m < N_MOTORS; m++) {
+            float activation = motor_activation(&sim->net, &motors[m]);
+            if (activation > 1) activation = 1;
+            if (activation < -1) activation = -1;
+            if (m < 4) signed_duty[m] = activation * g_pwm_max;
+
+            if (step < n_transient) {
+                on[m] = activation > 0;
+                continue;
+            }
+
+            if (activation > 0) n_positive[m]++;
+            if (!on[m] && activation > EDGE_HYSTERESIS) {
+                on[m] = true;
+                if (n_edges[m] < MAX_EDGES)
+                    sim->edges[m][n_edges[m]++] = step * dt;
+            } else if (on[m] && activation < -EDGE_HYSTERESIS) {
+                on[m] = false;
+            }
+        }
+        plant_advance(position, signed_duty, dt / MS_PER_SEC);
+
+        if (step >= n_transient) n_spikes += spikes;
+    }
+
+    struct gait *gait = &job->gait;
+    long n_measured = n_steps - n_transient;
+    float measured_s = n_measured * dt / MS_PER_SEC;
+    gait->spike_hz = n_measured ? n_spikes / (N_CELLS * measured_s) : 0;
+
+    int n0 = n_edges[0];
+    const float *ref = sim->edges[0];
+    gait->period_ms = n0 >= 2 ? (ref[n0-1] - ref[0]) / (n0 - 1) : NAN;
+
+    for (int m = 0; m < N_MOTORS; m++) {
+        gait->duty[m] = n_measured ? (float)n_positive[m] / n_measured : 0;
+
+        /* Phases overwrite the edge times in place. */
+        float *edges = sim->edges[m];
+        if (isnan(gait->period_ms)) {
+            gait->lag[m] = NAN;
+            continue;
+        }
+        for (int k = 0; k < n_edges[m]; k++) {
+            float phase = (edges[k] - ref[0]) / gait->period_ms;
+            edges[k] = phase - floorf(phase);
+        }
+        gait->lag[m] = circular_mean(edges, n_edges[m]);
+    }
+}
+
+
+static void *sweep_worker(void *arg)
+{
+    struct worker *w = arg;
+    for (;;) {
+        int job;
+        while (take_job(w, &job))
+            simulate(&w->sim, &g_jobs[job]);
+
+        /* Out of work: look for someone to steal from, nearest first. */
+        bool stole = false;
+        for (int k = 1; k < g_n_workers && !stole; k++)
+            stole = steal_jobs(w, &g_workers[(w->id + k) % g_n_workers]);
+        if (!stole) return NULL;
+    }
+}
+
+
+static void run_jobs(int n_workers)
+{
+    if (n_workers > g_n_jobs) n_workers = g_n_jobs;
+    if (n_workers < 1) n_workers = 1;
+    g_n_workers = n_workers;
+
+    if (posix_memalign((void **)&g_workers, 64,
+                n_workers * sizeof *g_workers))
+        die("Couldn't allocate workers", NULL);
+
+    for (int w = 0; w < n_workers; w++) {
+        g_workers[w].id = w;
+        g_workers[w].range = pack_range(
+                (uint64_t)g_n_jobs * w / n_workers,
+                (uint64_t)g_n_jobs * (w+1) / n_workers);
+    }
+
+    /* The first worker is this thread. */
+    for (int w = 1; w < n_workers; w++)
+        if (pthread_create(&g_workers[w].thread, NULL, sweep_worker,
+                    &g_workers[w]))
+            die("Couldn't start worker thread", NULL);
+    sweep_worker(&g_workers[0]);
+    for (int w = 1; w < n_workers; w++)
+        pthread_join(g_workers[w].thread, NULL);
+
+    free(g_workers);
+}
+
+
+static int param_index(const char *name)
+{
+    for (int p = 0; p < N_SWEEP_PARAMS; p++)
+        if (!strcmp(name, sweep_param_names[p])) return p;
+    if (!strcmp(name, "k")) return FEEDBACK_PARAM;
+    die("No such parameter", name);
+    return -1;
+}
+
+
+static void add_job(const float *param)
+{
+    if (g_n_jobs % 1024 == 0) {
+        g_jobs = realloc(g_jobs, (g_n_jobs + 1024) * sizeof *g_jobs);
+        if (!g_jobs) die("Couldn't allocate parameter sets", NULL);
+    }
+    memcpy(g_jobs[g_n_jobs].param, param, sizeof g_jobs->param);
+    g_n_jobs++;
+}
+
+
+/*
+ * One axis of the grid, given as name=value or name=lo:hi:step, with
+ * hi included if the steps land on it.
+ */
+struct axis {
+    int param, n;
+    float lo, step;
+};
+
+static void parse_axis(char *arg, struct axis *axis)
+{
+    char *eq = strchr(arg, '=');
+    if (!eq) die("Grid axis should look like name=lo:hi:step", arg);
+    *eq = '\0';
+    axis->param = param_index(arg);
+
+    char *p = eq+1, *endptr;
+    float lo = strtod(p, &endptr), hi = lo, step = 1;
+    if (*endptr == ':') {
+        hi = strtod(endptr+1, &endptr);
+        if (*endptr != ':') die("Grid axis should look like name=lo:hi:step", p);
+        step = strtod(endptr+1, &endptr);
+    }
+    if (*endptr != '\0' || step <= 0 || hi < lo)
+        die("Invalid grid axis", p);
+
+    axis->lo = lo;
+    axis->step = step;
+    axis->n = (hi - lo)/step * (1 + 1e-6f) + 1;
+}
+
+
+/* Every combination of the axes, the first one varying slowest. */
+static void add_grid(const struct axis *axes, int n_axes,
+        const float *defaults)
+{
+    float param[N_PARAMS];
+    memcpy(param, defaults, sizeof param);
+
+    int index[N_PARAMS] = {0};
+    for (;;) {
+        for (int a = 0; a < n_axes; a++)
+            param[axes[a].param] = axes[a].lo + index[a]*axes[a].step;
+        add_job(param);
+
+        int a = n_axes - 1;
+        while (a >= 0 && ++index[a] == axes[a].n) index[a--] = 0;
+        if (a < 0) return;
+    }
+}
+
+
+/*
+ * A CSV file of parameter sets: a header line naming some of the
+ * parameters, then one set per line. Anything not named keeps its
+ * default.
+ */
+static void add_list(const char *path, const float *defaults)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) die("Couldn't open parameter list", path);
+
+    char line[1024];
+    int columns[N_PARAMS], n_columns = 0;
+    if (!fgets(line, sizeof line, f)) die("Empty parameter list", path);
+    for (char *tok = strtok(line, ", \t\r\n"); tok;
+            tok = strtok(NULL, ", \t\r\n")) {
+        if (n_columns == N_PARAMS) die("Too many columns", path);
+        columns[n_columns++] = param_index(tok);
+    }
+
+    while (fgets(line, sizeof line, f)) {
+        float param[N_PARAMS];
+        memcpy(param, defaults, sizeof param);
+
+        int c = 0;
+        for (char *tok = strtok(line, ", \t\r\n"); tok;
+                tok = strtok(NULL, ", \t\r\n")) {
+            if (c == n_columns) die("Too many values on a line", path);
+            char *endptr;
+            param[columns[c++]] = strtod(tok, &endptr);
+            if (*endptr != '\0') die("Invalid parameter value", tok);
+        }
+        if (c == 0) continue;
+        if (c != n_columns) die("Too few values on a line", path);
+        add_job(param);
+    }
+    fclose(f);
+}
+
+
+static void print_results()
+{
+    for (int p = 0; p < N_SWEEP_PARAMS; p++)
+        printf("%s,", sweep_param_names[p]);
+    printf("k,period_ms");
+    for (int m = 1; m < N_MOTORS; m++) printf(",lag%d", m);
+    for (int m = 0; m < N_MOTORS; m++) printf(",duty%d", m);
+    printf(",spike_hz\n");
+
+    for (int k = 0; k < g_n_jobs; k++) {
+        const struct job *job = &g_jobs[k];
+        for (int p = 0; p < N_PARAMS; p++) printf("%g,", job->param[p]);
+        printf("%g", job->gait.period_ms);
+        for (int m = 1; m < N_MOTORS; m++) printf(",%.4f", job->gait.lag[m]);
+        for (int m = 0; m < N_MOTORS; m++) printf(",%.4f", job->gait.duty[m]);
+        printf(",%g\n", job->gait.spike_hz);
+    }
+}
+
+
+int main(int argc, char **argv)
+{
+    float defaults[N_PARAMS];
+    memcpy(defaults, sweep_param_defaults, sizeof sweep_param_defaults);
+    defaults[FEEDBACK_PARAM] = DEFAULT_FEEDBACK;
+
+    struct axis axes[N_PARAMS];
+    int n_axes = 0;
+    const char *list = NULL;
+    int n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    char *endptr;
+    while ((opt = getopt(argc, argv, COMMON_OPTIONS "g:f:t:w:j:")) != -1) {
+        if (opt == 'g') {
+            if (n_axes == N_PARAMS) die("Too many grid axes", optarg);
+            parse_axis(optarg, &axes[n_axes++]);
+        } else if (opt == 'f') {
+            list = optarg;
+        } else if (opt == 't') {
+            g_duration_s = strtod(optarg, &endptr);
+            if (*endptr != '\0' || g_duration_s <= 0)
+                die("Invalid duration", optarg);
+        } else if (opt == 'w') {
+            g_transient_s = strtod(optarg, &endptr);
+            if (*endptr != '\0' || g_transient_s < 0)
+                die("Invalid transient", optarg);
+        } else if (opt == 'j') {
+            n_workers = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || n_workers < 1 || n_workers > MAX_WORKERS)
+                die("Invalid number of threads", optarg);
+        } else if (!common_option(opt, optarg))
+            die("Unrecognized argument", NULL);
+    }
+    if (optind != argc) die("Too many arguments!", NULL);
+    if (list && n_axes) die("Give either a grid or a list, not both", NULL);
+    if (g_transient_s >= g_duration_s)
+        die("Transient must be shorter than the run", NULL);
+    if (n_workers > MAX_WORKERS) n_workers = MAX_WORKERS;
+
+    if (list) add_list(list, defaults);
+    else add_grid(axes, n_axes, defaults);
+    if (g_n_jobs == 0) die("No parameter sets", NULL);
+
+    /* Every copy of the network shares the one set of coefficients. */
+    prepare_dynamics(&network);
+
+    uint64_t start_ns = now_ns();
+    run_jobs(n_workers);
+    float elapsed_s = (float)(now_ns() - start_ns) / NS_PER_SEC;
+
+    print_results();
+    fprintf(stderr, "Simulated %d sets of %gs in %.2fs on %d threads.\n",
+            g_n_jobs, g_duration_s, elapsed_s,
+            n_workers < g_n_jobs ? n_workers : g_n_jobs);
+    free(g_jobs);
+}
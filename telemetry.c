@@ -0,0 +1,314 @@
+/*
+ *
+ * telemetry.c
+ *
+ * Live telemetry for watching a run without logging it to a terminal
+ * (see struct telemetry_header): with -Y, every so many I/O ticks the
+ * loop sends one datagram holding that tick's chosen values to a local
+ * socket, and telemetry.py on the other end turns them into CSV or a
+ * live plot. The socket is non-blocking, so if nobody's reading, or
+ * not fast enough, frames are dropped and counted rather than holding
+ * up the loop; there's no other I/O in it. The count is of what the
+ * kernel reports: a full socket buffer, a Unix socket with nobody
+ * bound to it, or a UDP port refused, which comes back by ICMP a
+ * datagram late and may be rate-limited, so it can fall short there.
+ *
+ *     -Y DEST[,every=N][,adc][,act][,time][,v[=CELLS]]
+ *
+ * DEST is a UDP port on localhost or the path of a Unix datagram
+ * socket. The groups are the ADC readings, the actuator activations,
+ * the loop's timing (how late the tick woke up and how long its work
+ * took, in μs) and the voltages of the given cells, such as 0-3+12, or
+ * of all of them; with no groups given it sends everything. Every
+ * TELEMETRY_LAYOUT_EVERY frames, and before the first, a layout
+ * datagram names the values so a subscriber can start at any time.
+ *
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "libneurobot.h"
+
+
+#define TELEMETRY_LAYOUT_EVERY 256
+
+/* The groups of values, in the order they're sent. */
+enum {
+    TELEMETRY_ADC = 1, TELEMETRY_ACT = 2, TELEMETRY_TIME = 4,
+    TELEMETRY_V = 8, TELEMETRY_ALL = 15
+};
+
+bool g_telemetry = false;
+
+static int g_fd = -1;
+static struct sockaddr_storage g_addr;
+static socklen_t g_addr_len;
+static int g_every = 1;
+static unsigned g_groups = 0;
+static char *g_cells_spec = NULL;
+
+/* The cells whose voltages are sent, once the network is known. */
+static const struct network *g_net = NULL;
+static int *g_cells = NULL, g_n_cells = 0;
+
+/* This tick's values so far. */
+static float g_adc[4], g_act[4];
+
+static char *g_frame = NULL, *g_layout = NULL;
+static size_t g_layout_size = 0;
+static uint32_t g_seq = 0;
+static long g_sent = 0, g_dropped = 0;
+
+
+/* Parse one group of cells for -Y: CELL or FIRST-LAST, joined by +. */
+static void parse_cells(const char *spec, int n)
+{
+    g_cells = realloc(g_cells, (n ? n : 1) * sizeof *g_cells);
+    if (!g_cells) die("Couldn't allocate telemetry", NULL);
+    g_n_cells = 0;
+    if (!spec) {
+        for (int c = 0; c < n; c++) g_cells[g_n_cells++] = c;
+        return;
+    }
+
+    const char *p = spec;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p) die("Invalid telemetry cells", spec);
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) die("Invalid telemetry cells", spec);
+        }
+        if (first < 0 || last >= n || first > last)
+            die("Telemetry cells out of range", spec);
+        for (long c = first; c <= last && g_n_cells < n; c++)
+            g_cells[g_n_cells++] = c;
+        if (*end == '+') end++;
+        else if (*end) die("Invalid telemetry cells", spec);
+        p = end;
+    }
+}
+
+
+static void set_destination(const char *dest)
+{
+    memset(&g_addr, 0, sizeof g_addr);
+    char *end;
+    long port = strtol(dest, &end, 10);
+    if (*dest && !*end) {
+        if (port < 1 || port > 65535)
+            die("Invalid telemetry port", dest);
+        struct sockaddr_in *in = (struct sockaddr_in *)&g_addr;
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+        in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        g_addr_len = sizeof *in;
+    } else {
+        struct sockaddr_un *un = (struct sockaddr_un *)&g_addr;
+        if (strlen(dest) >= sizeof un->sun_path)
+            die("Telemetry socket path too long", dest);
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, dest);
+        g_addr_len = sizeof *un;
+    }
+
+    g_fd = socket(g_addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (g_fd < 0) die("Couldn't open telemetry socket", strerror(errno));
+
+    /*
+     * An unconnected UDP socket never hears that nobody's listening, so
+     * connect it, and the ICMP refusals come back as send errors. A Unix
+     * socket reports that anyway, and can't connect before its
+     * subscriber has started.
+     */
+    if (g_addr.ss_family == AF_INET && connect(g_fd,
+                (const struct sockaddr *)&g_addr, g_addr_len))
+        die("Couldn't connect telemetry socket", strerror(errno));
+}
+
+
+void open_telemetry(const char *spec)
+{
+    char *copy = strdup(spec);
+    if (!copy) die("Couldn't allocate telemetry", NULL);
+
+    char *save = NULL;
+    set_destination(strtok_r(copy, ",", &save));
+    for (char *opt; (opt = strtok_r(NULL, ",", &save)); ) {
+        if (!strncmp(opt, "every=", 6)) {
+            char *end;
+            g_every = strtol(opt + 6, &end, 10);
+            if (*end || g_every < 1)
+                die("Invalid telemetry decimation", opt);
+        } else if (!strcmp(opt, "adc")) {
+            g_groups |= TELEMETRY_ADC;
+        } else if (!strcmp(opt, "act")) {
+            g_groups |= TELEMETRY_ACT;
+        } else if (!strcmp(opt, "time")) {
+            g_groups |= TELEMETRY_TIME;
+        } else if (!strcmp(opt, "v")) {
+            g_groups |= TELEMETRY_V;
+        } else if (!strncmp(opt, "v=", 2)) {
+            g_groups |= TELEMETRY_V;
+            g_cells_spec = strdup(opt + 2);
+        } else die("Invalid telemetry option", opt);
+    }
+    if (!g_groups) g_groups = TELEMETRY_ALL;
+    free(copy);
+    g_telemetry = true;
+}
+
+
+/* How many values go in each frame. */
+static int n_values()
+{
+    return (g_groups & TELEMETRY_ADC ? 4 : 0)
+        + (g_groups & TELEMETRY_ACT ? 4 : 0)
+        + (g_groups & TELEMETRY_TIME ? 2 : 0)
+        + (g_groups & TELEMETRY_V ? g_n_cells : 0);
+}
+
+
+/* Append a column name to the layout being built. */
+static void add_name(size_t *len, const char *fmt, int k)
+{
+    char name[32];
+    int n = snprintf(name, sizeof name, fmt, k);
+    g_layout = realloc(g_layout, sizeof(struct telemetry_header)
+            + *len + n + 2);
+    if (!g_layout) die("Couldn't allocate telemetry", NULL);
+    char *names = g_layout + sizeof(struct telemetry_header);
+    if (*len) names[(*len)++] = ',';
+    memcpy(names + *len, name, n + 1);
+    *len += n;
+}
+
+
+/*
+ * Lay the frames out for the given network, or none, and allocate them
+ * now rather than in the loop. Controllers get here through
+ * start_network() or start_pool(), before the loop; until then nothing
+ * is sent.
+ */
+void telemetry_network(const struct network *net)
+{
+    if (!g_telemetry) return;
+    g_net = net;
+    if (g_groups & TELEMETRY_V) parse_cells(g_cells_spec, net ? net->n : 0);
+
+    size_t len = 0;
+    g_layout = realloc(g_layout, sizeof(struct telemetry_header) + 1);
+    if (!g_layout) die("Couldn't allocate telemetry", NULL);
+    for (int k = 0; g_groups & TELEMETRY_ADC && k < 4; k++)
+        add_name(&len, "A%d", k);
+    for (int k = 0; g_groups & TELEMETRY_ACT && k < 4; k++)
+        add_name(&len, "M%d", k);
+    if (g_groups & TELEMETRY_TIME) {
+        add_name(&len, "late_us", 0);
+        add_name(&len, "busy_us", 0);
+    }
+    for (int k = 0; g_groups & TELEMETRY_V && k < g_n_cells; k++)
+        add_name(&len, "V%d", g_cells[k]);
+    g_layout_size = sizeof(struct telemetry_header) + len;
+
+    struct telemetry_header *h = (struct telemetry_header *)g_layout;
+    *h = (struct telemetry_header){
+        .magic = TELEMETRY_LAYOUT_MAGIC, .n_values = n_values(),
+        .dt_us = g_dt_us
+    };
+
+    size_t frame_size = sizeof *h + n_values() * sizeof(float);
+    if (frame_size > TELEMETRY_MAX_FRAME)
+        die("Too many telemetry values for one datagram", NULL);
+    free(g_frame);
+    g_frame = calloc(1, frame_size);
+    if (!g_frame) die("Couldn't allocate telemetry", NULL);
+}
+
+
+void telemetry_adc(int channel, float value)
+{
+    if (channel < 4) g_adc[channel] = value;
+}
+
+
+void telemetry_actuator(size_t i, float activation)
+{
+    if (i < 4) g_act[i] = activation > 1 ? 1 : activation < -1 ? -1
+        : activation;
+}
+
+
+static void send_datagram(const void *data, size_t size)
+{
+    bool connected = g_addr.ss_family == AF_INET;
+    if (sendto(g_fd, data, size, MSG_DONTWAIT,
+                connected ? NULL : (const struct sockaddr *)&g_addr,
+                connected ? 0 : g_addr_len) >= 0) {
+        g_sent++;
+        return;
+    }
+    /* A refusal is for an earlier datagram, which went nowhere either. */
+    if (errno == ECONNREFUSED && g_sent) {
+        g_sent--;
+        g_dropped++;
+    }
+    g_dropped++;
+}
+
+
+/*
+ * The end of a tick's work, with how late it started and how long the
+ * work took: send a frame if one is due.
+ */
+void send_telemetry(uint64_t late_ns, uint64_t busy_ns)
+{
+    long tick = g_num_dts / g_io_steps;
+    if (tick % g_every || !g_frame) return;
+
+    if (g_seq % TELEMETRY_LAYOUT_EVERY == 0) {
+        struct telemetry_header *h = (struct telemetry_header *)g_layout;
+        h->seq = g_seq;
+        h->step = g_num_dts;
+        send_datagram(g_layout, g_layout_size);
+    }
+
+    struct telemetry_header *h = (struct telemetry_header *)g_frame;
+    h->magic = TELEMETRY_MAGIC;
+    h->seq = g_seq++;
+    h->step = g_num_dts;
+    h->n_values = n_values();
+    h->dt_us = g_dt_us;
+
+    float *value = (float *)(h + 1);
+    if (g_groups & TELEMETRY_ADC)
+        for (int k = 0; k < 4; k++) *value++ = g_adc[k];
+    if (g_groups & TELEMETRY_ACT)
+        for (int k = 0; k < 4; k++) *value++ = g_act[k];
+    if (g_groups & TELEMETRY_TIME) {
+        *value++ = (float)late_ns / NS_PER_US;
+        *value++ = (float)busy_ns / NS_PER_US;
+    }
+    for (int k = 0; g_groups & TELEMETRY_V && k < g_n_cells; k++) {
+        int c = g_cells[k];
+        float v = g_net->v[c];
+        *value++ = v > g_net->vp[c] ? g_net->vp[c] : v;
+    }
+    send_datagram(g_frame, (char *)value - g_frame);
+}
+
+
+void close_telemetry()
+{
+    if (!g_telemetry) return;
+    fprintf(stderr, "Telemetry: %ld datagrams sent, %ld dropped.\n",
+            g_sent, g_dropped);
+    close(g_fd);
+    g_telemetry = false;
+}
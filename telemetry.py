@@ -0,0 +1,126 @@
+"""
+Reference subscriber for the controllers' telemetry (-Y; see
+telemetry.c). It listens on a UDP port on localhost or a Unix datagram
+socket, the same DEST the controller was given, and writes the frames
+out as CSV, or with --plot draws the chosen columns live:
+
+    ./forwards -Y 9000,every=10,adc,v=12-15 &
+    python3 telemetry.py 9000 > run.csv
+    python3 telemetry.py 9000 --plot V12,V13,A0
+
+Frames that arrive before the first layout datagram are skipped, since
+there's no telling what's in them; the controller sends a layout every
+256 frames. Gaps in the sequence numbers, meaning frames dropped at
+either end, are counted and reported at the end.
+"""
+import argparse
+import os
+import socket
+import struct
+import sys
+
+TELEMETRY_MAGIC = 0x4d54424e
+TELEMETRY_LAYOUT_MAGIC = 0x4c54424e
+HEADER = struct.Struct('<IIqII')
+MAX_DATAGRAM = 65536
+
+# Filled in by frames() as it goes.
+stats = {'lost': 0}
+
+
+def open_socket(dest):
+    """Bind to DEST: a port number on localhost or a socket path."""
+    if dest.isdigit():
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sock.bind(('127.0.0.1', int(dest)))
+    else:
+        if os.path.exists(dest):
+            os.unlink(dest)
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+        sock.bind(dest)
+    return sock
+
+
+def frames(sock):
+    """
+    Yield (names, step, dt_us, values) for each frame, once a layout
+    says what the values are, and count the frames that went missing
+    in stats['lost'].
+    """
+    names = None
+    expected = None
+    while True:
+        data = sock.recv(MAX_DATAGRAM)
+        if len(data) < HEADER.size:
+            continue
+        magic, seq, step, n_values, dt_us = HEADER.unpack_from(data)
+        if magic == TELEMETRY_LAYOUT_MAGIC:
+            names = data[HEADER.size:].decode().split(',')
+            if len(names) != n_values:
+                names = None
+            continue
+        if magic != TELEMETRY_MAGIC or names is None \
+                or n_values != len(names):
+            continue
+
+        if expected is not None and seq > expected:
+            stats['lost'] += seq - expected
+        expected = seq + 1
+        values = struct.unpack_from(f'<{n_values}f', data, HEADER.size)
+        yield names, step, dt_us, values
+
+
+def write_csv(sock, out):
+    header = None
+    for names, step, dt_us, values in frames(sock):
+        if names != header:
+            header = names
+            out.write('t,' + ','.join(names) + '\n')
+        t = step * dt_us / 1000
+        out.write(f'{t:f}, ' + ', '.join(f'{v:f}' for v in values) + '\n')
+
+
+def plot(sock, columns, window):
+    import matplotlib.pyplot as plt
+    from collections import deque
+
+    plt.ion()
+    fig, ax = plt.subplots()
+    lines, ts, ys = {}, deque(maxlen=window), {}
+    for n, (names, step, dt_us, values) in enumerate(frames(sock)):
+        row = dict(zip(names, values))
+        ts.append(step * dt_us / 1000)
+        for c in columns:
+            ys.setdefault(c, deque(maxlen=window)).append(row.get(c, 0))
+            if c not in lines:
+                lines[c], = ax.plot([], [], label=c)
+                ax.legend(loc='upper left')
+        if n % 20 == 0:
+            for c in columns:
+                lines[c].set_data(ts, ys[c])
+            ax.relim()
+            ax.autoscale_view()
+            plt.pause(0.001)
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(
+            description='Receive telemetry from a controller run with -Y.')
+    parser.add_argument('dest', help='UDP port on localhost or socket path')
+    parser.add_argument('--plot', metavar='COLUMNS',
+            help='plot these comma-separated columns live instead')
+    parser.add_argument('--window', type=int, default=2000,
+            help='frames shown at once when plotting')
+    args = parser.parse_args()
+
+    sock = open_socket(args.dest)
+    try:
+        if args.plot:
+            plot(sock, args.plot.split(','), args.window)
+        else:
+            write_csv(sock, sys.stdout)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        print(f'{stats["lost"]} frames lost.', file=sys.stderr)
+        if not args.dest.isdigit():
+            os.unlink(args.dest)
@@ -0,0 +1,271 @@
+/*
+ *
+ * trace.c
+ *
+ * Recording a run's sensor input so it can be replayed later (see
+ * struct trace_file_header). With -W, every step's ADC readings and
+ * any key events, such as backwards' reversal, go to a trace file;
+ * with -X, a controller takes its readings and events from one instead
+ * and runs flat out rather than in real time, so a run from the robot
+ * can be rerun, profiled or bisected on any machine in seconds.
+ *
+ * Readings are stored in 16 bits, which is exact for single samples
+ * and within a sixteenth of an LSB for -F averages; the recording run
+ * uses the stored values itself, so a replay of the same controller
+ * with the same options goes exactly the same way. Frames are handed
+ * off to a writer thread in chunks so the loop never waits on the disk.
+ *
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libneurobot.h"
+
+
+/* Frames per chunk handed to the writer: about 4s at the defaults. */
+#define TRACE_CHUNK_FRAMES 8192
+
+/* Largest stored reading, 4095/4096, so a sample can't be an event. */
+#define TRACE_MAX_READING 0xfff0
+
+bool g_recording = false, g_replaying = false;
+
+/*
+ * This step's readings, the events it has seen as a bitmask, and when
+ * replaying, how many missed ticks the next tick catches up on.
+ */
+static struct trace_frame g_frame;
+static uint32_t g_events;
+static int g_catchup;
+
+/* Recording: two chunks, one filling while the writer drains the other. */
+static FILE *g_trace_file;
+static struct trace_frame g_chunks[2][TRACE_CHUNK_FRAMES];
+static int g_chunk, g_chunk_frames, g_ready_frames;
+static sem_t g_chunk_free, g_chunk_ready;
+static pthread_t g_trace_thread;
+
+/* Replaying: the mapped file and the next frame to read. */
+static void *g_trace_map;
+static size_t g_trace_map_size;
+static const struct trace_frame *g_next_frame, *g_end_frame;
+
+
+static void *trace_writer(void *arg)
+{
+    (void)arg;
+    demote_thread();
+
+    for (int chunk = 0;; chunk = !chunk) {
+        sem_wait(&g_chunk_ready);
+        int n = g_ready_frames;
+        if (n && fwrite(g_chunks[chunk], sizeof **g_chunks, n, g_trace_file)
+                != (size_t)n)
+            perror("Couldn't write trace");
+        sem_post(&g_chunk_free);
+        if (n < TRACE_CHUNK_FRAMES) return NULL;
+    }
+}
+
+
+/* Hand the filling chunk to the writer; a short one is the last. */
+static void hand_off_chunk()
+{
+    sem_wait(&g_chunk_free);
+    g_ready_frames = g_chunk_frames;
+    sem_post(&g_chunk_ready);
+    g_chunk = !g_chunk;
+    g_chunk_frames = 0;
+}
+
+
+static void put_frame(const struct trace_frame *frame)
+{
+    g_chunks[g_chunk][g_chunk_frames++] = *frame;
+    if (g_chunk_frames == TRACE_CHUNK_FRAMES) hand_off_chunk();
+}
+
+
+void record_trace(const char *path)
+{
+    if (g_replaying) die("Can't record a trace while replaying one", NULL);
+    g_trace_file = fopen(path, "wb");
+    if (!g_trace_file) die("Couldn't open trace file", path);
+    g_recording = true;
+}
+
+
+/*
+ * Map the trace and take the timestep, steps per tick and catching up
+ * from it; a -d, -M or -V after -X that disagrees is caught in
+ * start_trace(). Likewise a later -O overrides the blocking log.
+ */
+void replay_trace(const char *path)
+{
+    if (g_recording) die("Can't record a trace while replaying one", NULL);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) die("Couldn't open trace file", path);
+    struct stat st;
+    if (fstat(fd, &st)) die("Couldn't stat trace file", path);
+    if ((size_t)st.st_size < sizeof(struct trace_file_header))
+        die("Not a trace file", path);
+    g_trace_map_size = st.st_size;
+    g_trace_map = mmap(NULL, g_trace_map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (g_trace_map == MAP_FAILED) die("Couldn't map trace file", path);
+
+    const struct trace_file_header *h = g_trace_map;
+    if (h->magic != TRACE_MAGIC) die("Not a trace file", path);
+    if (h->version != TRACE_VERSION)
+        die("Unsupported trace file version", path);
+    if (h->n_channels != TRACE_CHANNELS) die("Corrupt trace file", path);
+
+    g_dt_us = h->dt_us;
+    g_io_steps = h->io_steps;
+    if (h->catchup_ticks) {
+        char policy[32];
+        snprintf(policy, sizeof policy, "catchup=%u", h->catchup_ticks);
+        set_overrun_policy(policy);
+    }
+    set_log_overflow(LOG_BLOCK);
+    g_next_frame = (const struct trace_frame *)(h + 1);
+    g_end_frame = g_next_frame + (g_trace_map_size - sizeof *h)
+        / sizeof *g_next_frame;
+    g_replaying = true;
+}
+
+
+/*
+ * Read the next step's events and readings from the replayed trace,
+ * or finish the run if it's over.
+ */
+static void replay_frame()
+{
+    g_events = 0;
+    g_catchup = 0;
+    for (; g_next_frame < g_end_frame; g_next_frame++) {
+        if (g_next_frame->sample[0] != TRACE_EVENT_MARK) {
+            g_frame = *g_next_frame++;
+            return;
+        }
+        if (g_next_frame->sample[1] == EVENT_CATCHUP)
+            g_catchup = g_next_frame->sample[2];
+        else if (g_next_frame->sample[1] < N_TRACE_EVENTS)
+            g_events |= 1u << g_next_frame->sample[1];
+    }
+    if (!g_please_die_kthxbai) fprintf(stderr, "End of trace.\n");
+    g_please_die_kthxbai = true;
+}
+
+
+/* Called from setup(), once the timestep is settled. */
+void start_trace()
+{
+    if (g_replaying) {
+        const struct trace_file_header *h = g_trace_map;
+        if ((uint32_t)g_dt_us != h->dt_us
+                || (uint32_t)g_io_steps != h->io_steps)
+            die("Trace was recorded with a different timestep", NULL);
+        if (max_tick_steps() < (int)(1 + h->catchup_ticks) * g_io_steps)
+            die("Trace was recorded catching up on more ticks", NULL);
+        replay_frame();
+    } else if (g_recording) {
+        struct trace_file_header header = {
+            .magic = TRACE_MAGIC, .version = TRACE_VERSION,
+            .dt_us = g_dt_us, .io_steps = g_io_steps,
+            .n_channels = TRACE_CHANNELS,
+            .catchup_ticks = max_tick_steps() / g_io_steps - 1
+        };
+        if (fwrite(&header, sizeof header, 1, g_trace_file) != 1)
+            die("Couldn't write trace", NULL);
+        sem_init(&g_chunk_free, 0, 1);
+        sem_init(&g_chunk_ready, 0, 0);
+        if (pthread_create(&g_trace_thread, NULL, trace_writer, NULL))
+            die("Couldn't start trace writer", NULL);
+    }
+}
+
+
+/*
+ * A reading from the ADC as the loop should see it: the recorded one
+ * when replaying, and when recording the live one as it was stored.
+ */
+float trace_adc(int channel, float value)
+{
+    if (channel >= TRACE_CHANNELS) return value;
+    if (g_replaying) return g_frame.sample[channel] / 65536.f;
+
+    if (g_recording) {
+        float scaled = value * 65536.f + 0.5f;
+        uint16_t stored = scaled < 0 ? 0
+            : scaled > TRACE_MAX_READING ? TRACE_MAX_READING : scaled;
+        g_frame.sample[channel] = stored;
+        value = stored / 65536.f;
+    }
+    return value;
+}
+
+
+/*
+ * Whether an event happens this step: when replaying, whether it did in
+ * the recording, whatever the controller thinks; otherwise whether it
+ * does, which is recorded if so.
+ */
+bool trace_event(enum trace_event event, bool happens)
+{
+    if (g_replaying) return g_events & (1u << event);
+    if (happens) g_events |= 1u << event;
+    return happens;
+}
+
+
+/* The end of a tick: store its frame, or fetch the next one. */
+void trace_step()
+{
+    if (g_replaying) {
+        replay_frame();
+    } else if (g_recording) {
+        for (int e = 0; e < N_TRACE_EVENTS; e++) {
+            if (!(g_events & (1u << e))) continue;
+            struct trace_frame mark = {{TRACE_EVENT_MARK, e}};
+            put_frame(&mark);
+        }
+        g_events = 0;
+        put_frame(&g_frame);
+    }
+}
+
+
+/*
+ * How many missed ticks' steps the next tick catches up on: when
+ * replaying, as many as it did in the recording; otherwise the number
+ * given, which is recorded after this tick's frame if it's any.
+ */
+int trace_catchup(int ticks)
+{
+    if (g_replaying) return g_catchup;
+    if (g_recording && ticks) {
+        struct trace_frame mark = {{TRACE_EVENT_MARK, EVENT_CATCHUP, ticks}};
+        put_frame(&mark);
+    }
+    return ticks;
+}
+
+
+void close_trace()
+{
+    if (g_recording && g_trace_file) {
+        hand_off_chunk();
+        pthread_join(g_trace_thread, NULL);
+        fclose(g_trace_file);
+        g_trace_file = NULL;
+    } else if (g_replaying && g_trace_map) {
+        munmap(g_trace_map, g_trace_map_size);
+        g_trace_map = NULL;
+    }
+}
@@ -0,0 +1,175 @@
+/*
+ *
+ * tune.c
+ *
+ * Watch and retune a controller running with -K NAME through its
+ * control plane (see control.c), without stopping it:
+ *
+ *     tune NAME                    the loop's state and parameters
+ *     tune -c NAME                 and every cell's v, u, i and j
+ *     tune -w MS NAME              again every MS until interrupted
+ *     tune NAME feedback=30 ...    change parameters
+ *
+ * New parameters all take effect together at the end of a tick, and
+ * tune waits to see the loop take them up.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/mman.h>
+
+#include "libneurobot.h"
+
+
+/* How long to wait for the loop to take up new parameters. */
+#define TUNE_APPLY_TIMEOUT_MS 1000
+
+static const char *const g_param_names[] = CONTROL_PARAM_NAMES;
+
+
+/* Same as die(), but this doesn't link against the rest of libneurobot. */
+static void fail(const char *message, const char *arg)
+{
+    if (arg) fprintf(stderr, "%s: %s\n", message, arg);
+    else fprintf(stderr, "%s :(\n", message);
+    exit(1);
+}
+
+
+static struct control_block *open_block(const char *name)
+{
+    char path[256];
+    snprintf(path, sizeof path, "%s%s", name[0] == '/' ? "" : "/", name);
+    int fd = shm_open(path, O_RDWR, 0);
+    if (fd < 0) fail("No controller running with that name", name);
+    struct control_block *b = mmap(NULL, sizeof *b, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    close(fd);
+    if (b == MAP_FAILED) fail("Couldn't map control plane", strerror(errno));
+
+    if (__atomic_load_n(&b->magic, __ATOMIC_ACQUIRE) != CONTROL_MAGIC)
+        fail("Controller hasn't started yet", name);
+    if (b->version != CONTROL_VERSION)
+        fail("Unsupported control plane version", name);
+    return b;
+}
+
+
+static void print_state(struct control_block *b, bool cells)
+{
+    static struct control_snapshot s;
+    float params[N_CONTROL_PARAMS];
+    seqlock_read(&b->snapshot_seq, &b->snapshot, &s, sizeof s);
+    seqlock_read(&b->params_seq, b->params, params, sizeof params);
+
+    printf("pid %d: step %lld, %.3fs, %lld overruns, "
+            "last tick %.1fμs late and %.1fμs busy\n",
+            b->pid, (long long)s.step, (double)s.elapsed_ns / NS_PER_SEC,
+            (long long)s.overruns, s.late_us, s.busy_us);
+    for (int p = 0; p < N_CONTROL_PARAMS; p++)
+        if (b->bound & (1u << p))
+            printf("  %s = %g\n", g_param_names[p], params[p]);
+
+    if (!cells) return;
+    printf("cell,v,u,i,j\n");
+    for (uint32_t c = 0; c < s.n_cells && c < CONTROL_MAX_CELLS; c++)
+        printf("%u, %f, %f, %f, %f\n", c, s.v[c], s.u[c], s.i[c], s.j[c]);
+}
+
+
+static enum control_param find_param(struct control_block *b,
+        const char *name, size_t len)
+{
+    for (int p = 0; p < N_CONTROL_PARAMS; p++)
+        if (strlen(g_param_names[p]) == len
+                && !strncmp(g_param_names[p], name, len)) {
+            if (!(b->bound & (1u << p)))
+                fail("This controller doesn't have that parameter", name);
+            return p;
+        }
+    fail("Unknown parameter", name);
+    return N_CONTROL_PARAMS;
+}
+
+
+/*
+ * Take the write side of the parameters from any other tool, change
+ * them in place and let the loop have them.
+ */
+static void set_params(struct control_block *b, char **settings, int n)
+{
+    float params[N_CONTROL_PARAMS];
+    memcpy(params, b->params, sizeof params);
+    bool changed[N_CONTROL_PARAMS] = {false};
+    for (int k = 0; k < n; k++) {
+        char *eq = strchr(settings[k], '='), *end;
+        if (!eq) fail("Expected PARAM=VALUE", settings[k]);
+        enum control_param p = find_param(b, settings[k], eq - settings[k]);
+        params[p] = strtod(eq + 1, &end);
+        if (*end || end == eq + 1) fail("Invalid value", settings[k]);
+        if ((p == CONTROL_PWM_MAX && (params[p] < 0 || params[p] > 100))
+                || (p == CONTROL_CONDUCTANCE && params[p] < 0))
+            fail("Value out of range", settings[k]);
+        changed[p] = true;
+    }
+
+    uint32_t seq;
+    for (;;) {
+        seq = __atomic_load_n(&b->params_seq, __ATOMIC_ACQUIRE);
+        if (!(seq & 1) && __atomic_compare_exchange_n(&b->params_seq,
+                    &seq, seq + 1, false, __ATOMIC_ACQ_REL,
+                    __ATOMIC_RELAXED))
+            break;
+        usleep(100);
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (int p = 0; p < N_CONTROL_PARAMS; p++)
+        if (changed[p]) b->params[p] = params[p];
+    seqlock_write_end(&b->params_seq);
+
+    /* The loop reports which parameters it's running with. */
+    for (int ms = 0; ms < TUNE_APPLY_TIMEOUT_MS; ms++) {
+        struct control_snapshot s;
+        seqlock_read(&b->snapshot_seq, &b->snapshot, &s,
+                offsetof(struct control_snapshot, v));
+        if ((int32_t)(s.params_seq - (seq + 2)) >= 0) {
+            printf("Applied at step %lld.\n", (long long)s.step);
+            return;
+        }
+        usleep(US_PER_MS);
+    }
+    fail("Controller hasn't taken up the new parameters", NULL);
+}
+
+
+int main(int argc, char **argv)
+{
+    bool cells = false;
+    int watch_ms = 0;
+    int opt;
+    char *endptr;
+    while ((opt = getopt(argc, argv, "cw:")) != -1) {
+        if (opt == 'c') {
+            cells = true;
+        } else if (opt == 'w') {
+            watch_ms = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || watch_ms < 1)
+                fail("Invalid watch interval", optarg);
+        } else fail("Usage: tune [-c] [-w MS] NAME [PARAM=VALUE...]", NULL);
+    }
+    if (optind >= argc)
+        fail("Usage: tune [-c] [-w MS] NAME [PARAM=VALUE...]", NULL);
+
+    struct control_block *b = open_block(argv[optind]);
+    if (optind + 1 < argc) {
+        set_params(b, argv + optind + 1, argc - optind - 1);
+        return 0;
+    }
+
+    do {
+        print_state(b, cells);
+        fflush(stdout);
+    } while (watch_ms && !usleep(watch_ms * US_PER_MS));
+}